@@ -0,0 +1,260 @@
+#include "rt.h"
+
+//one entry point for every acceleration structure, so the lab and the renderer
+//can swap them freely. faces stay where they are, structures only hold indices.
+
+double wall_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+const char *accel_name(int type)
+{
+	if (type == ACCEL_KD)
+		return "kd-tree";
+	if (type == ACCEL_GRID)
+		return "grid";
+	return "sbvh";
+}
+
+static void build_sbvh(Scene *scene, Accel *accel)
+{
+	//LL is best for this bvh. link the faces in place so leaves can refer back to them by index
+	Face *face_list = NULL;
+	for (int i = 0; i < scene->face_count; i++)
+	{
+		scene->faces[i].next = face_list;
+		face_list = &scene->faces[i];
+	}
+
+	int box_count, ref_count;
+	AABB *tree = sbvh(face_list, &box_count, &ref_count);
+	printf("finished with %d boxes\n", box_count);
+
+	scene->bins = tree;
+	scene->bin_count = box_count;
+	scene->ref_count = ref_count;
+	printf("about to flatten\n");
+	flatten_faces(scene);
+
+	accel->nodes = flatten_bvh(scene);
+	accel->node_count = box_count;
+	accel->node_size = box_count * sizeof(gpu_bin);
+	accel->refs = scene->refs;
+	accel->ref_count = scene->ref_count;
+	accel->depth = bins_depth(accel->nodes, accel->node_count);
+}
+
+Accel *build_accel(Scene *scene, int type)
+{
+	Accel *accel = calloc(1, sizeof(Accel));
+	accel->type = type;
+
+	double start = wall_clock();
+	if (type == ACCEL_KD)
+	{
+		accel->nodes = kd_build(scene->faces, scene->face_count, &accel->node_count, &accel->refs, &accel->ref_count);
+		accel->node_size = accel->node_count * sizeof(gpu_kd_node);
+	}
+	else if (type == ACCEL_GRID)
+	{
+		accel->nodes = grid_build(scene->faces, scene->face_count, &accel->node_size, &accel->refs, &accel->ref_count);
+		accel->node_count = ((gpu_grid *)accel->nodes)->top_count + ((gpu_grid *)accel->nodes)->cell_count;
+	}
+	else
+		build_sbvh(scene, accel);
+	accel->build_time = wall_clock() - start;
+
+	printf("%s built in %.3f seconds, %.2f MB\n", accel_name(type), accel->build_time,
+		(float)(accel->node_size + accel->ref_count * sizeof(cl_int)) / (1024.0f * 1024.0f));
+	return accel;
+}
+
+int bins_depth(gpu_bin *bins, int node_count)
+{
+	//edges from the root down to the deepest leaf. walked with an explicit stack, sbvh depth isn't bounded
+	int *node = malloc(node_count * sizeof(int));
+	int *level = malloc(node_count * sizeof(int));
+	int s_i = 0;
+	int deepest = 0;
+	node[s_i] = 0;
+	level[s_i++] = 0;
+	while (s_i)
+	{
+		s_i--;
+		gpu_bin b = bins[node[s_i]];
+		int d = level[s_i];
+		deepest = d > deepest ? d : deepest;
+		if (b.rind < 0)
+			continue;
+		node[s_i] = b.lind & BIN_IND_MASK;
+		level[s_i++] = d + 1;
+		node[s_i] = b.rind;
+		level[s_i++] = d + 1;
+	}
+	free(node);
+	free(level);
+	return deepest;
+}
+
+void free_accel(Accel *accel)
+{
+	free(accel->nodes);
+	free(accel->refs);
+	free(accel->quant);
+	free(accel);
+}
+
+int bvh_stack_size(int depth)
+{
+	//a stack traversal holds at most one pending node per level below the one it's at, plus one
+	//(the sentinel in the pair walk), so depth + 2 never overflows
+	return depth + 2 > BVH_STACK_MIN ? depth + 2 : BVH_STACK_MIN;
+}
+
+static void pair_child(gpu_bin *bins, int c, int *slot, float *lo, float *hi, cl_int *ind, cl_int *count)
+{
+	lo[0] = bins[c].minx;
+	lo[1] = bins[c].miny;
+	lo[2] = bins[c].minz;
+	hi[0] = bins[c].maxx;
+	hi[1] = bins[c].maxy;
+	hi[2] = bins[c].maxz;
+	*ind = bins[c].rind < 0 ? ~(-bins[c].lind) : slot[c];
+	*count = bins[c].rind < 0 ? -bins[c].rind : 0;
+}
+
+void pair_accel(Accel *accel)
+{
+	//gpu_bins -> child-pair nodes for -pairs. inner bins become pair nodes in depth first order, left
+	//first, so a left inner child is the next node. a root that's a leaf is paired with itself, empty
+	gpu_bin *bins = accel->nodes;
+	int *slot = malloc(accel->node_count * sizeof(int));
+	int *order = malloc(accel->node_count * sizeof(int));
+	int *stack = malloc(accel->node_count * sizeof(int));
+	int count = 0;
+	int s_i = 0;
+	stack[s_i++] = 0;
+	while (s_i)
+	{
+		int b = stack[--s_i];
+		if (bins[b].rind < 0)
+			continue;
+		slot[b] = count;
+		order[count++] = b;
+		stack[s_i++] = bins[b].rind;
+		stack[s_i++] = bins[b].lind & BIN_IND_MASK;
+	}
+
+	gpu_pair_node *pairs = calloc(count ? count : 1, sizeof(gpu_pair_node));
+	for (int i = 0; i < count; i++)
+	{
+		gpu_pair_node *p = &pairs[i];
+		float lo[3], hi[3];
+		pair_child(bins, bins[order[i]].lind & BIN_IND_MASK, slot, lo, hi, &p->left, &p->lcount);
+		p->lminx = lo[0];
+		p->lmaxx = hi[0];
+		p->lminy = lo[1];
+		p->lmaxy = hi[1];
+		p->lminz = lo[2];
+		p->lmaxz = hi[2];
+		pair_child(bins, bins[order[i]].rind, slot, lo, hi, &p->right, &p->rcount);
+		p->rminx = lo[0];
+		p->rmaxx = hi[0];
+		p->rminy = lo[1];
+		p->rmaxy = hi[1];
+		p->rminz = lo[2];
+		p->rmaxz = hi[2];
+	}
+	if (!count)
+	{
+		float lo[3], hi[3];
+		pair_child(bins, 0, slot, lo, hi, &pairs[0].left, &pairs[0].lcount);
+		pairs[0] = (gpu_pair_node){lo[0], hi[0], lo[1], hi[1], lo[0], hi[0], lo[1], hi[1], lo[2], hi[2], lo[2], hi[2], pairs[0].left, pairs[0].left, pairs[0].lcount, 0};
+		count = 1;
+	}
+	free(slot);
+	free(order);
+	free(stack);
+
+	printf("child-pair nodes: %d instead of %d bins, %.2f MB\n", count, accel->node_count, (float)(count * sizeof(gpu_pair_node)) / (1024.0f * 1024.0f));
+	free(accel->nodes);
+	accel->nodes = pairs;
+	accel->node_count = count;
+	accel->node_size = count * sizeof(gpu_pair_node);
+}
+
+static int leaf_units(int count)
+{
+	//a leaf node plus its records, 3 float4s each, in 32 byte gpu_bin units
+	return 1 + (3 * count + 1) / 2;
+}
+
+cl_float4 *inline_blob(Scene *scene, gpu_bin *bins, cl_int *refs, int node_count, size_t *size)
+{
+	//gpu_bins renumbered depth first, left first, with every leaf's triangles right after it: per
+	//reference v0 with the I entry's bits in w, v1, v2. a leaf's lind is then minus its first record
+	//in float4s and rind stays minus the count, inner nodes keep their axis and flip bits
+	int *slot = malloc(node_count * sizeof(int));
+	int *stack = malloc(node_count * sizeof(int));
+	int units = 0;
+	int s_i = 0;
+	stack[s_i++] = 0;
+	while (s_i)
+	{
+		int b = stack[--s_i];
+		slot[b] = units;
+		if (bins[b].rind < 0)
+		{
+			units += leaf_units(-bins[b].rind);
+			continue;
+		}
+		units++;
+		stack[s_i++] = bins[b].rind;
+		stack[s_i++] = bins[b].lind & BIN_IND_MASK;
+	}
+
+	cl_float4 *blob = calloc(units * 2, sizeof(cl_float4));
+	for (int b = 0; b < node_count; b++)
+	{
+		gpu_bin n = bins[b];
+		if (n.rind >= 0)
+		{
+			n.lind = (n.lind & ~BIN_IND_MASK) | slot[n.lind & BIN_IND_MASK];
+			n.rind = slot[n.rind];
+			memcpy(&blob[slot[b] * 2], &n, sizeof(gpu_bin));
+			continue;
+		}
+		cl_float4 *r = &blob[slot[b] * 2 + 2];
+		for (int i = 0; i < -n.rind; i++, r += 3)
+		{
+			int f = refs[-n.lind + i];
+			cl_int ref = scene->faces[f].alpha < 0 ? f : ALPHA_TEST | scene->faces[f].alpha;
+			for (int v = 0; v < 3; v++)
+				r[v] = (cl_float4){{scene->faces[f].verts[v].x, scene->faces[f].verts[v].y, scene->faces[f].verts[v].z, 0.0f}};
+			memcpy(&r[0].s[3], &ref, sizeof(cl_int));
+		}
+		n.lind = -(slot[b] * 2 + 2);
+		memcpy(&blob[slot[b] * 2], &n, sizeof(gpu_bin));
+	}
+	free(slot);
+	free(stack);
+	*size = units * sizeof(gpu_bin);
+	return blob;
+}
+
+void inline_accel(Scene *scene, Accel *accel)
+{
+	//-inline: one buffer, nodes and triangles interleaved (see inline_blob). W isn't read any more
+	size_t size;
+	cl_float4 *blob = inline_blob(scene, accel->nodes, accel->refs, accel->node_count, &size);
+	printf("inline leaves: %.2f MB of nodes and triangles instead of %.2f MB of nodes + %.2f MB of W\n",
+		(float)size / (1024.0f * 1024.0f), (float)accel->node_size / (1024.0f * 1024.0f),
+		(float)(scene->face_count * 9 * sizeof(cl_float)) / (1024.0f * 1024.0f));
+	free(accel->nodes);
+	accel->nodes = blob;
+	accel->node_size = size;
+	accel->inlined = 1;
+}
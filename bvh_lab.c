@@ -13,9 +13,12 @@ typedef struct s_traversal
 	int insides_hit;
 	int tri_comps;
 	int tris_hit;
+	int restarts;
 
 	int max_tris;
 	int max_boxes;
+
+	Face *face; //closest hit so far, only check_tris sets it
 }			Traversal;
 
 typedef struct s_triangle
@@ -38,17 +41,15 @@ static int inside_box(Traversal *ray, AABB *box)
 	return 0;
 }
 
-static int intersect_box(Traversal *ray, AABB *box)
+static int clip_ray(Traversal *ray, cl_float3 min, cl_float3 max, float *t_in, float *t_out)
 {
-	ray->box_comps++;
-
-	float tx0 = (box->min.x - ray->origin.x) * ray->inv_dir.x;
-	float tx1 = (box->max.x - ray->origin.x) * ray->inv_dir.x;
+	float tx0 = (min.x - ray->origin.x) * ray->inv_dir.x;
+	float tx1 = (max.x - ray->origin.x) * ray->inv_dir.x;
 	float tmin = fmin(tx0, tx1);
 	float tmax = fmax(tx0, tx1);
 
-	float ty0 = (box->min.y - ray->origin.y) * ray->inv_dir.y;
-	float ty1 = (box->max.y - ray->origin.y) * ray->inv_dir.y;
+	float ty0 = (min.y - ray->origin.y) * ray->inv_dir.y;
+	float ty1 = (max.y - ray->origin.y) * ray->inv_dir.y;
 	float tymin = fmin(ty0, ty1);
 	float tymax = fmax(ty0, ty1);
 
@@ -59,8 +60,8 @@ static int intersect_box(Traversal *ray, AABB *box)
 	tmin = fmax(tymin, tmin);
 	tmax = fmin(tymax, tmax);
 
-	float tz0 = (box->min.z - ray->origin.z) * ray->inv_dir.z;
-	float tz1 = (box->max.z - ray->origin.z) * ray->inv_dir.z;
+	float tz0 = (min.z - ray->origin.z) * ray->inv_dir.z;
+	float tz1 = (max.z - ray->origin.z) * ray->inv_dir.z;
 	float tzmin = fmin(tz0, tz1);
 	float tzmax = fmax(tz0, tz1);
 
@@ -72,6 +73,18 @@ static int intersect_box(Traversal *ray, AABB *box)
 
 	if (tmin <= 0.0 && tmax <= 0.0)
 		return (0);
+	*t_in = tmin;
+	*t_out = tmax;
+	return (1);
+}
+
+static int intersect_box(Traversal *ray, AABB *box)
+{
+	float tmin, tmax;
+	ray->box_comps++;
+
+	if (!clip_ray(ray, box->min, box->max, &tmin, &tmax))
+		return (0);
 	if (tmin > ray->t)
 		return(0);
 	ray->boxes_hit++;
@@ -90,7 +103,7 @@ static int intersect_triangle(Traversal *ray, const cl_float3 v0, const cl_float
 	cl_float3 h = cross(ray->direction, e2);
 	float a = dot(h, e1);
 
-	if (fabs(a) < 0)
+	if (a == 0.0f) //parallel
 		return 0;
 	float f = 1.0f / a;
 	cl_float3 s = vec_sub(ray->origin, v0);
@@ -102,16 +115,110 @@ static int intersect_triangle(Traversal *ray, const cl_float3 v0, const cl_float
 	if (v < 0.0 || u + v > 1.0)
 		return 0;
 	t = f * dot(e2, q);
+	if (t > 0.0f && t < ray->t)
+		ray->t = t;
+	ray->tris_hit++;
+	return 1;
+}
+
+static float component(cl_float3 v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static int intersect_watertight(Traversal *ray, const cl_float3 v0, const cl_float3 v1, const cl_float3 v2)
+{
+	//the kernel's test (Woop, Benthin, Wald 2013). the kernel does the shear setup once per ray
+	ray->tri_comps++;
+
+	cl_float3 a = (cl_float3){fabs(ray->direction.x), fabs(ray->direction.y), fabs(ray->direction.z)};
+	int kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+	int kx = kz == 2 ? 0 : kz + 1;
+	int ky = kx == 2 ? 0 : kx + 1;
+	if (component(ray->direction, kz) < 0.0f)
+	{
+		int tmp = kx;
+		kx = ky;
+		ky = tmp;
+	}
+	float Sz = 1.0f / component(ray->direction, kz);
+	float Sx = component(ray->direction, kx) * Sz;
+	float Sy = component(ray->direction, ky) * Sz;
+
+	cl_float3 A = vec_sub(v0, ray->origin);
+	cl_float3 B = vec_sub(v1, ray->origin);
+	cl_float3 C = vec_sub(v2, ray->origin);
+	float Az = component(A, kz);
+	float Bz = component(B, kz);
+	float Cz = component(C, kz);
+	float Ax = component(A, kx) - Sx * Az;
+	float Ay = component(A, ky) - Sy * Az;
+	float Bx = component(B, kx) - Sx * Bz;
+	float By = component(B, ky) - Sy * Bz;
+	float Cx = component(C, kx) - Sx * Cz;
+	float Cy = component(C, ky) - Sy * Cz;
+
+	float U = Cx * By - Cy * Bx;
+	float V = Ax * Cy - Ay * Cx;
+	float W = Bx * Ay - By * Ax;
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+		return 0;
+	float det = U + V + W;
+	if (det == 0.0f)
+		return 0;
+	float t = (U * Az + V * Bz + W * Cz) * Sz / det;
+	if (t > 0.0f && t < ray->t)
+		ray->t = t;
+	ray->tris_hit++;
+	return 1;
+}
+
+static int intersect_sphere(Traversal *ray, Face *f)
+{
+	//same as the kernel's, closest approach first
+	ray->tri_comps++;
+	cl_float3 oc = vec_sub(ray->origin, f->verts[0]);
+	float b = dot(oc, ray->direction);
+	cl_float3 h = vec_sub(oc, vec_scale(ray->direction, b));
+	float disc = f->verts[1].x * f->verts[1].x - dot(h, h);
+	if (disc < 0.0f)
+		return 0;
+	float t = -b - sqrtf(disc);
+	if (t <= 0.0f)
+		t = -b + sqrtf(disc);
+	if (t <= 0.0f)
+		return 0;
 	if (t < ray->t)
 		ray->t = t;
 	ray->tris_hit++;
 	return 1;
 }
 
+static int intersect_face(Traversal *ray, Face *f)
+{
+	//a quad is its two halves, same split as the kernel's intersect_quad
+	if (f->shape == GPU_SPHERE)
+		return intersect_sphere(ray, f);
+	int hit = intersect_watertight(ray, f->verts[0], f->verts[1], f->verts[2]);
+	if (f->shape == GPU_QUAD)
+		hit |= intersect_watertight(ray, f->verts[0], f->verts[2], f->verts[3]);
+	return hit;
+}
+
 void check_tris(Traversal *ray, AABB *box)
 {
 	for (AABB *member = box->members; member; member = member->next)
-		intersect_triangle(ray, member->f->verts[0], member->f->verts[1], member->f->verts[2]);
+	{
+		float t = ray->t;
+		if (member->f->shape == GPU_SPHERE)
+			intersect_sphere(ray, member->f);
+		else
+			intersect_triangle(ray, member->f->verts[0], member->f->verts[1], member->f->verts[2]);
+		if (member->f->shape == GPU_QUAD)
+			intersect_triangle(ray, member->f->verts[0], member->f->verts[2], member->f->verts[3]);
+		if (ray->t < t)
+			ray->face = member->f;
+	}
 }
 
 static void push(AABB **stack, AABB *box)
@@ -159,6 +266,23 @@ float unit_rand()
 	return (float)rand() / (float)RAND_MAX;
 }
 
+static cl_float3 random_dir(void)
+{
+	float theta = 2 * M_PI * unit_rand();
+	float phi = acos(2 * unit_rand() - 1);
+
+	return (cl_float3){sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi)};
+}
+
+static cl_float3 seeded_dir(unsigned int *seed)
+{
+	//random_dir off the caller's own state, the global rand() sequence stays main's
+	float theta = 2 * M_PI * ((float)rand_r(seed) / (float)RAND_MAX);
+	float phi = acos(2 * ((float)rand_r(seed) / (float)RAND_MAX) - 1);
+
+	return (cl_float3){sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi)};
+}
+
 Traversal *random_ray(AABB *tree)
 {
 	Traversal *ray = calloc(1, sizeof(Traversal));
@@ -170,16 +294,13 @@ Traversal *random_ray(AABB *tree)
 								tree->min.y + ry * (tree->max.y - tree->min.y),
 								tree->min.z + rz * (tree->max.z - tree->min.z)};
 
-	float theta = 2 * M_PI * unit_rand();
-	float phi = acos(2 * unit_rand() - 1);
-
-	ray->direction = (cl_float3){	sin(phi) * cos(theta), sin(phi) * sin(theta), cos(phi)};
+	ray->direction = random_dir();
 	ray->inv_dir = (cl_float3){1.0f / ray->direction.x, 1.0f / ray->direction.y, 1.0f / ray->direction.z};
 
 	return ray;
 }
 
-void tally(Traversal *sum, Traversal *ray)
+static void add_counts(Traversal *sum, Traversal *ray)
 {
 	sum->box_comps += ray->box_comps;
 	sum->boxes_hit += ray->boxes_hit;
@@ -187,12 +308,17 @@ void tally(Traversal *sum, Traversal *ray)
 	sum->insides_hit += ray->insides_hit;
 	sum->tri_comps += ray->tri_comps;
 	sum->tris_hit += ray->tris_hit;
+	sum->restarts += ray->restarts;
 
 	if (ray->box_comps > sum->max_boxes)
 		sum->max_boxes = ray->box_comps;
 	if (ray->tri_comps > sum->max_tris)
 		sum->max_tris = ray->tri_comps;
+}
 
+void tally(Traversal *sum, Traversal *ray)
+{
+	add_counts(sum, ray);
 	free(ray);
 }
 
@@ -275,4 +401,860 @@ void study_tree(AABB *tree, int ray_count)
 	printf("%d rays complete\n", ray_count);
 	printf("%.2f box comparisons per ray avg, %d max\n", (float)sum->box_comps / (float)ray_count, sum->max_boxes);
 	printf("%.2f triangle comparisons per ray avg, %d max\n", (float)sum->tri_comps / (float)ray_count, sum->max_tris);
+}
+
+///////LAZY BUILD//////////
+
+#define LAZY_TOP_LEVELS 8
+#define TREE_STACK 256
+
+static AABB **grow_stack(AABB **stack, AABB **local, int *cap)
+{
+	//stacks start on the callers' frame, trees deeper than that move them to the heap
+	AABB **bigger = malloc(2 * *cap * sizeof(AABB *));
+	memcpy(bigger, stack, *cap * sizeof(AABB *));
+	if (stack != local)
+		free(stack);
+	*cap *= 2;
+	return bigger;
+}
+
+static void traverse_lazy(AABB *tree, Traversal *ray)
+{
+	//like traverse(), but with a private stack (other threads are in the tree) and
+	//pending nodes get built on the spot
+	AABB *local[TREE_STACK];
+	AABB **stack = local;
+	int cap = TREE_STACK;
+	int s_i = 0;
+	stack[s_i++] = tree;
+
+	while (s_i)
+	{
+		AABB *box = stack[--s_i];
+		if (!intersect_box(ray, box))
+			continue;
+		if (__atomic_load_n(&box->pending, __ATOMIC_ACQUIRE) != LAZY_DONE)
+			lazy_expand(box);
+		if (box->left)
+		{
+			if (s_i + 2 > cap)
+				stack = grow_stack(stack, local, &cap);
+			stack[s_i++] = box->left;
+			stack[s_i++] = box->right;
+		}
+		else
+			check_tris(ray, box);
+	}
+	if (stack != local)
+		free(stack);
+}
+
+static Face *link_faces(Scene *scene)
+{
+	Face *face_list = NULL;
+	for (int i = 0; i < scene->face_count; i++)
+	{
+		scene->faces[i].next = face_list;
+		face_list = &scene->faces[i];
+	}
+	return face_list;
+}
+
+void study_lazy(Scene *scene, int ray_count)
+{
+	printf("\n\n\nentering the lab, lazy sbvh on %d faces\n", scene->face_count);
+	int threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	threads = threads < 1 ? 1 : threads;
+
+	int box_count, ref_count;
+	double start = wall_clock();
+	AABB *full = sbvh(link_faces(scene), &box_count, &ref_count);
+	double full_time = wall_clock() - start;
+
+	start = wall_clock();
+	AABB *tree = sbvh_lazy(link_faces(scene), LAZY_TOP_LEVELS, threads);
+	double first_time = wall_clock() - start;
+
+	//"preview" on the main thread while the workers refine
+	Traversal *sum = calloc(1, sizeof(Traversal));
+	for (int i = 0; i < ray_count; i++)
+	{
+		Traversal *ray = random_ray(full);
+		ray->t = FLT_MAX;
+		traverse_lazy(tree, ray);
+		tally(sum, ray);
+	}
+	double preview_time = wall_clock() - start;
+
+	int lazy_boxes, lazy_refs;
+	int on_demand = lazy_finish(tree, &lazy_boxes, &lazy_refs);
+	double done_time = wall_clock() - start;
+
+	printf("full sbvh: %.3f seconds, %d boxes, %d refs\n", full_time, box_count, ref_count);
+	printf("lazy sbvh: first ray after %.3f seconds, %d preview rays done after %.3f, fully built after %.3f with %d workers\n",
+		first_time, ray_count, preview_time, done_time, threads);
+	printf("%d boxes, %d refs, %d subtrees expanded on demand by rays\n", lazy_boxes, lazy_refs, on_demand);
+	printf("%.2f box comparisons per ray avg, %.2f triangle comparisons\n", (float)sum->box_comps / (float)ray_count, (float)sum->tri_comps / (float)ray_count);
+	free(sum);
+}
+
+///////PROFILING//////////
+
+#define PROFILE_STRIDE 4 //profile every 4th pixel in x and y
+#define PROFILE_BOUNCES 2
+#define PROFILE_SEED 42
+
+static void clear_profile(AABB *box)
+{
+	box->visits = 0;
+	box->hits = 0;
+	if (box->left)
+	{
+		clear_profile(box->left);
+		clear_profile(box->right);
+	}
+}
+
+static void traverse_profiled(AABB *tree, Traversal *ray)
+{
+	//left is popped first, so with sbvh_order_by_profile the hot path goes first here too
+	AABB *local[TREE_STACK];
+	AABB **stack = local;
+	int cap = TREE_STACK;
+	int s_i = 0;
+	stack[s_i++] = tree;
+
+	while (s_i)
+	{
+		AABB *box = stack[--s_i];
+		box->visits++;
+		if (!intersect_box(ray, box))
+			continue;
+		box->hits++;
+		if (box->left)
+		{
+			if (s_i + 2 > cap)
+				stack = grow_stack(stack, local, &cap);
+			stack[s_i++] = box->right;
+			stack[s_i++] = box->left;
+		}
+		else
+			check_tris(ray, box);
+	}
+	if (stack != local)
+		free(stack);
+}
+
+static int profile_bvh(AABB *tree, t_camera cam, int xres, int yres, Traversal *sum)
+{
+	//camera rays like render_kernel shoots them, plus a couple of diffuse bounces.
+	//fixed seed so a rebuilt tree gets profiled with the same paths
+	unsigned int seed = PROFILE_SEED;
+	clear_profile(tree);
+	int ray_count = 0;
+	for (int y = 0; y < yres; y += PROFILE_STRIDE)
+		for (int x = 0; x < xres; x += PROFILE_STRIDE)
+		{
+			Traversal ray = {0};
+			ray.origin = cam.focus;
+			cl_float3 through = vec_add(cam.origin, vec_add(vec_scale(cam.d_x, x), vec_scale(cam.d_y, y)));
+			ray.direction = unit_vec(vec_sub(cam.focus, through));
+			for (int bounce = 0; bounce <= PROFILE_BOUNCES; bounce++)
+			{
+				ray.inv_dir = (cl_float3){1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+				ray.t = FLT_MAX;
+				ray.face = NULL;
+				traverse_profiled(tree, &ray);
+				ray_count++;
+				if (!ray.face)
+					break;
+				Face *f = ray.face;
+				cl_float3 hit = vec_add(ray.origin, vec_scale(ray.direction, ray.t));
+				cl_float3 N = f->shape == GPU_SPHERE ? unit_vec(vec_sub(hit, f->verts[0])) : unit_vec(cross(vec_sub(f->verts[1], f->verts[0]), vec_sub(f->verts[2], f->verts[0])));
+				if (dot(N, ray.direction) > 0.0f)
+					N = vec_scale(N, -1.0f);
+				ray.origin = vec_add(vec_add(ray.origin, vec_scale(ray.direction, ray.t)), vec_scale(N, 0.01f));
+				ray.direction = seeded_dir(&seed);
+				if (dot(N, ray.direction) < 0.0f)
+					ray.direction = vec_scale(ray.direction, -1.0f);
+			}
+			add_counts(sum, &ray);
+		}
+	return ray_count;
+}
+
+void profile_rebuild(Scene *scene, t_camera cam, int xres, int yres)
+{
+	//profile, then rebuild: hot subtrees get a finer build, children and memory get ordered by traffic
+	printf("\nprofiling sbvh from the camera\n");
+	Traversal before = {0};
+	int ray_count = profile_bvh(scene->bins, cam, xres, yres, &before);
+
+	double start = wall_clock();
+	int box_count, ref_count;
+	int rebuilt = sbvh_rebuild_hot(scene->bins, &box_count, &ref_count);
+	printf("rebuilt %d hot subtrees in %.3f seconds, %d -> %d boxes, %d -> %d refs\n",
+		rebuilt, wall_clock() - start, scene->bin_count, box_count, scene->ref_count, ref_count);
+
+	Traversal after = {0};
+	profile_bvh(scene->bins, cam, xres, yres, &after);
+	sbvh_order_by_profile(scene->bins);
+	printf("%d rays: %.2f -> %.2f box comparisons per ray, %.2f -> %.2f triangle comparisons\n", ray_count,
+		(float)before.box_comps / (float)ray_count, (float)after.box_comps / (float)ray_count,
+		(float)before.tri_comps / (float)ray_count, (float)after.tri_comps / (float)ray_count);
+
+	scene->bin_count = box_count;
+	scene->ref_count = ref_count;
+	free(scene->refs);
+	flatten_faces(scene);
+	Accel *accel = scene->accel;
+	free(accel->nodes);
+	accel->nodes = flatten_bvh_profiled(scene);
+	accel->node_count = box_count;
+	accel->node_size = box_count * sizeof(gpu_bin);
+	accel->refs = scene->refs;
+	accel->ref_count = ref_count;
+	accel->depth = bins_depth(accel->nodes, accel->node_count);
+}
+
+///////CALIBRATION//////////
+
+#define CALIBRATE_PRIMS 4096 //powers of two, picked with a mask so the loops time only the tests
+#define CALIBRATE_RAYS 1024
+#define CALIBRATE_TESTS (1 << 24)
+
+void calibrate_cpu(double *box_ns, double *tri_ns)
+{
+	//random boxes and triangles in a unit cube, random rays through it. same tests the lab uses
+	AABB unit = {0};
+	unit.max = (cl_float3){1.0f, 1.0f, 1.0f};
+	AABB *boxes = calloc(CALIBRATE_PRIMS, sizeof(AABB));
+	Triangle *tris = calloc(CALIBRATE_PRIMS, sizeof(Triangle));
+	for (int i = 0; i < CALIBRATE_PRIMS; i++)
+	{
+		cl_float3 c = (cl_float3){unit_rand(), unit_rand(), unit_rand()};
+		cl_float3 h = vec_scale((cl_float3){unit_rand(), unit_rand(), unit_rand()}, 0.1f);
+		boxes[i].min = vec_sub(c, h);
+		boxes[i].max = vec_add(c, h);
+		tris[i].v0 = c;
+		tris[i].v1 = vec_add(c, vec_scale(random_dir(), 0.2f));
+		tris[i].v2 = vec_add(c, vec_scale(random_dir(), 0.2f));
+	}
+	Traversal *rays[CALIBRATE_RAYS];
+	for (int i = 0; i < CALIBRATE_RAYS; i++)
+	{
+		rays[i] = random_ray(&unit);
+		rays[i]->t = FLT_MAX;
+	}
+
+	int hits = 0;
+	double start = wall_clock();
+	for (int i = 0; i < CALIBRATE_TESTS; i++)
+		hits += intersect_box(rays[i & (CALIBRATE_RAYS - 1)], &boxes[i & (CALIBRATE_PRIMS - 1)]);
+	*box_ns = (wall_clock() - start) * 1000000000.0 / (double)CALIBRATE_TESTS;
+
+	start = wall_clock();
+	for (int i = 0; i < CALIBRATE_TESTS; i++)
+	{
+		Triangle *tri = &tris[i & (CALIBRATE_PRIMS - 1)];
+		hits += intersect_watertight(rays[i & (CALIBRATE_RAYS - 1)], tri->v0, tri->v1, tri->v2);
+	}
+	*tri_ns = (wall_clock() - start) * 1000000000.0 / (double)CALIBRATE_TESTS;
+	printf("calibration: %d hits\n", hits);
+
+	for (int i = 0; i < CALIBRATE_RAYS; i++)
+		free(rays[i]);
+	free(boxes);
+	free(tris);
+}
+
+///////FLAT STRUCTURES//////////
+//host mirrors of the kernel traversals, working on exactly what gets uploaded.
+//box_comps counts nodes or cells visited, tri_comps counts triangle tests.
+
+static void check_refs(Traversal *ray, cl_int *refs, int start, int count, Face *faces)
+{
+	for (int i = start; i < start + count; i++)
+		intersect_face(ray, &faces[refs[i]]);
+}
+
+static float bin_entry(Traversal *ray, gpu_bin b)
+{
+	float tmin, tmax;
+	ray->box_comps++;
+	if (!clip_ray(ray, (cl_float3){b.minx, b.miny, b.minz}, (cl_float3){b.maxx, b.maxy, b.maxz}, &tmin, &tmax) || tmin > ray->t)
+		return FLT_MAX;
+	ray->boxes_hit++;
+	return tmin;
+}
+
+static void traverse_bins(gpu_bin *bins, cl_int *refs, Face *faces, int depth, Traversal *ray)
+{
+	//same as hit_bvh: near child first by the ray's sign on the split axis, far children
+	//dropped on pop if something closer turned up since they were pushed.
+	//a pop pushes at most two, so depth + 2 entries (bvh_stack_size) always fit
+	int stack[bvh_stack_size(depth)];
+	float entry[bvh_stack_size(depth)];
+	int s_i = 0;
+
+	float root_in = bin_entry(ray, bins[0]);
+	if (root_in != FLT_MAX)
+	{
+		stack[0] = 0;
+		entry[0] = root_in;
+		s_i = 1;
+	}
+
+	while (s_i)
+	{
+		s_i--;
+		if (entry[s_i] > ray->t)
+			continue;
+		gpu_bin b = bins[stack[s_i]];
+		if (b.rind < 0)
+		{
+			check_refs(ray, refs, -1 * b.lind, -1 * b.rind, faces);
+			continue;
+		}
+		int l = b.lind & BIN_IND_MASK;
+		float l_in = bin_entry(ray, bins[l]);
+		float r_in = bin_entry(ray, bins[b.rind]);
+		int axis = (b.lind >> BIN_AXIS_SHIFT) & 3;
+		float d = axis == 0 ? ray->direction.x : (axis == 1 ? ray->direction.y : ray->direction.z);
+		int left_near = (d >= 0.0f) == ((b.lind & BIN_FLIP) == 0);
+
+		if ((left_near ? r_in : l_in) != FLT_MAX)
+		{
+			stack[s_i] = left_near ? b.rind : l;
+			entry[s_i++] = left_near ? r_in : l_in;
+		}
+		if ((left_near ? l_in : r_in) != FLT_MAX)
+		{
+			stack[s_i] = left_near ? l : b.rind;
+			entry[s_i++] = left_near ? l_in : r_in;
+		}
+	}
+}
+
+static void traverse_packed(gpu_bin *bins, cl_int *refs, cl_float *W, int inlined, int depth, Traversal *ray)
+{
+	//traverse_bins reading triangles the way the device does: 9 packed floats per face in W through
+	//the refs (split layout), or the records behind each leaf of an inline_blob
+	int stack[bvh_stack_size(depth)];
+	float entry[bvh_stack_size(depth)];
+	int s_i = 0;
+
+	float root_in = bin_entry(ray, bins[0]);
+	if (root_in != FLT_MAX)
+	{
+		stack[0] = 0;
+		entry[0] = root_in;
+		s_i = 1;
+	}
+
+	while (s_i)
+	{
+		s_i--;
+		if (entry[s_i] > ray->t)
+			continue;
+		gpu_bin b = bins[stack[s_i]];
+		if (b.rind < 0)
+		{
+			for (int i = 0; i < -1 * b.rind; i++)
+			{
+				cl_float *v = inlined ? (cl_float *)bins + (-1 * b.lind + i * 3) * 4 : W + refs[-1 * b.lind + i] * 9;
+				int stride = inlined ? 4 : 3;
+				intersect_watertight(ray, (cl_float3){v[0], v[1], v[2]}, (cl_float3){v[stride], v[stride + 1], v[stride + 2]},
+					(cl_float3){v[stride * 2], v[stride * 2 + 1], v[stride * 2 + 2]});
+			}
+			continue;
+		}
+		int l = b.lind & BIN_IND_MASK;
+		float l_in = bin_entry(ray, bins[l]);
+		float r_in = bin_entry(ray, bins[b.rind]);
+		int axis = (b.lind >> BIN_AXIS_SHIFT) & 3;
+		float d = axis == 0 ? ray->direction.x : (axis == 1 ? ray->direction.y : ray->direction.z);
+		int left_near = (d >= 0.0f) == ((b.lind & BIN_FLIP) == 0);
+
+		if ((left_near ? r_in : l_in) != FLT_MAX)
+		{
+			stack[s_i] = left_near ? b.rind : l;
+			entry[s_i++] = left_near ? r_in : l_in;
+		}
+		if ((left_near ? l_in : r_in) != FLT_MAX)
+		{
+			stack[s_i] = left_near ? l : b.rind;
+			entry[s_i++] = left_near ? l_in : r_in;
+		}
+	}
+}
+
+static void traverse_bins_unordered(gpu_bin *bins, cl_int *refs, Face *faces, int depth, Traversal *ray)
+{
+	//the old way, lind then rind whatever the direction. kept for comparison
+	int stack[bvh_stack_size(depth)];
+	int s_i = 1;
+	stack[0] = 0;
+
+	while (s_i)
+	{
+		gpu_bin b = bins[stack[--s_i]];
+		if (bin_entry(ray, b) == FLT_MAX)
+			continue;
+		if (b.rind < 0)
+			check_refs(ray, refs, -1 * b.lind, -1 * b.rind, faces);
+		else
+		{
+			stack[s_i++] = b.lind & BIN_IND_MASK;
+			stack[s_i++] = b.rind;
+		}
+	}
+}
+
+static void traverse_bins_restart(gpu_bin *bins, cl_int *refs, Face *faces, Traversal *ray)
+{
+	//same as hit_bvh_restart: one trail bit per level, SHORT_STACK far children, restart from the root otherwise
+	cl_ulong trail = 0;
+	cl_ulong level = TRAIL_TOP;
+	int st_node[SHORT_STACK];
+	float st_in[SHORT_STACK];
+	cl_ulong st_level[SHORT_STACK];
+	int s_top = 0;
+	int s_n = 0;
+
+	if (bin_entry(ray, bins[0]) == FLT_MAX)
+		return;
+	int node = 0;
+	while (1)
+	{
+		gpu_bin b = bins[node];
+		if (b.rind >= 0)
+		{
+			int l = b.lind & BIN_IND_MASK;
+			float l_in = bin_entry(ray, bins[l]);
+			float r_in = bin_entry(ray, bins[b.rind]);
+			int axis = (b.lind >> BIN_AXIS_SHIFT) & 3;
+			float d = axis == 0 ? ray->direction.x : (axis == 1 ? ray->direction.y : ray->direction.z);
+			int left_near = (d >= 0.0f) == ((b.lind & BIN_FLIP) == 0);
+			int near = left_near ? l : b.rind;
+			int far = left_near ? b.rind : l;
+			int hit_near = (left_near ? l_in : r_in) != FLT_MAX;
+			int hit_far = (left_near ? r_in : l_in) != FLT_MAX;
+
+			//lowest set trail bit with the far child culled: near is done, so is this subtree
+			int finished = (trail & level) && !hit_far && !(trail & (level - 1));
+			if ((hit_near || hit_far) && !finished)
+			{
+				if (trail & level)
+					node = hit_far ? far : near;
+				else if (hit_near && hit_far)
+				{
+					s_top = (s_top + 1) % SHORT_STACK;
+					st_node[s_top] = far;
+					st_in[s_top] = left_near ? r_in : l_in;
+					st_level[s_top] = level;
+					s_n = s_n < SHORT_STACK ? s_n + 1 : SHORT_STACK;
+					node = near;
+				}
+				else
+				{
+					node = hit_near ? near : far;
+					trail |= level;
+				}
+				level >>= 1;
+				continue;
+			}
+		}
+		else
+			check_refs(ray, refs, -1 * b.lind, -1 * b.rind, faces);
+
+		//this node's subtree is done, move the trail on to the next pending far child
+		while (1)
+		{
+			if (level == TRAIL_TOP)
+				return;
+			cl_ulong done = level << 1;
+			trail = (trail & ~(done - 1)) + done;
+			if (!trail)
+				return;
+			cl_ulong target = trail & (~trail + 1);
+			if (s_n && st_level[s_top] == target)
+			{
+				node = st_node[s_top];
+				float entry = st_in[s_top];
+				s_top = (s_top + SHORT_STACK - 1) % SHORT_STACK;
+				s_n--;
+				level = target >> 1;
+				if (entry > ray->t)
+					continue;
+			}
+			else
+			{
+				ray->restarts++;
+				s_n = 0;
+				node = 0;
+				level = TRAIL_TOP;
+			}
+			break;
+		}
+	}
+}
+
+static int occluded_bins(gpu_bin *bins, cl_int *refs, Face *faces, int depth, Traversal *ray)
+{
+	//same as occluded_bvh: ray->t comes in as the max distance, first hit before it ends the search
+	float t_max = ray->t;
+	int stack[bvh_stack_size(depth)];
+	int s_i = 1;
+	stack[0] = 0;
+
+	while (s_i)
+	{
+		gpu_bin b = bins[stack[--s_i]];
+		if (bin_entry(ray, b) == FLT_MAX)
+			continue;
+		if (b.rind < 0)
+		{
+			for (int i = -1 * b.lind; i < -1 * b.lind - b.rind; i++)
+			{
+				intersect_face(ray, &faces[refs[i]]);
+				if (ray->t < t_max)
+					return 1;
+			}
+		}
+		else
+		{
+			stack[s_i++] = b.lind & BIN_IND_MASK;
+			stack[s_i++] = b.rind;
+		}
+	}
+	return 0;
+}
+
+static void traverse_kd(gpu_kd_node *nodes, cl_int *refs, Face *faces, Traversal *ray)
+{
+	float t_in, t_out;
+	gpu_kd_node root = nodes[0];
+	if (!clip_ray(ray, (cl_float3){root.minx, root.miny, root.minz}, (cl_float3){root.maxx, root.maxy, root.maxz}, &t_in, &t_out))
+		return;
+	t_in = fmax(t_in, 0.0f);
+
+	int ind = 0;
+	while (ind != -1 && t_in < t_out)
+	{
+		//descend to the leaf holding the entry point
+		cl_float3 p = vec_add(ray->origin, vec_scale(ray->direction, t_in));
+		while (nodes[ind].axis != -1)
+		{
+			ray->box_comps++;
+			int a = nodes[ind].axis;
+			if (p.s[a] < nodes[ind].split || (p.s[a] == nodes[ind].split && ray->direction.s[a] <= 0.0f))
+				ind = nodes[ind].left;
+			else
+				ind = nodes[ind].right;
+		}
+		gpu_kd_node *leaf = &nodes[ind];
+		ray->box_comps++;
+		ray->boxes_hit++;
+
+		//find the face the ray leaves through
+		float exits[3];
+		exits[0] = ((ray->direction.x > 0.0f ? leaf->maxx : leaf->minx) - ray->origin.x) * ray->inv_dir.x;
+		exits[1] = ((ray->direction.y > 0.0f ? leaf->maxy : leaf->miny) - ray->origin.y) * ray->inv_dir.y;
+		exits[2] = ((ray->direction.z > 0.0f ? leaf->maxz : leaf->minz) - ray->origin.z) * ray->inv_dir.z;
+		int a = exits[0] < exits[1] ? (exits[0] < exits[2] ? 0 : 2) : (exits[1] < exits[2] ? 1 : 2);
+		float t_exit = exits[a];
+
+		check_refs(ray, refs, leaf->left, leaf->right, faces);
+		if (ray->t <= t_exit)
+			return;
+		t_in = fmax(t_in, t_exit);
+		ind = leaf->ropes[2 * a + (ray->direction.s[a] > 0.0f)];
+	}
+}
+
+static int walk_cells(Traversal *ray, void *grid, gpu_grid_cell *cells, cl_float3 min, cl_float3 size, int *res, float t_in, float t_out, cl_int *refs, Face *faces)
+{
+	//3D DDA (Amanatides & Woo) over one level, returns 1 once the closest hit is known
+	gpu_grid *header = grid;
+	gpu_subgrid *subgrids = (gpu_subgrid *)((gpu_grid_cell *)(header + 1) + header->top_count);
+	gpu_grid_cell *sub_cells = (gpu_grid_cell *)(subgrids + header->sub_count);
+
+	cl_float3 p = vec_add(ray->origin, vec_scale(ray->direction, t_in));
+	int cell[3], step[3];
+	float next[3], delta[3];
+	for (int a = 0; a < 3; a++)
+	{
+		cell[a] = (int)floorf((p.s[a] - min.s[a]) / size.s[a]);
+		cell[a] = cell[a] < 0 ? 0 : (cell[a] >= res[a] ? res[a] - 1 : cell[a]);
+		if (ray->direction.s[a] > 0.0f)
+		{
+			step[a] = 1;
+			next[a] = (min.s[a] + (cell[a] + 1) * size.s[a] - ray->origin.s[a]) * ray->inv_dir.s[a];
+			delta[a] = size.s[a] * ray->inv_dir.s[a];
+		}
+		else if (ray->direction.s[a] < 0.0f)
+		{
+			step[a] = -1;
+			next[a] = (min.s[a] + cell[a] * size.s[a] - ray->origin.s[a]) * ray->inv_dir.s[a];
+			delta[a] = -1.0f * size.s[a] * ray->inv_dir.s[a];
+		}
+		else
+		{
+			step[a] = 0;
+			next[a] = FLT_MAX;
+			delta[a] = FLT_MAX;
+		}
+	}
+
+	while (t_in < t_out)
+	{
+		int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		float t_exit = fmin(next[a], t_out);
+		gpu_grid_cell c = cells[(cell[2] * res[1] + cell[1]) * res[0] + cell[0]];
+		ray->box_comps++;
+		if (c.count == -1)
+		{
+			gpu_subgrid sub = subgrids[c.start];
+			int sub_res[3] = {sub.resx, sub.resy, sub.resz};
+			cl_float3 cmin = (cl_float3){min.x + cell[0] * size.x, min.y + cell[1] * size.y, min.z + cell[2] * size.z};
+			cl_float3 sub_size = (cl_float3){size.x / sub.resx, size.y / sub.resy, size.z / sub.resz};
+			if (walk_cells(ray, grid, &sub_cells[sub.first_cell], cmin, sub_size, sub_res, t_in, t_exit, refs, faces))
+				return 1;
+		}
+		else
+			check_refs(ray, refs, c.start, c.count, faces);
+		if (ray->t <= t_exit)
+			return 1;
+
+		cell[a] += step[a];
+		if (cell[a] < 0 || cell[a] >= res[a])
+			return 0;
+		t_in = next[a];
+		next[a] += delta[a];
+	}
+	return 0;
+}
+
+static void traverse_grid(void *grid, cl_int *refs, Face *faces, Traversal *ray)
+{
+	gpu_grid *g = grid;
+	cl_float3 min = (cl_float3){g->minx, g->miny, g->minz};
+	cl_float3 max = (cl_float3){g->maxx, g->maxy, g->maxz};
+	int res[3] = {g->resx, g->resy, g->resz};
+	cl_float3 size = (cl_float3){(max.x - min.x) / res[0], (max.y - min.y) / res[1], (max.z - min.z) / res[2]};
+	float t_in, t_out;
+
+	if (!clip_ray(ray, min, max, &t_in, &t_out))
+		return;
+	walk_cells(ray, grid, (gpu_grid_cell *)(g + 1), min, size, res, fmax(t_in, 0.0f), t_out, refs, faces);
+}
+
+static void trace_accel(Accel *accel, Face *faces, Traversal *ray)
+{
+	if (accel->type == ACCEL_KD)
+		traverse_kd(accel->nodes, accel->refs, faces, ray);
+	else if (accel->type == ACCEL_GRID)
+		traverse_grid(accel->nodes, accel->refs, faces, ray);
+	else
+		traverse_bins(accel->nodes, accel->refs, faces, accel->depth, ray);
+}
+
+Accel *study_accels(Scene *scene, int ray_count)
+{
+	//returns the sbvh it built, the other structures are freed
+	printf("\n\n\nentering the lab, comparing structures on %d faces\n", scene->face_count);
+
+	AABB bounds;
+	bounds.min = (cl_float3){FLT_MAX, FLT_MAX, FLT_MAX};
+	bounds.max = (cl_float3){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int i = 0; i < scene->face_count; i++)
+	{
+		cl_float3 a, b;
+		face_bounds(&scene->faces[i], &a, &b);
+		bounds.min = (cl_float3){fmin(bounds.min.x, a.x), fmin(bounds.min.y, a.y), fmin(bounds.min.z, a.z)};
+		bounds.max = (cl_float3){fmax(bounds.max.x, b.x), fmax(bounds.max.y, b.y), fmax(bounds.max.z, b.z)};
+	}
+
+	//same rays for everyone
+	Traversal *rays = calloc(ray_count, sizeof(Traversal));
+	for (int i = 0; i < ray_count; i++)
+	{
+		Traversal *ray = random_ray(&bounds);
+		rays[i] = *ray;
+		rays[i].t = FLT_MAX;
+		free(ray);
+	}
+	float *reference = calloc(ray_count, sizeof(float));
+
+	Accel *results[3];
+	Traversal sums[3];
+	double times[3];
+	int mismatches[3];
+	for (int type = ACCEL_BVH; type <= ACCEL_GRID; type++)
+	{
+		results[type] = build_accel(scene, type);
+		if (type == ACCEL_BVH)
+			study_tree(scene->bins, ray_count);
+
+		Traversal *sum = &sums[type];
+		bzero(sum, sizeof(Traversal));
+		mismatches[type] = 0;
+		double start = wall_clock();
+		for (int i = 0; i < ray_count; i++)
+		{
+			Traversal ray = rays[i];
+			trace_accel(results[type], scene->faces, &ray);
+			add_counts(sum, &ray);
+			if (type == ACCEL_BVH)
+				reference[i] = ray.t;
+			else if (fabs(ray.t - reference[i]) > ERROR * fmax(1.0f, fabs(reference[i])) && !(ray.t == FLT_MAX && reference[i] == FLT_MAX))
+				mismatches[type]++;
+		}
+		times[type] = wall_clock() - start;
+
+		if (type == ACCEL_BVH)
+		{
+			Traversal unordered = {0};
+			start = wall_clock();
+			for (int i = 0; i < ray_count; i++)
+			{
+				Traversal ray = rays[i];
+				traverse_bins_unordered(results[type]->nodes, results[type]->refs, scene->faces, results[type]->depth, &ray);
+				add_counts(&unordered, &ray);
+			}
+			printf("sbvh without near-first ordering: %.2f nodes/ray, %.2f tris/ray, %.3f Mrays/s\n",
+				(float)unordered.box_comps / (float)ray_count, (float)unordered.tri_comps / (float)ray_count,
+				(double)ray_count / (wall_clock() - start) / 1000000.0);
+
+			//the trail has one bit per level, deeper trees render with the stack instead (see main)
+			int levels = results[type]->depth;
+			if (levels > RESTART_MAX_DEPTH)
+				printf("sbvh is %d levels deep, past the restart trail's %d, skipping it\n", levels, RESTART_MAX_DEPTH);
+			else
+			{
+				Traversal restart = {0};
+				int restart_wrong = 0;
+				start = wall_clock();
+				for (int i = 0; i < ray_count; i++)
+				{
+					Traversal ray = rays[i];
+					traverse_bins_restart(results[type]->nodes, results[type]->refs, scene->faces, &ray);
+					add_counts(&restart, &ray);
+					if (fabs(ray.t - reference[i]) > ERROR * fmax(1.0f, fabs(reference[i])) && !(ray.t == FLT_MAX && reference[i] == FLT_MAX))
+						restart_wrong++;
+				}
+				printf("sbvh restart trail, %d-entry short stack: %.2f nodes/ray, %.2f tris/ray, %.3f Mrays/s, %.3f restarts/ray, %d differ\n",
+					SHORT_STACK, (float)restart.box_comps / (float)ray_count, (float)restart.tri_comps / (float)ray_count,
+					(double)ray_count / (wall_clock() - start) / 1000000.0, (float)restart.restarts / (float)ray_count, restart_wrong);
+			}
+
+			//occlusion queries on the same rays, max distance anywhere up to twice the closest hit
+			//(or the scene size on a miss), so a good share of them are blocked
+			Traversal shadow = {0};
+			int blocked = 0;
+			int wrong = 0;
+			float diagonal = sqrt(dot(vec_sub(bounds.max, bounds.min), vec_sub(bounds.max, bounds.min)));
+			cl_float4 *queries = malloc(2 * ray_count * sizeof(cl_float4));
+			int *answers = malloc(ray_count * sizeof(int));
+			start = wall_clock();
+			for (int i = 0; i < ray_count; i++)
+			{
+				Traversal ray = rays[i];
+				ray.t = 2.0f * unit_rand() * (reference[i] == FLT_MAX ? diagonal : reference[i]);
+				float t_max = ray.t;
+				queries[2 * i] = (cl_float4){ray.origin.x, ray.origin.y, ray.origin.z, t_max};
+				queries[2 * i + 1] = (cl_float4){ray.direction.x, ray.direction.y, ray.direction.z, 0.0f};
+				int hit = occluded_bins(results[type]->nodes, results[type]->refs, scene->faces, results[type]->depth, &ray);
+				add_counts(&shadow, &ray);
+				answers[i] = hit;
+				blocked += hit;
+				if (hit != (reference[i] < t_max))
+					wrong++;
+			}
+			printf("occlusion: %.2f nodes/ray, %.2f tris/ray, %.3f Mrays/s, %d of %d blocked, %d disagree with closest hit\n",
+				(float)shadow.box_comps / (float)ray_count, (float)shadow.tri_comps / (float)ray_count,
+				(double)ray_count / (wall_clock() - start) / 1000000.0, blocked, ray_count, wrong);
+
+			//the same queries through the kernel's occluded, refs counts whole leaves (the kernel tests a leaf
+			//before looking at the answer, occluded_bins stops inside it)
+			cl_int *gpu_hits = malloc(ray_count * sizeof(cl_int));
+			cl_uint *gpu_counts = malloc(2 * ray_count * sizeof(cl_uint));
+			double seconds = gpu_occlusion(scene, results[type], queries, ray_count, gpu_hits, gpu_counts);
+			if (seconds < 0.0)
+				printf("kernel occlusion: no usable OpenCL device, skipped\n");
+			else
+			{
+				long nodes = 0;
+				long refs = 0;
+				int differ = 0;
+				for (int i = 0; i < ray_count; i++)
+				{
+					nodes += gpu_counts[2 * i];
+					refs += gpu_counts[2 * i + 1];
+					differ += (gpu_hits[i] != 0) != answers[i];
+				}
+				printf("kernel occlusion: %.2f nodes/ray, %.2f refs/ray, %.3f Mrays/s, %d differ from occluded_bins\n",
+					(float)nodes / (float)ray_count, (float)refs / (float)ray_count, (double)ray_count / seconds / 1000000.0, differ);
+			}
+			free(gpu_hits);
+			free(gpu_counts);
+			free(queries);
+			free(answers);
+
+			//split layout (nodes, then W through the refs) against -inline (triangles behind their leaf)
+			//(-inline splits quads first, so the comparison needs a triangle-only scene)
+			int quads = count_shape(scene, GPU_QUAD);
+			int spheres = count_shape(scene, GPU_SPHERE);
+			if (quads || spheres)
+				printf("layout comparison skipped, %d quads (run with -inline to split them) and %d spheres\n", quads, spheres);
+			else
+			{
+				cl_float *W = malloc(scene->face_count * 9 * sizeof(cl_float));
+				for (int i = 0; i < scene->face_count; i++)
+					for (int v = 0; v < 3; v++)
+					{
+						W[i * 9 + v * 3] = scene->faces[i].verts[v].x;
+						W[i * 9 + v * 3 + 1] = scene->faces[i].verts[v].y;
+						W[i * 9 + v * 3 + 2] = scene->faces[i].verts[v].z;
+					}
+				size_t blob_size;
+				gpu_bin *blob = (gpu_bin *)inline_blob(scene, results[type]->nodes, results[type]->refs, results[type]->node_count, &blob_size);
+				for (int inlined = 0; inlined < 2; inlined++)
+				{
+					int layout_wrong = 0;
+					start = wall_clock();
+					for (int i = 0; i < ray_count; i++)
+					{
+						Traversal ray = rays[i];
+						traverse_packed(inlined ? blob : results[type]->nodes, results[type]->refs, W, inlined, results[type]->depth, &ray);
+						if (fabs(ray.t - reference[i]) > ERROR * fmax(1.0f, fabs(reference[i])) && !(ray.t == FLT_MAX && reference[i] == FLT_MAX))
+							layout_wrong++;
+					}
+					printf("%s: %.3f Mrays/s, %.2f MB, %d differ\n", inlined ? "leaf triangles inline" : "split nodes + W",
+						(double)ray_count / (wall_clock() - start) / 1000000.0,
+						(float)(inlined ? blob_size : results[type]->node_size + results[type]->ref_count * sizeof(cl_int) + scene->face_count * 9 * sizeof(cl_float)) / (1024.0f * 1024.0f),
+						layout_wrong);
+				}
+				free(blob);
+				free(W);
+			}
+		}
+	}
+
+	printf("\n%-8s %10s %10s %8s %9s %12s %12s %10s %9s\n", "", "build (s)", "nodes", "refs", "MB", "nodes/ray", "tris/ray", "Mrays/s", "differ");
+	for (int type = ACCEL_BVH; type <= ACCEL_GRID; type++)
+	{
+		Accel *a = results[type];
+		printf("%-8s %10.3f %10d %8d %9.2f %12.2f %12.2f %10.3f %9d\n", accel_name(type), a->build_time, a->node_count, a->ref_count,
+			(float)(a->node_size + a->ref_count * sizeof(cl_int)) / (1024.0f * 1024.0f),
+			(float)sums[type].box_comps / (float)ray_count, (float)sums[type].tri_comps / (float)ray_count,
+			(double)ray_count / times[type] / 1000000.0, mismatches[type]);
+		if (type != ACCEL_BVH)
+			free_accel(a);
+	}
+	free(rays);
+	free(reference);
+	return results[ACCEL_BVH];
 }
\ No newline at end of file
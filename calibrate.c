@@ -0,0 +1,67 @@
+#include "rt.h"
+
+//measures what a box test and a triangle test actually cost on the machine that renders,
+//and keeps the result in SAH_PROFILE so the builders can use it instead of textbook constants.
+//costs are stored relative to one box test (trav 1.0), which is all the SAH cares about
+
+int sah_costs(float *trav, float *isect)
+{
+	//fills in the costs and returns 1 if there's a profile, otherwise leaves them alone
+	FILE *fp = fopen(SAH_PROFILE, "r");
+	if (!fp)
+		return 0;
+
+	char line[256];
+	float t = -1.0f;
+	float i = -1.0f;
+	while (fgets(line, sizeof(line), fp))
+	{
+		sscanf(line, "trav %f", &t);
+		sscanf(line, "isect %f", &i);
+	}
+	fclose(fp);
+	if (t <= 0.0f || i <= 0.0f)
+		return 0;
+	*trav = t;
+	*isect = i;
+	return 1;
+}
+
+static void save_sah_profile(const char *device, double box_ns, double tri_ns)
+{
+	FILE *fp = fopen(SAH_PROFILE, "w");
+	if (!fp)
+	{
+		printf("couldn't write %s\n", SAH_PROFILE);
+		return;
+	}
+	fprintf(fp, "# written by -calibrate, delete to go back to the default costs\n");
+	fprintf(fp, "device %s\n", device);
+	fprintf(fp, "box_ns %f\n", box_ns);
+	fprintf(fp, "tri_ns %f\n", tri_ns);
+	fprintf(fp, "trav %f\n", 1.0);
+	fprintf(fp, "isect %f\n", tri_ns / box_ns);
+	fclose(fp);
+}
+
+void calibrate(int device)
+{
+	double box_ns, tri_ns;
+	const char *name = "cpu";
+
+	if (device == CALIBRATE_GPU)
+	{
+		name = "gpu";
+		if (!gpu_calibrate(&box_ns, &tri_ns))
+		{
+			printf("no usable OpenCL device, calibrating the cpu instead\n");
+			name = "cpu";
+			calibrate_cpu(&box_ns, &tri_ns);
+		}
+	}
+	else
+		calibrate_cpu(&box_ns, &tri_ns);
+
+	printf("%s: %.3f ns per box test, %.3f ns per triangle test, isect/trav %.2f\n", name, box_ns, tri_ns, tri_ns / box_ns);
+	save_sah_profile(name, box_ns, tri_ns);
+}
@@ -0,0 +1,194 @@
+#include "rt.h"
+
+//two-level uniform grid (Kalojanov et al. 2011). a coarse top grid, and any top cell
+//holding more than GRID_LEAF_THRESHOLD faces gets its own finer grid.
+//flat layout is one blob: gpu_grid header, top cells, gpu_subgrids, sub cells
+
+#define GRID_TOP_DENSITY 0.0625f
+#define GRID_SUB_DENSITY 2.0f
+#define GRID_LEAF_THRESHOLD 8
+#define GRID_MAX_RES 128
+#define GRID_MAX_SUB_RES 32
+
+typedef struct s_cell_list
+{
+	int *faces;
+	int count;
+	int cap;
+}				CellList;
+
+static void cell_add(CellList *cell, int face)
+{
+	if (cell->count == cell->cap)
+	{
+		cell->cap = cell->cap ? cell->cap * 2 : 4;
+		cell->faces = realloc(cell->faces, cell->cap * sizeof(int));
+	}
+	cell->faces[cell->count++] = face;
+}
+
+static int plane_overlaps_cell(Face *f, cl_float3 min, cl_float3 max)
+{
+	//cheap rejection of cells the face's bounding box touches but its plane (or sphere) doesn't
+	if (f->shape == GPU_SPHERE)
+	{
+		cl_float3 p = f->verts[0];
+		cl_float3 d = vec_sub(p, (cl_float3){fmax(min.x, fmin(p.x, max.x)), fmax(min.y, fmin(p.y, max.y)), fmax(min.z, fmin(p.z, max.z))});
+		return dot(d, d) <= f->verts[1].x * f->verts[1].x;
+	}
+	cl_float3 c = vec_scale(vec_add(min, max), 0.5f);
+	cl_float3 h = vec_scale(vec_sub(max, min), 0.5f);
+	cl_float3 n = cross(vec_sub(f->verts[1], f->verts[0]), vec_sub(f->verts[2], f->verts[0]));
+	float r = h.x * fabs(n.x) + h.y * fabs(n.y) + h.z * fabs(n.z) + quad_slack(f) * sqrtf(dot(n, n));
+	float s = dot(n, vec_sub(c, f->verts[0]));
+	return fabs(s) <= r;
+}
+
+static void grid_res(cl_float3 span, int count, float density, int max_res, int *res)
+{
+	float volume = span.x * span.y * span.z;
+	float k = volume > 0.0f ? cbrtf(density * (float)count / volume) : 0.0f;
+	float dims[3] = {span.x, span.y, span.z};
+	for (int i = 0; i < 3; i++)
+	{
+		res[i] = (int)(dims[i] * k + 0.5f);
+		if (res[i] < 1)
+			res[i] = 1;
+		if (res[i] > max_res)
+			res[i] = max_res;
+	}
+}
+
+static CellList *fill_cells(Face *faces, int *face_inds, int face_count, cl_float3 min, cl_float3 max, int *res)
+{
+	CellList *cells = calloc(res[0] * res[1] * res[2], sizeof(CellList));
+	cl_float3 size = (cl_float3){(max.x - min.x) / res[0], (max.y - min.y) / res[1], (max.z - min.z) / res[2]};
+
+	for (int i = 0; i < face_count; i++)
+	{
+		Face *f = &faces[face_inds[i]];
+		cl_float3 fmin_, fmax_;
+		face_bounds(f, &fmin_, &fmax_);
+		int lo[3], hi[3];
+		float fl[3] = {fmin_.x, fmin_.y, fmin_.z};
+		float fh[3] = {fmax_.x, fmax_.y, fmax_.z};
+		float gm[3] = {min.x, min.y, min.z};
+		float gs[3] = {size.x, size.y, size.z};
+		for (int a = 0; a < 3; a++)
+		{
+			lo[a] = gs[a] > 0.0f ? (int)floorf((fl[a] - gm[a]) / gs[a]) : 0;
+			hi[a] = gs[a] > 0.0f ? (int)floorf((fh[a] - gm[a]) / gs[a]) : 0;
+			lo[a] = lo[a] < 0 ? 0 : (lo[a] >= res[a] ? res[a] - 1 : lo[a]);
+			hi[a] = hi[a] < 0 ? 0 : (hi[a] >= res[a] ? res[a] - 1 : hi[a]);
+		}
+		for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+				{
+					cl_float3 cmin = (cl_float3){min.x + x * size.x, min.y + y * size.y, min.z + z * size.z};
+					cl_float3 cmax = vec_add(cmin, size);
+					if (plane_overlaps_cell(f, cmin, cmax))
+						cell_add(&cells[(z * res[1] + y) * res[0] + x], face_inds[i]);
+				}
+	}
+	return cells;
+}
+
+void *grid_build(Face *faces, int face_count, size_t *out_size, cl_int **out_refs, int *out_ref_count)
+{
+	cl_float3 min = (cl_float3){FLT_MAX, FLT_MAX, FLT_MAX};
+	cl_float3 max = (cl_float3){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	int *all = calloc(face_count, sizeof(int));
+	for (int i = 0; i < face_count; i++)
+	{
+		cl_float3 a, b;
+		face_bounds(&faces[i], &a, &b);
+		min = (cl_float3){fmin(min.x, a.x), fmin(min.y, a.y), fmin(min.z, a.z)};
+		max = (cl_float3){fmax(max.x, b.x), fmax(max.y, b.y), fmax(max.z, b.z)};
+		all[i] = i;
+	}
+	//pad so faces on the boundary land inside a cell
+	cl_float3 pad = vec_scale(vec_sub(max, min), 0.0001f);
+	min = vec_sub(min, pad);
+	max = vec_add(max, pad);
+
+	int res[3];
+	grid_res(vec_sub(max, min), face_count, GRID_TOP_DENSITY, GRID_MAX_RES, res);
+	int top_count = res[0] * res[1] * res[2];
+	CellList *top = fill_cells(faces, all, face_count, min, max, res);
+	free(all);
+	cl_float3 size = (cl_float3){(max.x - min.x) / res[0], (max.y - min.y) / res[1], (max.z - min.z) / res[2]};
+
+	//second level
+	CellList **subs = calloc(top_count, sizeof(CellList *));
+	int (*sub_res)[3] = calloc(top_count, sizeof(int[3]));
+	int sub_count = 0;
+	int cell_count = 0;
+	for (int i = 0; i < top_count; i++)
+	{
+		if (top[i].count <= GRID_LEAF_THRESHOLD)
+			continue;
+		int x = i % res[0];
+		int y = (i / res[0]) % res[1];
+		int z = i / (res[0] * res[1]);
+		cl_float3 cmin = (cl_float3){min.x + x * size.x, min.y + y * size.y, min.z + z * size.z};
+		grid_res(size, top[i].count, GRID_SUB_DENSITY, GRID_MAX_SUB_RES, sub_res[i]);
+		subs[i] = fill_cells(faces, top[i].faces, top[i].count, cmin, vec_add(cmin, size), sub_res[i]);
+		sub_count++;
+		cell_count += sub_res[i][0] * sub_res[i][1] * sub_res[i][2];
+	}
+
+	//flatten
+	int ref_count = 0;
+	for (int i = 0; i < top_count; i++)
+		if (subs[i])
+			for (int j = 0; j < sub_res[i][0] * sub_res[i][1] * sub_res[i][2]; j++)
+				ref_count += subs[i][j].count;
+		else
+			ref_count += top[i].count;
+
+	size_t blob_size = sizeof(gpu_grid) + top_count * sizeof(gpu_grid_cell) + sub_count * sizeof(gpu_subgrid) + cell_count * sizeof(gpu_grid_cell);
+	void *blob = calloc(1, blob_size);
+	gpu_grid *header = blob;
+	gpu_grid_cell *top_cells = (gpu_grid_cell *)(header + 1);
+	gpu_subgrid *subgrids = (gpu_subgrid *)(top_cells + top_count);
+	gpu_grid_cell *cells = (gpu_grid_cell *)(subgrids + sub_count);
+	*header = (gpu_grid){min.x, min.y, min.z, res[0], max.x, max.y, max.z, res[1], res[2], top_count, sub_count, cell_count};
+
+	cl_int *refs = calloc(ref_count, sizeof(cl_int));
+	int ref_ind = 0;
+	int sub_ind = 0;
+	int cell_ind = 0;
+	for (int i = 0; i < top_count; i++)
+	{
+		if (subs[i])
+		{
+			top_cells[i] = (gpu_grid_cell){sub_ind, -1};
+			subgrids[sub_ind++] = (gpu_subgrid){sub_res[i][0], sub_res[i][1], sub_res[i][2], cell_ind};
+			for (int j = 0; j < sub_res[i][0] * sub_res[i][1] * sub_res[i][2]; j++)
+			{
+				cells[cell_ind++] = (gpu_grid_cell){ref_ind, subs[i][j].count};
+				memcpy(&refs[ref_ind], subs[i][j].faces, subs[i][j].count * sizeof(int));
+				ref_ind += subs[i][j].count;
+				free(subs[i][j].faces);
+			}
+			free(subs[i]);
+		}
+		else
+		{
+			top_cells[i] = (gpu_grid_cell){ref_ind, top[i].count};
+			memcpy(&refs[ref_ind], top[i].faces, top[i].count * sizeof(int));
+			ref_ind += top[i].count;
+		}
+		free(top[i].faces);
+	}
+	free(top);
+	free(subs);
+	free(sub_res);
+
+	printf("grid: %dx%dx%d top, %d subgrids with %d cells, %d refs to %d faces\n", res[0], res[1], res[2], sub_count, cell_count, ref_ind, face_count);
+	*out_size = blob_size;
+	*out_refs = refs;
+	*out_ref_count = ref_ind;
+	return blob;
+}
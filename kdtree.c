@@ -0,0 +1,412 @@
+#include "rt.h"
+
+//SAH kd-tree with perfect splits (triangles are clipped to the node before bounding)
+//and ropes on every leaf face for stackless traversal (Popov et al. 2007)
+
+#define KD_TRAV 1.0f
+#define KD_ISECT 1.5f
+#define KD_EMPTY_BONUS 0.8f
+#define KD_LEAF_MIN 2
+
+//defaults, replaced by the calibration profile when there is one
+static float kd_trav = KD_TRAV;
+static float kd_isect = KD_ISECT;
+
+enum kd_event {KD_END, KD_PLANAR, KD_START};
+
+typedef struct s_kd_ref
+{
+	int face;
+	cl_float3 min;
+	cl_float3 max;
+}				KdRef;
+
+typedef struct s_event
+{
+	float pos;
+	int type;
+}				Event;
+
+typedef struct s_kd_node
+{
+	cl_float3 min;
+	cl_float3 max;
+	int axis; //-1 for leaves
+	float split;
+	struct s_kd_node *left;
+	struct s_kd_node *right;
+	struct s_kd_node *ropes[6]; //-x +x -y +y -z +z
+
+	KdRef *refs; //leaves only
+	int ref_count;
+
+	int flat_ind;
+}				KdNode;
+
+static int node_count;
+static int leaf_ref_count;
+
+static float get_axis(cl_float3 v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static void set_axis(cl_float3 *v, int axis, float f)
+{
+	if (axis == 0)
+		v->x = f;
+	else if (axis == 1)
+		v->y = f;
+	else
+		v->z = f;
+}
+
+static float kd_SA(cl_float3 min, cl_float3 max)
+{
+	cl_float3 span = vec_sub(max, min);
+	return 2.0f * (span.x * span.y + span.y * span.z + span.x * span.z);
+}
+
+static int clip_plane(cl_float3 *in, int count, cl_float3 *out, int axis, float pos, int keep_above)
+{
+	//one Sutherland-Hodgman pass against an axis aligned plane
+	int out_count = 0;
+	for (int i = 0; i < count; i++)
+	{
+		cl_float3 a = in[i];
+		cl_float3 b = in[(i + 1) % count];
+		float da = get_axis(a, axis) - pos;
+		float db = get_axis(b, axis) - pos;
+		if (!keep_above)
+		{
+			da = -da;
+			db = -db;
+		}
+		if (da >= 0.0f)
+			out[out_count++] = a;
+		if ((da >= 0.0f) != (db >= 0.0f))
+		{
+			cl_float3 p = vec_add(a, vec_scale(vec_sub(b, a), da / (da - db)));
+			set_axis(&p, axis, pos);
+			out[out_count++] = p;
+		}
+	}
+	return out_count;
+}
+
+static void clip_ref(Face *faces, KdRef *ref, cl_float3 min, cl_float3 max)
+{
+	//bounds of the part of the triangle inside [min, max]
+	cl_float3 poly_a[9];
+	cl_float3 poly_b[9];
+	Face *f = &faces[ref->face];
+	int count = f->shape == GPU_SPHERE ? 0 : f->shape; //spheres just clip their box
+	for (int i = 0; i < count; i++)
+		poly_a[i] = f->verts[i];
+
+	for (int axis = 0; axis < 3 && count; axis++)
+	{
+		count = clip_plane(poly_a, count, poly_b, axis, get_axis(min, axis), 1);
+		count = clip_plane(poly_b, count, poly_a, axis, get_axis(max, axis), 0);
+	}
+
+	cl_float3 cmin = (cl_float3){FLT_MAX, FLT_MAX, FLT_MAX};
+	cl_float3 cmax = (cl_float3){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int i = 0; i < count; i++)
+	{
+		cmin = (cl_float3){fmin(cmin.x, poly_a[i].x), fmin(cmin.y, poly_a[i].y), fmin(cmin.z, poly_a[i].z)};
+		cmax = (cl_float3){fmax(cmax.x, poly_a[i].x), fmax(cmax.y, poly_a[i].y), fmax(cmax.z, poly_a[i].z)};
+	}
+
+	//fall back to plain box clipping if the polygon degenerated numerically
+	if (count == 0)
+	{
+		cmin = ref->min;
+		cmax = ref->max;
+	}
+	//a quad is only planar to within quad_slack, its a-c diagonal can sit just off the clipped polygon
+	float pad = quad_slack(f);
+	cmin = vec_sub(cmin, (cl_float3){pad, pad, pad});
+	cmax = vec_add(cmax, (cl_float3){pad, pad, pad});
+	ref->min = (cl_float3){fmax(cmin.x, min.x), fmax(cmin.y, min.y), fmax(cmin.z, min.z)};
+	ref->max = (cl_float3){fmin(cmax.x, max.x), fmin(cmax.y, max.y), fmin(cmax.z, max.z)};
+}
+
+static int event_sort(const void *arg1, const void *arg2)
+{
+	Event *a = (Event *)arg1;
+	Event *b = (Event *)arg2;
+
+	if (a->pos != b->pos)
+		return a->pos > b->pos ? 1 : -1;
+	return a->type - b->type;
+}
+
+static float best_plane(KdNode *node, int *best_axis, float *best_pos)
+{
+	float best_cost = FLT_MAX;
+	float inv_SA = 1.0f / kd_SA(node->min, node->max);
+	Event *events = calloc(node->ref_count * 2, sizeof(Event));
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float lo = get_axis(node->min, axis);
+		float hi = get_axis(node->max, axis);
+		if (hi <= lo)
+			continue;
+
+		int e_count = 0;
+		for (int i = 0; i < node->ref_count; i++)
+		{
+			float a = get_axis(node->refs[i].min, axis);
+			float b = get_axis(node->refs[i].max, axis);
+			if (a == b)
+				events[e_count++] = (Event){a, KD_PLANAR};
+			else
+			{
+				events[e_count++] = (Event){a, KD_START};
+				events[e_count++] = (Event){b, KD_END};
+			}
+		}
+		qsort(events, e_count, sizeof(Event), event_sort);
+
+		//sweep (Wald & Havran 2006), planar refs are put on the left
+		int NL = 0;
+		int NR = node->ref_count;
+		for (int i = 0; i < e_count;)
+		{
+			float pos = events[i].pos;
+			int ends = 0, planars = 0, starts = 0;
+			while (i < e_count && events[i].pos == pos && events[i].type == KD_END)
+			{
+				ends++;
+				i++;
+			}
+			while (i < e_count && events[i].pos == pos && events[i].type == KD_PLANAR)
+			{
+				planars++;
+				i++;
+			}
+			while (i < e_count && events[i].pos == pos && events[i].type == KD_START)
+			{
+				starts++;
+				i++;
+			}
+
+			NR -= planars + ends;
+			if (pos > lo && pos < hi)
+			{
+				cl_float3 lmax = node->max;
+				cl_float3 rmin = node->min;
+				set_axis(&lmax, axis, pos);
+				set_axis(&rmin, axis, pos);
+				float PL = kd_SA(node->min, lmax) * inv_SA;
+				float PR = kd_SA(rmin, node->max) * inv_SA;
+				int nl = NL + planars;
+				float cost = kd_trav + kd_isect * (PL * nl + PR * NR);
+				if (nl == 0 || NR == 0)
+					cost *= KD_EMPTY_BONUS;
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					*best_axis = axis;
+					*best_pos = pos;
+				}
+			}
+			NL += starts + planars;
+		}
+	}
+	free(events);
+	return best_cost;
+}
+
+static KdNode *new_kd_node(cl_float3 min, cl_float3 max)
+{
+	KdNode *node = calloc(1, sizeof(KdNode));
+	node->min = min;
+	node->max = max;
+	node->axis = -1;
+	node_count++;
+	return node;
+}
+
+static void kd_split(Face *faces, KdNode *node, int depth)
+{
+	int axis = -1;
+	float pos = 0.0f;
+
+	if (node->ref_count <= KD_LEAF_MIN || depth <= 0)
+	{
+		leaf_ref_count += node->ref_count;
+		return;
+	}
+	float cost = best_plane(node, &axis, &pos);
+	if (axis == -1 || cost >= kd_isect * node->ref_count)
+	{
+		leaf_ref_count += node->ref_count;
+		return;
+	}
+
+	cl_float3 lmax = node->max;
+	cl_float3 rmin = node->min;
+	set_axis(&lmax, axis, pos);
+	set_axis(&rmin, axis, pos);
+	KdNode *left = new_kd_node(node->min, lmax);
+	KdNode *right = new_kd_node(rmin, node->max);
+	left->refs = calloc(node->ref_count, sizeof(KdRef));
+	right->refs = calloc(node->ref_count, sizeof(KdRef));
+
+	for (int i = 0; i < node->ref_count; i++)
+	{
+		KdRef ref = node->refs[i];
+		float a = get_axis(ref.min, axis);
+		float b = get_axis(ref.max, axis);
+		int goes_left = a < pos || (a == pos && b == pos);
+		int goes_right = b > pos;
+
+		if (goes_left && goes_right)
+		{
+			KdRef l = ref;
+			KdRef r = ref;
+			clip_ref(faces, &l, left->min, left->max);
+			clip_ref(faces, &r, right->min, right->max);
+			left->refs[left->ref_count++] = l;
+			right->refs[right->ref_count++] = r;
+		}
+		else if (goes_left)
+			left->refs[left->ref_count++] = ref;
+		else
+			right->refs[right->ref_count++] = ref;
+	}
+	free(node->refs);
+	node->refs = NULL;
+	node->ref_count = 0;
+	node->axis = axis;
+	node->split = pos;
+	node->left = left;
+	node->right = right;
+
+	kd_split(faces, left, depth - 1);
+	kd_split(faces, right, depth - 1);
+}
+
+static KdNode *optimize_rope(KdNode *rope, int face, KdNode *node)
+{
+	//walk the rope down as far as it stays adjacent to the whole face
+	int axis = face / 2;
+	while (rope && rope->axis != -1)
+	{
+		if (rope->axis == axis)
+			rope = face % 2 ? rope->left : rope->right;
+		else if (rope->split <= get_axis(node->min, rope->axis))
+			rope = rope->right;
+		else if (rope->split >= get_axis(node->max, rope->axis))
+			rope = rope->left;
+		else
+			break;
+	}
+	return rope;
+}
+
+static void build_ropes(KdNode *node, KdNode **ropes)
+{
+	for (int i = 0; i < 6; i++)
+		node->ropes[i] = optimize_rope(ropes[i], i, node);
+	if (node->axis == -1)
+		return;
+
+	KdNode *lropes[6];
+	KdNode *rropes[6];
+	memcpy(lropes, node->ropes, sizeof(lropes));
+	memcpy(rropes, node->ropes, sizeof(rropes));
+	lropes[node->axis * 2 + 1] = node->right;
+	rropes[node->axis * 2] = node->left;
+	build_ropes(node->left, lropes);
+	build_ropes(node->right, rropes);
+}
+
+static void number_nodes(KdNode *node, int *ind)
+{
+	node->flat_ind = (*ind)++;
+	if (node->axis != -1)
+	{
+		number_nodes(node->left, ind);
+		number_nodes(node->right, ind);
+	}
+}
+
+static void fill_flat(KdNode *node, gpu_kd_node *flat, cl_int *refs, int *ref_ind)
+{
+	gpu_kd_node *n = &flat[node->flat_ind];
+	*n = (gpu_kd_node){node->min.x, node->min.y, node->min.z, node->axis,
+						node->max.x, node->max.y, node->max.z, node->split};
+	for (int i = 0; i < 6; i++)
+		n->ropes[i] = node->ropes[i] ? node->ropes[i]->flat_ind : -1;
+	if (node->axis == -1)
+	{
+		n->left = *ref_ind;
+		n->right = node->ref_count;
+		for (int i = 0; i < node->ref_count; i++)
+			refs[(*ref_ind)++] = node->refs[i].face;
+	}
+	else
+	{
+		n->left = node->left->flat_ind;
+		n->right = node->right->flat_ind;
+		fill_flat(node->left, flat, refs, ref_ind);
+		fill_flat(node->right, flat, refs, ref_ind);
+	}
+}
+
+static void free_kd(KdNode *node)
+{
+	if (node->axis != -1)
+	{
+		free_kd(node->left);
+		free_kd(node->right);
+	}
+	free(node->refs);
+	free(node);
+}
+
+gpu_kd_node *kd_build(Face *faces, int face_count, int *out_node_count, cl_int **out_refs, int *out_ref_count)
+{
+	cl_float3 min = (cl_float3){FLT_MAX, FLT_MAX, FLT_MAX};
+	cl_float3 max = (cl_float3){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	node_count = 0;
+	leaf_ref_count = 0;
+	kd_trav = KD_TRAV;
+	kd_isect = KD_ISECT;
+	sah_costs(&kd_trav, &kd_isect);
+
+	KdRef *refs = calloc(face_count, sizeof(KdRef));
+	for (int i = 0; i < face_count; i++)
+	{
+		refs[i].face = i;
+		face_bounds(&faces[i], &refs[i].min, &refs[i].max);
+		min = (cl_float3){fmin(min.x, refs[i].min.x), fmin(min.y, refs[i].min.y), fmin(min.z, refs[i].min.z)};
+		max = (cl_float3){fmax(max.x, refs[i].max.x), fmax(max.y, refs[i].max.y), fmax(max.z, refs[i].max.z)};
+	}
+
+	KdNode *root = new_kd_node(min, max);
+	root->refs = refs;
+	root->ref_count = face_count;
+	kd_split(faces, root, (int)(8.0f + 1.3f * log2f((float)face_count)));
+
+	KdNode *no_ropes[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+	build_ropes(root, no_ropes);
+
+	int ind = 0;
+	number_nodes(root, &ind);
+	gpu_kd_node *flat = calloc(node_count, sizeof(gpu_kd_node));
+	cl_int *flat_refs = calloc(leaf_ref_count, sizeof(cl_int));
+	int ref_ind = 0;
+	fill_flat(root, flat, flat_refs, &ref_ind);
+	free_kd(root);
+
+	printf("kd-tree: %d nodes, %d refs to %d faces\n", node_count, ref_ind, face_count);
+	*out_node_count = node_count;
+	*out_refs = flat_refs;
+	*out_ref_count = ref_ind;
+	return flat;
+}
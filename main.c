@@ -67,30 +67,104 @@ int main(int ac, char **av)
 {
 	srand(time(NULL));
 
-	Scene *sponza = scene_from_obj("objects/sponza/", "sponza.obj");
-
-	//LL is best for this bvh. don't want to rearrange import for now, will do later
-	Face *face_list = NULL;
-	for (int i = 0; i < sponza->face_count; i++)
+	//usage: ./raytrace [-obj dir/file.obj] [-accel sbvh|kd|grid] [-lab] [-lazy] [-profile] [-calibrate cpu|gpu] [-restart] [-pairs] [-wavefront] [-sort] [-persistent] [-regen] [-compress] [-quantize] [-inline] [-spheres n] [-bounces n] [-linear]
+	char *obj_dir = "objects/sponza/";
+	char *obj_file = "sponza.obj";
+	int accel = ACCEL_BVH;
+	int lab = 0;
+	int lazy = 0;
+	int profile = 0;
+	int calibrate_on = -1;
+	int traversal = BVH_STACK;
+	int render_mode = RENDER_MEGAKERNEL;
+	int compress = 0;
+	int quantize = 0;
+	int inline_leaves = 0;
+	int spheres = 0;
+	int bounces = 0;
+	int pixel_order = PIXEL_TILED;
+	for (int i = 1; i < ac; i++)
 	{
-		Face *f = calloc(1, sizeof(Face));
-		memcpy(f, &sponza->faces[i], sizeof(Face));
-		f->next = face_list;
-		face_list = f;
+		if (strcmp(av[i], "-obj") == 0 && i + 1 < ac)
+		{
+			char *slash = strrchr(av[++i], '/');
+			obj_dir = slash ? strndup(av[i], slash - av[i] + 1) : "";
+			obj_file = slash ? slash + 1 : av[i];
+		}
+		else if (strcmp(av[i], "-accel") == 0 && i + 1 < ac)
+		{
+			i++;
+			accel = strcmp(av[i], "kd") == 0 ? ACCEL_KD : (strcmp(av[i], "grid") == 0 ? ACCEL_GRID : ACCEL_BVH);
+		}
+		else if (strcmp(av[i], "-lab") == 0)
+			lab = 1;
+		else if (strcmp(av[i], "-lazy") == 0)
+			lazy = 1;
+		else if (strcmp(av[i], "-profile") == 0)
+			profile = 1;
+		else if (strcmp(av[i], "-calibrate") == 0 && i + 1 < ac)
+			calibrate_on = strcmp(av[++i], "gpu") == 0 ? CALIBRATE_GPU : CALIBRATE_CPU;
+		else if (strcmp(av[i], "-restart") == 0)
+			traversal = BVH_RESTART;
+		else if (strcmp(av[i], "-pairs") == 0)
+			traversal = BVH_PAIRS;
+		else if (strcmp(av[i], "-wavefront") == 0)
+			render_mode = RENDER_WAVEFRONT;
+		else if (strcmp(av[i], "-sort") == 0)
+			render_mode = RENDER_WAVEFRONT_SORTED;
+		else if (strcmp(av[i], "-persistent") == 0)
+			render_mode = RENDER_PERSISTENT;
+		else if (strcmp(av[i], "-regen") == 0)
+			render_mode = RENDER_REGEN;
+		else if (strcmp(av[i], "-compress") == 0)
+			compress = 1;
+		else if (strcmp(av[i], "-quantize") == 0)
+			quantize = 1;
+		else if (strcmp(av[i], "-inline") == 0)
+			inline_leaves = 1;
+		else if (strcmp(av[i], "-spheres") == 0 && i + 1 < ac)
+			spheres = atoi(av[++i]);
+		else if (strcmp(av[i], "-bounces") == 0 && i + 1 < ac)
+			bounces = atoi(av[++i]);
+		else if (strcmp(av[i], "-linear") == 0)
+			pixel_order = PIXEL_LINEAR;
 	}
-	free(sponza->faces);
-
-	int box_count, ref_count;
-	AABB *tree = sbvh(face_list, &box_count, &ref_count);
-	printf("finished with %d boxes\n", box_count);
-	study_tree(tree, 100000);
 
+	if (calibrate_on != -1)
+		calibrate(calibrate_on);
 
-	sponza->bins = tree;
-	sponza->bin_count = box_count;
-	sponza->face_count = ref_count;
-	printf("about to flatten\n");
-	flatten_faces(sponza);
+	Scene *sponza = scene_from_obj(obj_dir, obj_file);
+	classify_opacity(sponza);
+	if (spheres > 0)
+		scatter_spheres(sponza, spheres);
+	if ((quantize || inline_leaves) && count_shape(sponza, GPU_SPHERE))
+	{
+		printf("-quantize and -inline store triangles only, ignoring them with spheres in the scene\n");
+		quantize = 0;
+		inline_leaves = 0;
+	}
+	if ((quantize || inline_leaves) && accel == ACCEL_BVH)
+		split_quads(sponza); //both store exactly one triangle per ref
+
+	Accel *lab_bvh = lab ? study_accels(sponza, 100000) : NULL;
+	if (lazy)
+		study_lazy(sponza, 100000);
+	if (lab_bvh && accel == ACCEL_BVH)
+		sponza->accel = lab_bvh; //same build, no need to do it twice
+	else
+	{
+		if (lab_bvh)
+		{
+			free_accel(lab_bvh); //scene->refs was its refs
+			sponza->refs = NULL;
+		}
+		sponza->accel = build_accel(sponza, accel);
+	}
+	sponza->accel->traversal = traversal;
+	sponza->render_mode = render_mode;
+	sponza->tex_compress = compress;
+	sponza->max_bounces = bounces;
+	sponza->pixel_order = pixel_order;
 	
 	t_camera cam;
 	//cam.center = (cl_float3){-400.0, 50.0, -220.0}; //reference vase view (1,0,0)
@@ -104,6 +178,30 @@ int main(int ac, char **av)
 	cam.width = 1.0;
 	cam.height = 1.0;
 	init_camera(&cam, XDIM, YDIM);
+	if (profile && accel == ACCEL_BVH)
+		profile_rebuild(sponza, cam, XDIM, YDIM);
+	//after the profiled rebuild, which swaps out the leaves and refs the blob is cut to
+	if (quantize && accel == ACCEL_BVH)
+		quantize_accel(sponza, sponza->accel);
+	else if (quantize)
+		printf("-quantize only works with the sbvh, ignoring it\n");
+	if (traversal == BVH_RESTART && accel == ACCEL_BVH && sponza->accel->depth > RESTART_MAX_DEPTH)
+	{
+		printf("-restart's trail only covers %d levels and this sbvh is %d deep, using a %d entry stack\n",
+			RESTART_MAX_DEPTH, sponza->accel->depth, bvh_stack_size(sponza->accel->depth));
+		sponza->accel->traversal = BVH_STACK;
+	}
+	if (inline_leaves && accel == ACCEL_BVH && !quantize && traversal != BVH_PAIRS)
+		inline_accel(sponza, sponza->accel);
+	else if (inline_leaves)
+		printf("-inline only works with the sbvh, without -quantize or -pairs, ignoring it\n");
+	if (traversal == BVH_PAIRS && accel == ACCEL_BVH)
+		pair_accel(sponza->accel);
+	else if (traversal == BVH_PAIRS)
+	{
+		printf("-pairs only works with the sbvh, ignoring it\n");
+		sponza->accel->traversal = BVH_STACK;
+	}
 
 	printf("about to gpu launch, press any key\n");
 	getchar();
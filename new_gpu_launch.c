@@ -1,13 +1,18 @@
 #include "rt.h"
 #include <fcntl.h>
+#include <stddef.h>
 
-#define SAMPLES_PER_DEVICE 50
+#ifndef SAMPLES_PER_DEVICE
+# define SAMPLES_PER_DEVICE 50
+#endif
 
 char *load_cl_file(char *file)
 {
 	int fd = open(file, O_RDONLY);
-	char *source = calloc(sizeof(char),30000); // real kernel is about 8k characters, whatever
-	read(fd, source, 30000);
+	off_t size = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	char *source = calloc(sizeof(char), size + 1);
+	read(fd, source, size);
 	close(fd);
 	return source;
 }
@@ -21,6 +26,569 @@ void reseed(gpu_scene *scene)
 	scene->seeds = h_seeds;
 }
 
+//TEXTURE IMAGES: every map becomes one RGBA8 layer of an image2d_array, resampled to the largest map's
+//size so bilinear filtering works per layer. the packed RGB buffer stays for devices
+//without image support or whose limits the array doesn't fit in.
+//MIPMAPS: both layouts carry a box-filtered chain per map. packed maps store the levels one after
+//another from the map's offset; image layers are an atlas, level 0 on the left and
+//levels 1+ stacked top to bottom in the column to its right. the kernel walks the same layout
+//FORMATS (packed buffer only, image layers stay RGBA8): masks (map_d, map_Ks) and maps whose texels are
+//all grey keep one channel. with -compress colour maps become BC1 and one channel maps BC4 blocks,
+//8 bytes per 4x4 texels. bump maps stay uncompressed, BC1 endpoints bend normals too far.
+//every map starts 8 byte aligned so the kernel reads a block as one ulong.
+//encoded chains are kept in TEX_CACHE keyed by path, size, format and a hash of the pixels. the file
+//starts with TEX_CACHE_MAGIC and TEX_CACHE_VERSION, bump the version whenever the encoders or the entry
+//layout change. a cache that doesn't match or doesn't add up is dropped and everything gets re-encoded
+
+#define TEX_CACHE "tex.cache"
+#define TEX_CACHE_MAGIC 0x43584554u //"TEXC"
+#define TEX_CACHE_VERSION 1u
+#define TEX_CACHE_MAX_DIM 65536
+#define MAP_COLOUR 0
+#define MAP_MASK 1
+#define MAP_NORMAL 2
+
+typedef struct s_tex_entry
+{
+	char path[256];
+	cl_uint hash;
+	cl_int w;
+	cl_int h;
+	cl_int format;
+	cl_uint size;
+	cl_uchar *data;
+}				TexEntry;
+
+typedef struct s_tex_cache
+{
+	TexEntry *entries;
+	int count;
+	int cap;
+	int hits;
+	int added;
+}				TexCache;
+
+static int tex_layers(Scene *s, int *w, int *h)
+{
+	int layers = 0;
+	*w = 0;
+	*h = 0;
+	for (int i = 0; i < s->mat_count; i++)
+	{
+		Map *maps[4] = {s->materials[i].map_Kd, s->materials[i].map_Ks, s->materials[i].map_bump, s->materials[i].map_d};
+		for (int j = 0; j < 4; j++)
+			if (maps[j])
+			{
+				layers++;
+				*w = maps[j]->width > *w ? maps[j]->width : *w;
+				*h = maps[j]->height > *h ? maps[j]->height : *h;
+			}
+	}
+	return layers;
+}
+
+static int mip_next(int n)
+{
+	return n > 1 ? n / 2 : 1;
+}
+
+static size_t mip_chain_size(int w, int h, int channels)
+{
+	size_t size = (size_t)w * h * channels;
+	while (w > 1 || h > 1)
+	{
+		w = mip_next(w);
+		h = mip_next(h);
+		size += (size_t)w * h * channels;
+	}
+	return size;
+}
+
+static int atlas_width(int w)
+{
+	return w + mip_next(w);
+}
+
+static int atlas_height(int w, int h)
+{
+	//the column of levels 1+ only outgrows level 0 for very wide maps
+	int column = 0;
+	int lw = w;
+	int lh = h;
+	while (lw > 1 || lh > 1)
+	{
+		lw = mip_next(lw);
+		lh = mip_next(lh);
+		column += lh;
+	}
+	return column > h ? column : h;
+}
+
+static void downsample(cl_uchar *src, int w, int h, int channels, cl_uchar *dst)
+{
+	//2x2 box filter, odd edges clamp
+	int dw = mip_next(w);
+	int dh = mip_next(h);
+	for (int y = 0; y < dh; y++)
+		for (int x = 0; x < dw; x++)
+		{
+			int x0 = 2 * x < w ? 2 * x : w - 1;
+			int y0 = 2 * y < h ? 2 * y : h - 1;
+			int x1 = x0 + 1 < w ? x0 + 1 : x0;
+			int y1 = y0 + 1 < h ? y0 + 1 : y0;
+			for (int c = 0; c < channels; c++)
+				dst[(y * dw + x) * channels + c] = (src[(y0 * w + x0) * channels + c] + src[(y0 * w + x1) * channels + c]
+												+ src[(y1 * w + x0) * channels + c] + src[(y1 * w + x1) * channels + c] + 2) / 4;
+		}
+}
+
+static void build_mips(cl_uchar *chain, int w, int h, int channels)
+{
+	//level 0 is already at the front of chain, the rest follow it
+	while (w > 1 || h > 1)
+	{
+		cl_uchar *next = chain + (size_t)w * h * channels;
+		downsample(chain, w, h, channels, next);
+		chain = next;
+		w = mip_next(w);
+		h = mip_next(h);
+	}
+}
+
+static size_t level_bytes(int format, int w, int h)
+{
+	if (format == TEX_BC1 || format == TEX_BC4)
+		return (size_t)((w + 3) / 4) * ((h + 3) / 4) * 8;
+	return (size_t)w * h * (format == TEX_GRAY ? 1 : 3);
+}
+
+static size_t packed_size(int format, int w, int h)
+{
+	size_t size = level_bytes(format, w, h);
+	while (w > 1 || h > 1)
+	{
+		w = mip_next(w);
+		h = mip_next(h);
+		size += level_bytes(format, w, h);
+	}
+	return size;
+}
+
+static size_t tex_align(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+static int map_format(Map *m, int kind, int compress)
+{
+	//masks only ever read their red channel
+	int grey = 1;
+	for (int i = 0; grey && kind != MAP_MASK && i < m->width * m->height; i++)
+		if (m->pixels[i * 3] != m->pixels[i * 3 + 1] || m->pixels[i * 3] != m->pixels[i * 3 + 2])
+			grey = 0;
+	if (compress && kind != MAP_NORMAL)
+		return grey ? TEX_BC4 : TEX_BC1;
+	return grey ? TEX_GRAY : TEX_RGB;
+}
+
+static void read_block(cl_uchar *level, int w, int h, int channels, int bx, int by, cl_uchar *block)
+{
+	//the 4x4 texels from (bx, by), clamped at the level's edge
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+		{
+			int sx = bx + x < w ? bx + x : w - 1;
+			int sy = by + y < h ? by + y : h - 1;
+			memcpy(&block[(y * 4 + x) * channels], &level[(sy * w + sx) * channels], channels);
+		}
+}
+
+static cl_ushort rgb565(int *c)
+{
+	return (cl_ushort)(((c[0] * 31 + 127) / 255) << 11 | ((c[1] * 63 + 127) / 255) << 5 | ((c[2] * 31 + 127) / 255));
+}
+
+static cl_ulong encode_bc1(cl_uchar *block)
+{
+	//endpoints on the corners of the block's colour box, green and blue flipped when they run
+	//against red so the line follows the texels, then each texel takes the nearest of the 4 entries
+	int lo[3] = {255, 255, 255};
+	int hi[3] = {0, 0, 0};
+	float mean[3] = {0.0f, 0.0f, 0.0f};
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+		{
+			lo[c] = block[i * 3 + c] < lo[c] ? block[i * 3 + c] : lo[c];
+			hi[c] = block[i * 3 + c] > hi[c] ? block[i * 3 + c] : hi[c];
+			mean[c] += block[i * 3 + c] / 16.0f;
+		}
+	for (int c = 1; c < 3; c++)
+	{
+		float cov = 0.0f;
+		for (int i = 0; i < 16; i++)
+			cov += (block[i * 3] - mean[0]) * (block[i * 3 + c] - mean[c]);
+		if (cov < 0.0f)
+		{
+			int t = lo[c];
+			lo[c] = hi[c];
+			hi[c] = t;
+		}
+	}
+	cl_ushort c0 = rgb565(hi);
+	cl_ushort c1 = rgb565(lo);
+	if (c0 < c1)
+	{
+		cl_ushort t = c0;
+		c0 = c1;
+		c1 = t;
+	}
+	cl_ulong bits = (cl_ulong)c0 | (cl_ulong)c1 << 16;
+	if (c0 == c1)
+		return bits;
+
+	//same expansion and blend as the kernel's decode
+	float p[4][3];
+	for (int e = 0; e < 2; e++)
+	{
+		cl_ushort c = e ? c1 : c0;
+		p[e][0] = (c >> 11) * 255.0f / 31.0f;
+		p[e][1] = ((c >> 5) & 63) * 255.0f / 63.0f;
+		p[e][2] = (c & 31) * 255.0f / 31.0f;
+	}
+	for (int c = 0; c < 3; c++)
+	{
+		p[2][c] = (2.0f * p[0][c] + p[1][c]) / 3.0f;
+		p[3][c] = (p[0][c] + 2.0f * p[1][c]) / 3.0f;
+	}
+	for (int i = 0; i < 16; i++)
+	{
+		int best = 0;
+		float best_d = FLT_MAX;
+		for (int e = 0; e < 4; e++)
+		{
+			float d = 0.0f;
+			for (int c = 0; c < 3; c++)
+				d += (block[i * 3 + c] - p[e][c]) * (block[i * 3 + c] - p[e][c]);
+			if (d < best_d)
+			{
+				best_d = d;
+				best = e;
+			}
+		}
+		bits |= (cl_ulong)best << (32 + 2 * i);
+	}
+	return bits;
+}
+
+static cl_ulong encode_bc4(cl_uchar *block)
+{
+	//r0 > r1 picks the 8 entry palette: r0, r1, then 6 steps from r0 to r1
+	int lo = 255;
+	int hi = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		lo = block[i] < lo ? block[i] : lo;
+		hi = block[i] > hi ? block[i] : hi;
+	}
+	cl_ulong bits = (cl_ulong)hi | (cl_ulong)lo << 8;
+	if (hi == lo)
+		return bits;
+	for (int i = 0; i < 16; i++)
+	{
+		int step = ((hi - block[i]) * 7 + (hi - lo) / 2) / (hi - lo);
+		int index = step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+		bits |= (cl_ulong)index << (16 + 3 * i);
+	}
+	return bits;
+}
+
+static void encode_level(cl_uchar *level, int w, int h, int format, cl_uchar *out)
+{
+	int channels = format == TEX_BC1 ? 3 : 1;
+	cl_uchar block[16 * 3];
+	for (int by = 0; by < h; by += 4)
+		for (int bx = 0; bx < w; bx += 4)
+		{
+			read_block(level, w, h, channels, bx, by, block);
+			cl_ulong bits = format == TEX_BC1 ? encode_bc1(block) : encode_bc4(block);
+			memcpy(out, &bits, 8);
+			out += 8;
+		}
+}
+
+static cl_uint map_hash(Map *m)
+{
+	//FNV-1a over level 0, enough to notice a texture that changed under the same path
+	cl_uint hash = 2166136261u;
+	for (int i = 0; i < m->width * m->height * 3; i++)
+		hash = (hash ^ m->pixels[i]) * 16777619u;
+	return hash;
+}
+
+static void free_tex_cache(TexCache *cache);
+
+static int sane_entry(TexEntry *e)
+{
+	//an entry has to describe a chain this build would have encoded, sizes from disk aren't trusted
+	if (e->format != TEX_BC1 && e->format != TEX_BC4)
+		return 0;
+	if (e->w <= 0 || e->h <= 0 || e->w > TEX_CACHE_MAX_DIM || e->h > TEX_CACHE_MAX_DIM)
+		return 0;
+	if (!memchr(e->path, 0, sizeof(e->path)))
+		return 0;
+	return e->size == packed_size(e->format, e->w, e->h);
+}
+
+static void load_tex_cache(TexCache *cache)
+{
+	FILE *fp = fopen(TEX_CACHE, "rb");
+	if (!fp)
+		return;
+	cl_uint header[2];
+	int ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == TEX_CACHE_MAGIC && header[1] == TEX_CACHE_VERSION;
+	TexEntry e;
+	while (ok && fread(&e, offsetof(TexEntry, data), 1, fp) == 1)
+	{
+		if (!sane_entry(&e))
+		{
+			ok = 0;
+			break;
+		}
+		e.data = malloc(e.size);
+		if (fread(e.data, 1, e.size, fp) != e.size)
+		{
+			free(e.data);
+			ok = 0;
+			break;
+		}
+		if (cache->count == cache->cap)
+		{
+			cache->cap = cache->cap ? cache->cap * 2 : 16;
+			cache->entries = realloc(cache->entries, cache->cap * sizeof(TexEntry));
+		}
+		cache->entries[cache->count++] = e;
+	}
+	fclose(fp);
+	if (!ok)
+	{
+		printf("%s is from another build or cut short, re-encoding\n", TEX_CACHE);
+		free_tex_cache(cache);
+		*cache = (TexCache){0};
+	}
+}
+
+static void save_tex_cache(TexCache *cache)
+{
+	FILE *fp = fopen(TEX_CACHE, "wb");
+	if (!fp)
+	{
+		printf("couldn't write %s\n", TEX_CACHE);
+		return;
+	}
+	cl_uint header[2] = {TEX_CACHE_MAGIC, TEX_CACHE_VERSION};
+	fwrite(header, sizeof(header), 1, fp);
+	for (int i = 0; i < cache->count; i++)
+	{
+		fwrite(&cache->entries[i], offsetof(TexEntry, data), 1, fp);
+		fwrite(cache->entries[i].data, 1, cache->entries[i].size, fp);
+	}
+	fclose(fp);
+}
+
+static void free_tex_cache(TexCache *cache)
+{
+	for (int i = 0; i < cache->count; i++)
+		free(cache->entries[i].data);
+	free(cache->entries);
+}
+
+static void encode_map(Map *m, char *path, int format, TexCache *cache, cl_uchar *out)
+{
+	//BC chain from the cache, or encoded here and added to it
+	TexEntry key = {{0}, map_hash(m), m->width, m->height, format, packed_size(format, m->width, m->height), NULL};
+	strncpy(key.path, path ? path : "", sizeof(key.path) - 1);
+	for (int i = 0; i < cache->count; i++)
+	{
+		TexEntry *e = &cache->entries[i];
+		if (e->hash == key.hash && e->w == key.w && e->h == key.h && e->format == key.format && e->size == key.size && !strcmp(e->path, key.path))
+		{
+			memcpy(out, e->data, e->size);
+			cache->hits++;
+			return;
+		}
+	}
+
+	int channels = format == TEX_BC1 ? 3 : 1;
+	cl_uchar *chain = calloc(mip_chain_size(m->width, m->height, channels), 1);
+	for (int i = 0; i < m->width * m->height; i++)
+		memcpy(&chain[i * channels], &m->pixels[i * 3], channels);
+	build_mips(chain, m->width, m->height, channels);
+
+	cl_uchar *level = chain;
+	cl_uchar *dst = out;
+	int w = m->width;
+	int h = m->height;
+	while (1)
+	{
+		encode_level(level, w, h, format, dst);
+		dst += level_bytes(format, w, h);
+		if (w == 1 && h == 1)
+			break;
+		level += (size_t)w * h * channels;
+		w = mip_next(w);
+		h = mip_next(h);
+	}
+	free(chain);
+
+	key.data = malloc(key.size);
+	memcpy(key.data, out, key.size);
+	if (cache->count == cache->cap)
+	{
+		cache->cap = cache->cap ? cache->cap * 2 : 16;
+		cache->entries = realloc(cache->entries, cache->cap * sizeof(TexEntry));
+	}
+	cache->entries[cache->count++] = key;
+	cache->added++;
+}
+
+static int images_fit(cl_device_id *ids, int count, int w, int h, int layers)
+{
+	for (int i = 0; i < count; i++)
+	{
+		cl_bool support = CL_FALSE;
+		size_t max_w = 0;
+		size_t max_h = 0;
+		size_t max_layers = 0;
+		cl_ulong max_alloc = 0;
+		clGetDeviceInfo(ids[i], CL_DEVICE_IMAGE_SUPPORT, sizeof(support), &support, NULL);
+		clGetDeviceInfo(ids[i], CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(max_w), &max_w, NULL);
+		clGetDeviceInfo(ids[i], CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(max_h), &max_h, NULL);
+		clGetDeviceInfo(ids[i], CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, sizeof(max_layers), &max_layers, NULL);
+		clGetDeviceInfo(ids[i], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+		int aw = atlas_width(w);
+		int ah = atlas_height(w, h);
+		if (!support || aw > max_w || ah > max_h || layers > max_layers || (cl_ulong)aw * ah * 4 * layers > max_alloc)
+			return 0;
+	}
+	return 1;
+}
+
+static void resample_layer(Map *m, cl_uchar *out, int w, int h)
+{
+	//bilinear from RGB at the map's size to RGBA at the layer's
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			float fx = fmax(0.0f, (x + 0.5f) * m->width / w - 0.5f);
+			float fy = fmax(0.0f, (y + 0.5f) * m->height / h - 0.5f);
+			int x0 = (int)fx;
+			int y0 = (int)fy;
+			int x1 = x0 + 1 < m->width ? x0 + 1 : x0;
+			int y1 = y0 + 1 < m->height ? y0 + 1 : y0;
+			float ax = fx - x0;
+			float ay = fy - y0;
+			for (int c = 0; c < 3; c++)
+			{
+				float top = m->pixels[(y0 * m->width + x0) * 3 + c] * (1.0f - ax) + m->pixels[(y0 * m->width + x1) * 3 + c] * ax;
+				float bottom = m->pixels[(y1 * m->width + x0) * 3 + c] * (1.0f - ax) + m->pixels[(y1 * m->width + x1) * 3 + c] * ax;
+				out[(y * w + x) * 4 + c] = (cl_uchar)(top * (1.0f - ay) + bottom * ay + 0.5f);
+			}
+			out[(y * w + x) * 4 + 3] = 255;
+		}
+}
+
+static void pack_map(Map *m, char *path, int format, TexCache *cache, cl_uchar *tex, size_t *used, gpu_scene *gs, cl_int *ind, cl_int *h, cl_int *w, cl_int *fmt)
+{
+	//fills in what the material stores for the map: byte offset into the packed buffer or layer index,
+	//the level 0 size the kernel walks the mip chain from, and how the texels are stored
+	if (gs->tex_layers)
+	{
+		int lw = gs->tex_w;
+		int lh = gs->tex_h;
+		size_t stride = (size_t)atlas_width(lw) * 4;
+		size_t layer_bytes = stride * atlas_height(gs->tex_w, gs->tex_h);
+		cl_uchar *chain = calloc(mip_chain_size(lw, lh, 4), 1);
+		resample_layer(m, chain, lw, lh);
+		build_mips(chain, lw, lh, 4);
+
+		cl_uchar *layer = &tex[*used];
+		cl_uchar *level = chain;
+		int x0 = 0;
+		int y0 = 0;
+		for (int l = 0; ; l++)
+		{
+			for (int y = 0; y < lh; y++)
+				memcpy(&layer[(y0 + y) * stride + x0 * 4], &level[y * lw * 4], lw * 4);
+			if (lw == 1 && lh == 1)
+				break;
+			level += lw * lh * 4;
+			y0 = l == 0 ? 0 : y0 + lh;
+			x0 = gs->tex_w;
+			lw = mip_next(lw);
+			lh = mip_next(lh);
+		}
+		free(chain);
+
+		*ind = *used / layer_bytes;
+		*h = gs->tex_h;
+		*w = gs->tex_w;
+		*fmt = TEX_RGB;
+		*used += layer_bytes;
+		return;
+	}
+	*used = tex_align(*used);
+	*ind = *used;
+	*h = m->height;
+	*w = m->width;
+	*fmt = format;
+	if (format == TEX_BC1 || format == TEX_BC4)
+		encode_map(m, path, format, cache, &tex[*used]);
+	else
+	{
+		int channels = format == TEX_GRAY ? 1 : 3;
+		for (int i = 0; i < m->width * m->height; i++)
+			memcpy(&tex[*used + i * channels], &m->pixels[i * 3], channels);
+		build_mips(&tex[*used], m->width, m->height, channels);
+	}
+	*used += packed_size(format, m->width, m->height);
+}
+
+static cl_uint oct_encode(cl_float3 n)
+{
+	//octahedral unit vector as two snorm16s, x in the low half. a zero vector comes back as +z
+	float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	if (l1 == 0.0f)
+		return 0;
+	float x = n.x / l1;
+	float y = n.y / l1;
+	if (n.z < 0.0f)
+	{
+		float fold_x = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fold_x;
+	}
+	cl_short sx = (cl_short)lrintf(x * 32767.0f);
+	cl_short sy = (cl_short)lrintf(y * 32767.0f);
+	return (cl_uint)(cl_ushort)sx | (cl_uint)(cl_ushort)sy << 16;
+}
+
+static cl_ushort float_to_half(float f)
+{
+	//round to nearest, too big goes to inf, below the smallest normal half flushes to 0
+	cl_uint x;
+	memcpy(&x, &f, sizeof(x));
+	cl_ushort sign = (x >> 16) & 0x8000;
+	int e = (int)((x >> 23) & 0xff) - 127 + 15;
+	cl_uint m = x & 0x7fffff;
+	if (((x >> 23) & 0xff) == 0xff)
+		return sign | 0x7c00 | (m ? 0x200 : 0);
+	if (e >= 31)
+		return sign | 0x7c00;
+	if (e <= 0)
+		return sign;
+	return sign | (((cl_uint)e << 10 | m >> 13) + ((m >> 12) & 1));
+}
+
 gpu_scene *prep_scene(Scene *s, gpu_context *CL, int xdim, int ydim)
 {
 	//SEEDS
@@ -30,123 +598,335 @@ gpu_scene *prep_scene(Scene *s, gpu_context *CL, int xdim, int ydim)
 
 
 	//TEXTURES
-	cl_int tex_size = 0;
-	for (int i = 0; i < s->mat_count; i++)
+	double start = wall_clock();
+	gpu_scene *gs = calloc(1, sizeof(gpu_scene));
+	int kinds[4] = {MAP_COLOUR, MAP_MASK, MAP_NORMAL, MAP_MASK};
+	int (*formats)[4] = calloc(s->mat_count, sizeof(int[4]));
+	size_t raw_size = 0;
+	size_t tex_size = 0;
+	if (CL->tex_images)
 	{
-		if (s->materials[i].map_Kd)
-			tex_size += s->materials[i].map_Kd->height * s->materials[i].map_Kd->width * 3;
-		if (s->materials[i].map_Ks)
-			tex_size += s->materials[i].map_Ks->height * s->materials[i].map_Ks->width * 3;
-		if (s->materials[i].map_bump)
-			tex_size += s->materials[i].map_bump->height * s->materials[i].map_bump->width * 3;
-		if (s->materials[i].map_d)
-			tex_size += s->materials[i].map_d->height * s->materials[i].map_d->width * 3;
+		gs->tex_layers = tex_layers(s, &gs->tex_w, &gs->tex_h);
+		tex_size = (size_t)atlas_width(gs->tex_w) * atlas_height(gs->tex_w, gs->tex_h) * 4 * gs->tex_layers;
 	}
+	else
+		for (int i = 0; i < s->mat_count; i++)
+		{
+			Map *maps[4] = {s->materials[i].map_Kd, s->materials[i].map_Ks, s->materials[i].map_bump, s->materials[i].map_d};
+			for (int j = 0; j < 4; j++)
+				if (maps[j])
+				{
+					formats[i][j] = map_format(maps[j], kinds[j], s->tex_compress);
+					tex_size = tex_align(tex_size) + packed_size(formats[i][j], maps[j]->width, maps[j]->height);
+					raw_size += mip_chain_size(maps[j]->width, maps[j]->height, 3);
+				}
+		}
 
 	cl_uchar *h_tex = calloc(sizeof(cl_uchar), tex_size);
 	tex_size = 0;
+	TexCache cache = {NULL, 0, 0, 0, 0};
+	if (s->tex_compress)
+		load_tex_cache(&cache);
 
 	gpu_mat *simple_mats = calloc(s->mat_count, sizeof(gpu_mat));
 	for (int i = 0; i < s->mat_count; i++)
 	{
-		simple_mats[i].Ka = s->materials[i].Ka;
-		simple_mats[i].Kd = s->materials[i].Kd;
-		simple_mats[i].Ns.x = s->materials[i].Ns;
-		simple_mats[i].Ke = s->materials[i].Ke;
+		Material *m = &s->materials[i];
+		simple_mats[i].Ka = m->Ka;
+		simple_mats[i].Kd = m->Kd;
+		simple_mats[i].Ns.x = m->Ns;
+		simple_mats[i].Ke = m->Ke;
 
-		if (s->materials[i].map_Kd)
-		{
-			memcpy(&h_tex[tex_size], s->materials[i].map_Kd->pixels, s->materials[i].map_Kd->height * s->materials[i].map_Kd->width * 3);
-			simple_mats[i].diff_ind = tex_size;
-			simple_mats[i].diff_h = s->materials[i].map_Kd->height;
-			simple_mats[i].diff_w = s->materials[i].map_Kd->width;
-			tex_size += s->materials[i].map_Kd->height * s->materials[i].map_Kd->width * 3;
-		}
+		if (m->map_Kd)
+			pack_map(m->map_Kd, m->map_Kd_path, formats[i][0], &cache, h_tex, &tex_size, gs, &simple_mats[i].diff_ind, &simple_mats[i].diff_h, &simple_mats[i].diff_w, &simple_mats[i].diff_format);
+
+		if (m->map_Ks)
+			pack_map(m->map_Ks, m->map_Ks_path, formats[i][1], &cache, h_tex, &tex_size, gs, &simple_mats[i].spec_ind, &simple_mats[i].spec_h, &simple_mats[i].spec_w, &simple_mats[i].spec_format);
+
+		if (m->map_bump)
+			pack_map(m->map_bump, m->map_bump_path, formats[i][2], &cache, h_tex, &tex_size, gs, &simple_mats[i].bump_ind, &simple_mats[i].bump_h, &simple_mats[i].bump_w, &simple_mats[i].bump_format);
 
-		if (s->materials[i].map_Ks)
+		if (m->map_d)
+			pack_map(m->map_d, m->map_d_path, formats[i][3], &cache, h_tex, &tex_size, gs, &simple_mats[i].trans_ind, &simple_mats[i].trans_h, &simple_mats[i].trans_w, &simple_mats[i].trans_format);
+	}
+	free(formats);
+	if (cache.added)
+		save_tex_cache(&cache);
+	if (s->tex_compress)
+		printf("tex cache: %d hits, %d encoded\n", cache.hits, cache.added);
+	free_tex_cache(&cache);
+	if (!CL->tex_images && raw_size)
+		printf("textures: %.1f MB on device, %.1f MB as RGB mips, prepped in %.2fs\n", tex_size / 1e6, raw_size / 1e6, wall_clock() - start);
+
+
+	//DEVICE TRIANGLES
+	//everything below A, W and O counts triangles: a quad face is its two halves side by side, a sphere
+	//is one record like a triangle. first_tri maps faces (what the refs hold) to their first triangle
+	int *first_tri = malloc(s->face_count * sizeof(int));
+	int tri_count = 0;
+	for (int i = 0; i < s->face_count; i++)
+	{
+		first_tri[i] = tri_count;
+		tri_count += s->faces[i].shape == GPU_QUAD ? 2 : 1;
+	}
+	Face *tris = malloc(tri_count * sizeof(Face));
+	for (int i = 0; i < s->face_count; i++)
+		for (int h = 0; h < (s->faces[i].shape == GPU_QUAD ? 2 : 1); h++)
+			tris[first_tri[i] + h] = quad_half(&s->faces[i], h);
+	if (tri_count != s->face_count)
+		printf("quads: %d of %d faces, %d device triangles\n", tri_count - s->face_count, s->face_count, tri_count);
+
+
+	//HIT ATTRIBUTES
+	//one record per triangle, read only after a hit (layout in new_kernel.cl): oct normals, face normal and
+	//tangent, half uvs shifted into the face's uv cell, the face's uv-to-world lod bias and its material.
+	//40 bytes against 180 for the float3 V, T, N, TN, BTN and int M arrays it replaces
+	cl_uint *A = calloc(tri_count * ATTR_STRIDE, sizeof(cl_uint));
+	for (int i = 0; i < tri_count; i++)
+	{
+		Face f = tris[i];
+		cl_uint *rec = &A[i * ATTR_STRIDE];
+		if (f.shape == GPU_SPHERE)
 		{
-			memcpy(&h_tex[tex_size], s->materials[i].map_Ks->pixels, s->materials[i].map_Ks->height * s->materials[i].map_Ks->width * 3);
-			simple_mats[i].spec_ind = tex_size;
-			simple_mats[i].spec_h = s->materials[i].map_Ks->height;
-			simple_mats[i].spec_w = s->materials[i].map_Ks->width;
-			tex_size += s->materials[i].map_Ks->height * s->materials[i].map_Ks->width * 3;
+			//normal and uv come from the hit's spherical (u, v), the uv square covers 4 pi r^2
+			float lod = 0.5f * log2f(1.0f / (4.0f * M_PI * f.verts[1].x * f.verts[1].x));
+			memcpy(&rec[ATTR_LOD], &lod, sizeof(float));
+			rec[ATTR_TAN] = ATTR_SPHERE;
+			rec[ATTR_MAT] = f.mat_ind;
+			continue;
 		}
-
-		if (s->materials[i].map_bump)
+		cl_float3 dp1 = vec_sub(f.verts[1], f.verts[0]);
+		cl_float3 dp2 = vec_sub(f.verts[2], f.verts[0]);
+		cl_float3 n = cross(dp1, dp2);
+		cl_float3 duv1 = vec_sub(f.tex[1], f.tex[0]);
+		cl_float3 duv2 = vec_sub(f.tex[2], f.tex[0]);
+
+		for (int j = 0; j < 3; j++)
+			rec[ATTR_N + j] = oct_encode(f.norms[j]);
+		rec[ATTR_GEOM] = oct_encode(n);
+
+		float cell_u = floorf(fmin(f.tex[0].x, fmin(f.tex[1].x, f.tex[2].x)));
+		float cell_v = floorf(fmin(f.tex[0].y, fmin(f.tex[1].y, f.tex[2].y)));
+		cl_ushort *uv = (cl_ushort *)&rec[ATTR_UV];
+		for (int j = 0; j < 3; j++)
 		{
-			memcpy(&h_tex[tex_size], s->materials[i].map_bump->pixels, s->materials[i].map_bump->height * s->materials[i].map_bump->width * 3);
-			simple_mats[i].bump_ind = tex_size;
-			simple_mats[i].bump_h = s->materials[i].map_bump->height;
-			simple_mats[i].bump_w = s->materials[i].map_bump->width;
-			tex_size += s->materials[i].map_bump->height * s->materials[i].map_bump->width * 3;
+			uv[j * 2] = float_to_half(f.tex[j].x - cell_u);
+			uv[j * 2 + 1] = float_to_half(f.tex[j].y - cell_v);
 		}
 
-		if (s->materials[i].map_d)
+		float lod = 0.5f * log2f(fabs(duv1.x * duv2.y - duv1.y * duv2.x) / sqrtf(dot(n, n)));
+		memcpy(&rec[ATTR_LOD], &lod, sizeof(float));
+		rec[ATTR_MAT] = f.mat_ind;
+
+		if (simple_mats[f.mat_ind].bump_h)
 		{
-			memcpy(&h_tex[tex_size], s->materials[i].map_d->pixels, s->materials[i].map_d->height * s->materials[i].map_d->width * 3);
-			simple_mats[i].trans_ind = tex_size;
-			simple_mats[i].trans_h = s->materials[i].map_d->height;
-			simple_mats[i].trans_w = s->materials[i].map_d->width;
-			tex_size += s->materials[i].map_d->height * s->materials[i].map_d->width * 3;
+			float r = duv1.x * duv2.y - duv1.y * duv2.x == 0.0f ? 1.0f : 1.0f / (duv1.x * duv2.y - duv1.y * duv2.x);
+			rec[ATTR_TAN] = oct_encode(unit_vec(vec_scale(vec_sub(vec_scale(dp1, duv2.y), vec_scale(dp2, duv1.y)), r)));
 		}
 	}
+	printf("hit attributes: %d bytes per face\n", (int)(ATTR_STRIDE * sizeof(cl_uint)));
 
 
-	//FACES
-	cl_float3 *V, *T, *N;
-	V = calloc(s->face_count * 3, sizeof(cl_float3));
-	T = calloc(s->face_count * 3, sizeof(cl_float3));
-	N = calloc(s->face_count * 3, sizeof(cl_float3));
-	cl_int *M;
-	M = calloc(s->face_count, sizeof(cl_int));
-	cl_float3 *TN, *BTN;
-	TN = calloc(s->face_count, sizeof(cl_float3));
-	BTN = calloc(s->face_count, sizeof(cl_float3));
-
+	//OPACITY RECORDS
+	//one per alpha tested face, everything traversal needs for the test without touching A or mats:
+	//the face, its uvs (same halves as its hit record), where its map_d lives and the micromap states
+	cl_uint *O = calloc((s->omm_count ? s->omm_count : 1) * OMM_STRIDE, sizeof(cl_uint));
 	for (int i = 0; i < s->face_count; i++)
 	{
 		Face f = s->faces[i];
+		if (f.alpha < 0)
+			continue;
+		gpu_mat *m = &simple_mats[f.mat_ind];
+		cl_uint *rec = &O[f.alpha * OMM_STRIDE];
+		rec[OMM_FACE] = first_tri[i];
+		memcpy(&rec[OMM_UV], &A[first_tri[i] * ATTR_STRIDE + ATTR_UV], 3 * sizeof(cl_uint));
+		rec[OMM_MAP] = m->trans_ind;
+		rec[OMM_MAP + 1] = m->trans_h;
+		rec[OMM_MAP + 2] = m->trans_w;
+		rec[OMM_MAP + 3] = m->trans_format;
+		memcpy(&rec[OMM_STATES], &s->omm[f.alpha * OMM_STATE_WORDS], OMM_STATE_WORDS * sizeof(cl_uint));
+	}
 
-		V[i * 3] = f.verts[0];
-		V[i * 3 + 1] = f.verts[1];
-		V[i * 3 + 2] = f.verts[2];
-
-		T[i * 3] = f.tex[0];
-		T[i * 3 + 1] = f.tex[1];
-		T[i * 3 + 2] = f.tex[2];
-
-		N[i * 3] = f.norms[0];
-		N[i * 3 + 1] = f.norms[1];
-		N[i * 3 + 2] = f.norms[2];
 
-		M[i] = f.mat_ind;
-		if (simple_mats[f.mat_ind].bump_h)
+	//INTERSECTION RECORDS
+	//the three vertices packed tight (36 bytes instead of 3 float3s at 48), read with vload3.
+	//vertices rather than v0/e1/e2 so the watertight test sees bit-identical shared edges
+	//with -quantize the device gets the 16 bit blob quantize_accel made instead, with -inline the
+	//positions are already in the nodes and W is a placeholder
+	size_t w_size = s->accel->quantized ? s->accel->quant_size : (s->accel->inlined ? 9 : tri_count * 9) * sizeof(cl_float);
+	cl_float *W = calloc(w_size, 1);
+	cl_float3 lo = (cl_float3){FLT_MAX, FLT_MAX, FLT_MAX};
+	cl_float3 hi = (cl_float3){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int i = 0; i < tri_count; i++)
+	{
+		cl_float3 a, b;
+		face_bounds(&tris[i], &a, &b);
+		lo = (cl_float3){fmin(lo.x, a.x), fmin(lo.y, a.y), fmin(lo.z, a.z)};
+		hi = (cl_float3){fmax(hi.x, b.x), fmax(hi.y, b.y), fmax(hi.z, b.z)};
+		if (s->accel->quantized || s->accel->inlined)
+			continue;
+		//a sphere's verts are its center and (radius, 0, 0), so its record is center, radius, zeros
+		for (int j = 0; j < 3; j++)
 		{
-			cl_float3 dp1 = vec_sub(f.verts[1], f.verts[0]);
-			cl_float3 dp2 = vec_sub(f.verts[2], f.verts[0]);
-			cl_float3 duv1 = vec_sub(f.tex[1], f.tex[0]);
-			cl_float3 duv2 = vec_sub(f.tex[2], f.tex[0]);
-			float r = duv1.x * duv2.y - duv1.y * duv2.x == 0.0f ? 1.0f : 1.0f / (duv1.x * duv2.y - duv1.y * duv2.x);
-
-			TN[i] = unit_vec(vec_scale(vec_sub(vec_scale(dp1, duv2.y), vec_scale(dp2, duv1.y)), r));
-			TN[i] = unit_vec(vec_scale(vec_sub(vec_scale(dp1, duv2.y), vec_scale(dp2, duv1.y)), r));
-			BTN[i] = unit_vec(cross(TN[i], cross(vec_sub(f.verts[1], f.verts[0]), vec_sub(f.verts[2], f.verts[0]))));
+			cl_float3 p = tris[i].verts[j];
+			W[i * 9 + j * 3] = p.x;
+			W[i * 9 + j * 3 + 1] = p.y;
+			W[i * 9 + j * 3 + 2] = p.z;
 		}
 	}
+	if (s->accel->quantized)
+		memcpy(W, s->accel->quant, w_size);
 
+	//REFS (leaf references into the unique face arrays above)
+	cl_int *I = calloc(s->accel->ref_count, sizeof(cl_int));
+	for (int i = 0; i < s->accel->ref_count; i++)
+	{
+		Face *f = &s->faces[s->accel->refs[i]];
+		if (f->alpha >= 0)
+			I[i] = ALPHA_TEST | f->alpha;
+		else
+			I[i] = (f->shape == GPU_QUAD ? QUAD_REF : (f->shape == GPU_SPHERE ? SPHERE_REF : 0)) | first_tri[s->accel->refs[i]];
+	}
+	free(first_tri);
+	free(tris);
 
-	//BINS
-	gpu_bin *flat_bvh = flatten_bvh(s);
-	printf("BVH has been flattened (?)\n");
+	//NODES (already flat, whichever structure was built)
+	void *nodes = malloc(s->accel->node_size);
+	memcpy(nodes, s->accel->nodes, s->accel->node_size);
 
 	//COMBINE
-	gpu_scene *gs = calloc(1, sizeof(gpu_scene));
-	*gs = (gpu_scene){V, T, N, M, TN, BTN, s->face_count * 3, flat_bvh, s->bin_count, h_tex, tex_size, simple_mats, s->mat_count, h_seeds, xdim * ydim * 2 * CL->numDevices * CL->numPlatforms};
+	*gs = (gpu_scene){A, tri_count * 3, W, w_size, lo, hi, I, s->accel->ref_count, O, s->omm_count, nodes, s->accel->node_size, s->accel->type, h_tex, tex_size, gs->tex_w, gs->tex_h, gs->tex_layers, simple_mats, s->mat_count, h_seeds, xdim * ydim * 2 * CL->numDevices * CL->numPlatforms};
 	printf("made gs\n");
 	return gs;
 }
 
-gpu_context *prep_gpu(void)
+//KERNEL VARIANTS: the kernel is built for the scene's features (-D SCENE_MAPS, MAX_BOUNCES next to the
+//accel and texture options) so branches for maps no material has compile away. each variant's device
+//binaries are kept in a KERNEL_CACHE file named by a hash of source, options and devices, later runs with
+//the same feature set load that instead of compiling. any trouble with the cache falls back to the source
+
+#define KERNEL_CACHE "kernel_%016llx.bin"
+
+static int scene_maps(Scene *s)
+{
+	int maps = 0;
+	for (int i = 0; i < s->mat_count; i++)
+	{
+		maps |= s->materials[i].map_Kd ? MAPS_DIFF : 0;
+		maps |= s->materials[i].map_Ks ? MAPS_SPEC : 0;
+		maps |= s->materials[i].map_bump ? MAPS_BUMP : 0;
+		maps |= s->materials[i].map_d ? MAPS_TRANS : 0;
+	}
+	return maps;
+}
+
+static cl_ulong fnv64(cl_ulong hash, const void *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ ((const unsigned char *)data)[i]) * 1099511628211ull;
+	return hash;
+}
+
+static cl_program load_binaries(cl_context context, cl_device_id *ids, cl_uint count, const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return NULL;
+	cl_uint n = 0;
+	size_t sizes[count];
+	unsigned char *bins[count];
+	int ok = fread(&n, sizeof(n), 1, fp) == 1 && n == count && fread(sizes, sizeof(size_t), count, fp) == count;
+
+	//a truncated or foreign file can carry any sizes, they have to add up to what's left of it
+	long body = ok ? ftell(fp) : -1;
+	long end = ok && fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+	ok = ok && body >= 0 && end >= body && fseek(fp, body, SEEK_SET) == 0;
+	size_t left = ok ? (size_t)(end - body) : 0;
+	for (int i = 0; i < count && ok; i++)
+	{
+		ok = sizes[i] > 0 && sizes[i] <= left;
+		left -= ok ? sizes[i] : 0;
+	}
+	ok = ok && left == 0;
+	if (!ok)
+		printf("%s doesn't match its header, building from source\n", path);
+
+	for (int i = 0; i < count; i++)
+	{
+		bins[i] = ok ? malloc(sizes[i]) : NULL;
+		ok = ok && fread(bins[i], 1, sizes[i], fp) == sizes[i];
+	}
+	fclose(fp);
+
+	cl_program program = NULL;
+	if (ok)
+	{
+		cl_int err;
+		program = clCreateProgramWithBinary(context, count, ids, sizes, (const unsigned char **)bins, NULL, &err);
+		if (err != CL_SUCCESS)
+			program = NULL;
+	}
+	for (int i = 0; i < count; i++)
+		free(bins[i]);
+	return program;
+}
+
+static void save_binaries(cl_program program, cl_uint count, const char *path)
+{
+	size_t sizes[count];
+	unsigned char *bins[count];
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(sizes), sizes, NULL) != CL_SUCCESS)
+		return;
+	for (int i = 0; i < count; i++)
+		bins[i] = malloc(sizes[i]);
+	FILE *fp = NULL;
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(bins), bins, NULL) == CL_SUCCESS && (fp = fopen(path, "wb")))
+	{
+		fwrite(&count, sizeof(count), 1, fp);
+		fwrite(sizes, sizeof(size_t), count, fp);
+		for (int i = 0; i < count; i++)
+			fwrite(bins[i], 1, sizes[i], fp);
+		fclose(fp);
+	}
+	for (int i = 0; i < count; i++)
+		free(bins[i]);
+}
+
+static cl_program build_program(cl_context context, cl_device_id *ids, cl_uint count, char *source, char *options)
+{
+	cl_ulong hash = fnv64(14695981039346656037ull, source, strlen(source));
+	hash = fnv64(hash, options, strlen(options));
+	for (int i = 0; i < count; i++)
+	{
+		char name[256] = {0};
+		char driver[256] = {0};
+		clGetDeviceInfo(ids[i], CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+		clGetDeviceInfo(ids[i], CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+		hash = fnv64(hash, name, strlen(name));
+		hash = fnv64(hash, driver, strlen(driver));
+	}
+	char path[64];
+	snprintf(path, sizeof(path), KERNEL_CACHE, (unsigned long long)hash);
+
+	cl_program program = load_binaries(context, ids, count, path);
+	if (program && clBuildProgram(program, count, ids, options, NULL, NULL) == CL_SUCCESS)
+	{
+		printf("kernel variant from %s\n", path);
+		return program;
+	}
+	if (program)
+		clReleaseProgram(program);
+
+	cl_int err;
+	program = clCreateProgramWithSource(context, 1, (const char **)&source, NULL, &err);
+	if (clBuildProgram(program, count, ids, options, NULL, NULL) != CL_SUCCESS)
+		return NULL;
+	save_binaries(program, count, path);
+	printf("kernel variant built, saved to %s\n", path);
+	return program;
+}
+
+gpu_context *prep_gpu(int accel, int traversal, Scene *S)
 {
 	// printf("prepping for GPU launch\n");
 	gpu_context *gpu = calloc(1, sizeof(gpu_context));
@@ -170,6 +950,8 @@ gpu_context *prep_gpu(void)
     }
 
     printf("%u devices, %u platforms\n", gpu->numDevices, gpu->numPlatforms);
+    if (gpu->numDevices == 0)
+        return NULL;
 
     //get ids for devices and create (platforms) compute contexts, (devices) command queues
     cl_device_id device_ids[gpu->numDevices];
@@ -189,26 +971,218 @@ gpu_context *prep_gpu(void)
 
 
     char *source = load_cl_file("new_kernel.cl");
+    //textures go in an image array if every device can hold it, compressed ones always stay packed
+    int tex_w, tex_h;
+    int layers = S ? tex_layers(S, &tex_w, &tex_h) : 0;
+    gpu->tex_images = layers && !S->tex_compress && images_fit(device_ids, gpu->numDevices, tex_w, tex_h, layers);
+    if (layers)
+        printf("textures: %s\n", gpu->tex_images ? "image2d_array" : (S->tex_compress ? "packed buffer, BC1/BC4" : "packed buffer (device image limits)"));
+
+    char options[256];
+    int n = snprintf(options, sizeof(options), "-D ACCEL=%d -D BVH_TRAVERSAL=%d -D TEX_IMAGES=%d -D QUANTIZED=%d -D INLINE_LEAVES=%d",
+        accel, traversal, gpu->tex_images, S ? S->accel->quantized : 0, S ? S->accel->inlined : 0);
+    if (S)
+        snprintf(options + n, sizeof(options) - n,  " -D SCENE_MAPS=%d -D SCENE_SPHERES=%d -D MAX_BOUNCES=%d -D PIXEL_ORDER=%d -D BVH_STACK_SIZE=%d",
+            scene_maps(S), count_shape(S, GPU_SPHERE) > 0, S->max_bounces, S->pixel_order,
+            bvh_stack_size(S->accel->type == ACCEL_BVH ? S->accel->depth : 0));
+    printf("kernel options: %s\n", options);
 
 
     //create (platforms) programs and build them
     gpu->programs = calloc(gpu->numPlatforms, sizeof(cl_program));
+    offset = 0;
     for (int i = 0; i < gpu->numPlatforms; i++)
     {
-    	gpu->programs[i] = clCreateProgramWithSource(gpu->contexts[i], 1, (const char **) &source, NULL, &err);
-    	err = clBuildProgram(gpu->programs[i], 0, NULL, NULL, NULL, NULL);
-    	if (err != CL_SUCCESS)
+    	cl_uint d;
+    	clGetDeviceIDs(gpu->platform[i], CL_DEVICE_TYPE_GPU, 0, NULL, &d);
+    	gpu->programs[i] = build_program(gpu->contexts[i], &device_ids[offset], d, source, options);
+    	if (!gpu->programs[i])
     	{
     	 	printf("bad compile\n");
     	 	exit(0);
     	}
-	    free(source);
+    	offset += d;
     }
+    free(source);
     printf("good compile\n");
     //getchar();
     return gpu;
 }
 
+#define CALIBRATE_ITEMS 65536
+#define CALIBRATE_PRIMS 4096 //power of two, the kernels pick prims with CALIBRATE_PRIMS - 1
+#define CALIBRATE_LOOPS 256
+
+static double time_calibration(gpu_context *CL, cl_kernel k, cl_mem prims, cl_mem rays, cl_mem out)
+{
+	//returns ns per test on the first device
+	size_t items = CALIBRATE_ITEMS;
+	size_t groupsize = 256;
+	cl_int prim_mask = CALIBRATE_PRIMS - 1;
+	cl_int tests = CALIBRATE_LOOPS;
+	clSetKernelArg(k, 0, sizeof(cl_mem), &prims);
+	clSetKernelArg(k, 1, sizeof(cl_mem), &rays);
+	clSetKernelArg(k, 2, sizeof(cl_int), &prim_mask);
+	clSetKernelArg(k, 3, sizeof(cl_int), &tests);
+	clSetKernelArg(k, 4, sizeof(cl_mem), &out);
+
+	cl_ulong best = 0;
+	for (int run = 0; run < 3; run++) //first run warms up, keep the fastest
+	{
+		cl_event done;
+		clEnqueueNDRangeKernel(CL->commands[0], k, 1, 0, &items, &groupsize, 0, NULL, &done);
+		clFinish(CL->commands[0]);
+		cl_ulong start, end;
+		clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+		clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+		clReleaseEvent(done);
+		if (run && (!best || end - start < best))
+			best = end - start;
+	}
+	return (double)best / ((double)CALIBRATE_ITEMS * (double)CALIBRATE_LOOPS);
+}
+
+static void release_gpu(gpu_context *CL)
+{
+	for (int i = 0; i < CL->numDevices; i++)
+		clReleaseCommandQueue(CL->commands[i]);
+	for (int i = 0; i < CL->numPlatforms; i++)
+	{
+		if (CL->programs[i])
+			clReleaseProgram(CL->programs[i]);
+		if (CL->contexts[i])
+			clReleaseContext(CL->contexts[i]);
+	}
+	free(CL->commands);
+	free(CL->programs);
+	free(CL->contexts);
+	free(CL->platform);
+	free(CL);
+}
+
+int gpu_calibrate(double *box_ns, double *tri_ns)
+{
+	gpu_context *CL = prep_gpu(ACCEL_BVH, BVH_STACK, NULL);
+	if (!CL)
+		return 0;
+
+	//random boxes and triangles in a unit cube, random rays through it
+	gpu_bin *boxes = calloc(CALIBRATE_PRIMS, sizeof(gpu_bin));
+	cl_float *W = calloc(CALIBRATE_PRIMS * 9, sizeof(cl_float));
+	for (int i = 0; i < CALIBRATE_PRIMS; i++)
+	{
+		cl_float3 c = (cl_float3){(float)rand() / RAND_MAX, (float)rand() / RAND_MAX, (float)rand() / RAND_MAX};
+		float h = 0.1f * (float)rand() / RAND_MAX;
+		boxes[i] = (gpu_bin){c.x - h, c.y - h, c.z - h, 0, c.x + h, c.y + h, c.z + h, 0};
+		cl_float3 tri[3] = {c, vec_add(c, (cl_float3){0.2f * (float)rand() / RAND_MAX, 0.0f, 0.1f}), vec_add(c, (cl_float3){0.0f, 0.2f * (float)rand() / RAND_MAX, -0.1f})};
+		for (int j = 0; j < 3; j++)
+		{
+			W[9 * i + 3 * j] = tri[j].x;
+			W[9 * i + 3 * j + 1] = tri[j].y;
+			W[9 * i + 3 * j + 2] = tri[j].z;
+		}
+	}
+	cl_float3 *rays = calloc(CALIBRATE_ITEMS * 2, sizeof(cl_float3));
+	for (int i = 0; i < CALIBRATE_ITEMS; i++)
+	{
+		rays[2 * i] = (cl_float3){(float)rand() / RAND_MAX, (float)rand() / RAND_MAX, (float)rand() / RAND_MAX};
+		rays[2 * i + 1] = unit_vec((cl_float3){(float)rand() / RAND_MAX - 0.5f, (float)rand() / RAND_MAX - 0.5f, (float)rand() / RAND_MAX - 0.5f});
+	}
+
+	cl_mem d_boxes = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(gpu_bin) * CALIBRATE_PRIMS, boxes, NULL);
+	cl_mem d_W = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float) * CALIBRATE_PRIMS * 9, W, NULL);
+	cl_mem d_rays = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float3) * CALIBRATE_ITEMS * 2, rays, NULL);
+	cl_mem d_out = clCreateBuffer(CL->contexts[0], CL_MEM_WRITE_ONLY, sizeof(cl_int) * CALIBRATE_ITEMS, NULL, NULL);
+
+	cl_kernel box_kernel = clCreateKernel(CL->programs[0], "calibrate_boxes", NULL);
+	cl_kernel tri_kernel = clCreateKernel(CL->programs[0], "calibrate_tris", NULL);
+	*box_ns = time_calibration(CL, box_kernel, d_boxes, d_rays, d_out);
+	*tri_ns = time_calibration(CL, tri_kernel, d_W, d_rays, d_out);
+
+	clReleaseKernel(box_kernel);
+	clReleaseKernel(tri_kernel);
+	clReleaseMemObject(d_boxes);
+	clReleaseMemObject(d_W);
+	clReleaseMemObject(d_rays);
+	clReleaseMemObject(d_out);
+	free(boxes);
+	free(W);
+	free(rays);
+	release_gpu(CL);
+	return 1;
+}
+
+double gpu_occlusion(Scene *S, Accel *accel, cl_float4 *rays, int ray_count, cl_int *hits, cl_uint *counts)
+{
+	//runs occlusion_test over rays (see the kernel) with accel on the first device.
+	//returns the kernel's seconds, or -1 without a device
+	Accel *kept = S->accel;
+	S->accel = accel;
+	gpu_context *CL = prep_gpu(accel->type, accel->traversal, S);
+	if (!CL)
+	{
+		S->accel = kept;
+		return -1.0;
+	}
+	gpu_scene *scene = prep_scene(S, CL, 1, 1);
+	S->accel = kept;
+
+	cl_mem d_bins = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, scene->node_size, scene->nodes, NULL);
+	cl_mem d_W = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, scene->w_size, scene->W, NULL);
+	cl_mem d_I = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * scene->ref_count, scene->I, NULL);
+	cl_mem d_O = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint) * OMM_STRIDE * (scene->omm_count ? scene->omm_count : 1), scene->O, NULL);
+	cl_mem d_tex;
+	if (CL->tex_images)
+	{
+		cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+		cl_image_desc desc = {CL_MEM_OBJECT_IMAGE2D_ARRAY, atlas_width(scene->tex_w), atlas_height(scene->tex_w, scene->tex_h), 1, scene->tex_layers, 0, 0, 0, 0, NULL};
+		d_tex = clCreateImage(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format, &desc, scene->tex, NULL);
+	}
+	else
+		d_tex = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | (scene->tex_size ? CL_MEM_COPY_HOST_PTR : 0), scene->tex_size ? scene->tex_size : 1, scene->tex_size ? scene->tex : NULL, NULL);
+	cl_mem d_rays = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float4) * 2 * ray_count, rays, NULL);
+	cl_mem d_hits = clCreateBuffer(CL->contexts[0], CL_MEM_WRITE_ONLY, sizeof(cl_int) * ray_count, NULL, NULL);
+	cl_mem d_counts = clCreateBuffer(CL->contexts[0], CL_MEM_WRITE_ONLY, sizeof(cl_uint) * 2 * ray_count, NULL, NULL);
+
+	cl_kernel k = clCreateKernel(CL->programs[0], "occlusion_test", NULL);
+	clSetKernelArg(k, 0, sizeof(cl_mem), &d_bins);
+	clSetKernelArg(k, 1, sizeof(cl_mem), &d_W);
+	clSetKernelArg(k, 2, sizeof(cl_mem), &d_I);
+	clSetKernelArg(k, 3, sizeof(cl_mem), &d_O);
+	clSetKernelArg(k, 4, sizeof(cl_mem), &d_tex);
+	clSetKernelArg(k, 5, sizeof(cl_mem), &d_rays);
+	clSetKernelArg(k, 6, sizeof(cl_int), &ray_count);
+	clSetKernelArg(k, 7, sizeof(cl_mem), &d_hits);
+	clSetKernelArg(k, 8, sizeof(cl_mem), &d_counts);
+
+	size_t groupsize = 256;
+	size_t items = (ray_count + groupsize - 1) / groupsize * groupsize;
+	cl_event done;
+	clEnqueueNDRangeKernel(CL->commands[0], k, 1, 0, &items, &groupsize, 0, NULL, &done);
+	clEnqueueReadBuffer(CL->commands[0], d_hits, CL_TRUE, 0, sizeof(cl_int) * ray_count, hits, 1, &done, NULL);
+	clEnqueueReadBuffer(CL->commands[0], d_counts, CL_TRUE, 0, sizeof(cl_uint) * 2 * ray_count, counts, 0, NULL, NULL);
+	cl_ulong start, end;
+	clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+	clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+	clReleaseEvent(done);
+
+	clReleaseKernel(k);
+	cl_mem bufs[] = {d_bins, d_W, d_I, d_O, d_tex, d_rays, d_hits, d_counts};
+	for (int i = 0; i < sizeof(bufs) / sizeof(cl_mem); i++)
+		clReleaseMemObject(bufs[i]);
+	free(scene->A);
+	free(scene->W);
+	free(scene->I);
+	free(scene->O);
+	free(scene->nodes);
+	free(scene->tex);
+	free(scene->mats);
+	free(scene->seeds);
+	free(scene);
+	release_gpu(CL);
+	return (double)(end - start) / 1000000000.0;
+}
+
 cl_double3 *composite(cl_float3 **outputs, int numDevices, int resolution)
 {
 	cl_double3 *output_sum = calloc(resolution, sizeof(cl_double3));
@@ -295,11 +1269,363 @@ cl_double3 *debug_composite(cl_float3 **outputs, int numDevices, int resolution)
 	return output_sum;
 }
 
+//WAVEFRONT: see the kernel. each device owns one path slot per pixel, the host only reads back
+//the length of the next extend queue once per iteration to size the launches.
+//every launch is timed with its event and summed per iteration (~bounce depth, regenerated paths mix in later)
+
+#define WF_GROUPSIZE 256
+#define WF_NEXT 0
+#define WF_SHADE 1
+#define WF_DEPTHS 8 //iterations past this are lumped into the last row
+#define WF_MAX_EVENTS 16
+
+//timed stages
+#define WF_T_SORT 0
+#define WF_T_EXTEND 1
+#define WF_T_SHADE 2 //logic, shade and generate
+
+typedef struct s_wf_device
+{
+	cl_mem ray_o;
+	cl_mem ray_d;
+	cl_mem mask;
+	cl_mem depth;
+	cl_mem cone;
+	cl_mem samples;
+	cl_mem hit_t;
+	cl_mem hit_u;
+	cl_mem hit_v;
+	cl_mem hit_ind;
+	cl_mem q_extend;
+	cl_mem q_next;
+	cl_mem q_shade;
+	cl_mem q_regen;
+	cl_mem counters;
+	cl_mem q_sort;
+	cl_mem keys;
+	cl_mem hist;
+	cl_int counts[3];
+	int iterations;
+
+	cl_event events[WF_MAX_EVENTS];
+	int event_stage[WF_MAX_EVENTS];
+	int event_count;
+	double ms[WF_DEPTHS][3];
+	long paths[WF_DEPTHS];
+}				wf_device;
+
+static void wf_enqueue(cl_command_queue queue, cl_kernel k, size_t global, size_t group, wf_device *w, int stage)
+{
+	cl_event *ev = w && w->event_count < WF_MAX_EVENTS ? &w->events[w->event_count] : NULL;
+	clEnqueueNDRangeKernel(queue, k, 1, 0, &global, &group, 0, NULL, ev);
+	if (ev)
+		w->event_stage[w->event_count++] = stage;
+}
+
+static void wf_launch(cl_command_queue queue, cl_kernel k, int count, wf_device *w, int stage)
+{
+	if (count <= 0)
+		return;
+	wf_enqueue(queue, k, ((count + WF_GROUPSIZE - 1) / WF_GROUPSIZE) * WF_GROUPSIZE, WF_GROUPSIZE, w, stage);
+}
+
+static void wf_collect(wf_device *w)
+{
+	//call after the queue finished, adds this iteration's launches to its row
+	int row = w->iterations - 1 < WF_DEPTHS ? w->iterations - 1 : WF_DEPTHS - 1;
+	for (int i = 0; i < w->event_count; i++)
+	{
+		cl_ulong start, end;
+		clGetEventProfilingInfo(w->events[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+		clGetEventProfilingInfo(w->events[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+		if (row >= 0)
+			w->ms[row][w->event_stage[i]] += (double)(end - start) / 1000000.0;
+		clReleaseEvent(w->events[i]);
+	}
+	w->event_count = 0;
+}
+
+static void wf_set_args(cl_kernel k, int first, int count, cl_mem *args)
+{
+	for (int i = 0; i < count; i++)
+		clSetKernelArg(k, first + i, sizeof(cl_mem), &args[i]);
+}
+
+static void wf_sort(cl_command_queue queue, wf_device *w, cl_kernel key, int first, cl_kernel *sort, cl_mem *q, cl_int which, int count)
+{
+	//counting sort of *q by the keys the key kernel writes. the key kernel's own inputs are set by the
+	//caller, its queue / counters / which / keys args start at first
+	static cl_int zero[WF_BINS];
+	clEnqueueWriteBuffer(queue, w->hist, CL_FALSE, 0, sizeof(zero), zero, 0, NULL, NULL);
+
+	wf_set_args(key, first, 2, (cl_mem[]){*q, w->counters});
+	clSetKernelArg(key, first + 2, sizeof(cl_int), &which);
+	clSetKernelArg(key, first + 3, sizeof(cl_mem), &w->keys);
+	wf_launch(queue, key, count, w, WF_T_SORT);
+
+	wf_set_args(sort[0], 0, 2, (cl_mem[]){w->keys, w->counters});
+	clSetKernelArg(sort[0], 2, sizeof(cl_int), &which);
+	clSetKernelArg(sort[0], 3, sizeof(cl_mem), &w->hist);
+	wf_launch(queue, sort[0], count, w, WF_T_SORT);
+
+	clSetKernelArg(sort[1], 0, sizeof(cl_mem), &w->hist);
+	wf_enqueue(queue, sort[1], WF_SCAN_GROUP, WF_SCAN_GROUP, w, WF_T_SORT);
+
+	wf_set_args(sort[2], 0, 3, (cl_mem[]){*q, w->keys, w->counters});
+	clSetKernelArg(sort[2], 3, sizeof(cl_int), &which);
+	wf_set_args(sort[2], 4, 2, (cl_mem[]){w->hist, w->q_sort});
+	wf_launch(queue, sort[2], count, w, WF_T_SORT);
+
+	cl_mem swap = *q;
+	*q = w->q_sort;
+	w->q_sort = swap;
+}
+
+static void wf_report(wf_device *wf, cl_uint d, int sorted, double seconds)
+{
+	printf("wavefront%s took %.3f seconds\n", sorted ? " (sorted)" : "", seconds);
+	printf("iter      paths   sort ms  extend ms  shade ms  Mpaths/s\n");
+	for (int row = 0; row < WF_DEPTHS; row++)
+	{
+		long paths = 0;
+		double ms[3] = {0.0, 0.0, 0.0};
+		for (int i = 0; i < d; i++)
+		{
+			paths += wf[i].paths[row];
+			for (int j = 0; j < 3; j++)
+				ms[j] += wf[i].ms[row][j];
+		}
+		if (paths == 0)
+			continue;
+		double total = ms[WF_T_SORT] + ms[WF_T_EXTEND] + ms[WF_T_SHADE];
+		printf("%s%-4d %9ld %9.2f %10.2f %9.2f %9.2f\n", row == WF_DEPTHS - 1 ? ">=" : "  ", row + 1, paths,
+			ms[WF_T_SORT], ms[WF_T_EXTEND], ms[WF_T_SHADE], total > 0.0 ? (double)paths / total / 1000.0 : 0.0);
+	}
+}
+
+static void render_wavefront(gpu_context *CL, cl_uint d, t_camera cam, cl_uint width, size_t resolution, cl_uint samples, int sorted,
+							gpu_scene *scene, cl_mem *d_seeds, cl_mem *d_outputs, cl_float3 **outputs, cl_mem *geometry, cl_mem *shading)
+{
+	//geometry: W, I, bins, O. shading: A, mats, tex
+	cl_kernel generate = clCreateKernel(CL->programs[0], "wf_generate", NULL);
+	cl_kernel extend = clCreateKernel(CL->programs[0], "wf_extend", NULL);
+	cl_kernel logic = clCreateKernel(CL->programs[0], "wf_logic", NULL);
+	cl_kernel shade = clCreateKernel(CL->programs[0], "wf_shade", NULL);
+	cl_kernel key_rays = clCreateKernel(CL->programs[0], "wf_key_rays", NULL);
+	cl_kernel key_mats = clCreateKernel(CL->programs[0], "wf_key_mats", NULL);
+	cl_kernel sort[3];
+	sort[0] = clCreateKernel(CL->programs[0], "wf_histogram", NULL);
+	sort[1] = clCreateKernel(CL->programs[0], "wf_scan", NULL);
+	sort[2] = clCreateKernel(CL->programs[0], "wf_scatter", NULL);
+
+	//ray keys quantize origins to cells of the scene bounds
+	clSetKernelArg(key_rays, 2, sizeof(cl_float3), &scene->lo);
+	clSetKernelArg(key_rays, 3, sizeof(cl_float3), &scene->hi);
+	clSetKernelArg(key_mats, 1, sizeof(cl_mem), &shading[0]);
+
+	clSetKernelArg(generate, 0, sizeof(cl_float3), &cam.origin);
+	clSetKernelArg(generate, 1, sizeof(cl_float3), &cam.focus);
+	clSetKernelArg(generate, 2, sizeof(cl_float3), &cam.d_x);
+	clSetKernelArg(generate, 3, sizeof(cl_float3), &cam.d_y);
+	clSetKernelArg(generate, 4, sizeof(cl_uint), &width);
+	wf_set_args(extend, 0, 3, geometry);
+	wf_set_args(extend, 11, 2, (cl_mem[]){geometry[3], shading[2]});
+	clSetKernelArg(logic, 4, sizeof(cl_uint), &samples);
+	wf_set_args(shade, 0, 3, shading);
+	clSetKernelArg(shade, 14, sizeof(cl_uint), &samples);
+
+	cl_int *identity = calloc(resolution, sizeof(cl_int));
+	cl_float3 *zeroes = calloc(resolution, sizeof(cl_float3));
+	for (int i = 0; i < resolution; i++)
+		identity[i] = i;
+	cl_int reset[3] = {0, 0, 0};
+	cl_int first[3] = {0, 0, resolution};
+
+	double start = wall_clock();
+	wf_device *wf = calloc(d, sizeof(wf_device));
+	for (int i = 0; i < d; i++)
+	{
+		cl_context c = CL->contexts[0];
+		wf[i].ray_o = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float3) * resolution, NULL, NULL);
+		wf[i].ray_d = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float3) * resolution, NULL, NULL);
+		wf[i].mask = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float3) * resolution, NULL, NULL);
+		wf[i].depth = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].cone = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float2) * resolution, NULL, NULL);
+		wf[i].samples = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].hit_t = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float) * resolution, NULL, NULL);
+		wf[i].hit_u = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float) * resolution, NULL, NULL);
+		wf[i].hit_v = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_float) * resolution, NULL, NULL);
+		wf[i].hit_ind = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].q_extend = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].q_next = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].q_shade = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].q_regen = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].counters = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * 3, NULL, NULL);
+		wf[i].q_sort = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].keys = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * resolution, NULL, NULL);
+		wf[i].hist = clCreateBuffer(c, CL_MEM_READ_WRITE, sizeof(cl_int) * WF_BINS, NULL, NULL);
+
+		//every pixel starts out wanting its first sample
+		clEnqueueWriteBuffer(CL->commands[i], d_outputs[i], CL_FALSE, 0, sizeof(cl_float3) * resolution, zeroes, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], wf[i].samples, CL_FALSE, 0, sizeof(cl_int) * resolution, zeroes, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], wf[i].q_regen, CL_FALSE, 0, sizeof(cl_int) * resolution, identity, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], wf[i].counters, CL_TRUE, 0, sizeof(cl_int) * 3, first, 0, NULL, NULL);
+	}
+	free(identity);
+	free(zeroes);
+
+	//first camera rays go straight into the next extend queue
+	for (int i = 0; i < d; i++)
+	{
+		wf_set_args(generate, 5, 9, (cl_mem[]){d_seeds[i], wf[i].ray_o, wf[i].ray_d, wf[i].mask, wf[i].depth, wf[i].cone, wf[i].q_regen, wf[i].q_next, wf[i].counters});
+		wf_launch(CL->commands[i], generate, resolution, NULL, 0);
+		clEnqueueReadBuffer(CL->commands[i], wf[i].counters, CL_FALSE, 0, sizeof(cl_int) * 3, wf[i].counts, 0, NULL, NULL);
+		clFlush(CL->commands[i]);
+	}
+	for (int i = 0; i < d; i++)
+		clFinish(CL->commands[i]);
+
+	int active = 1;
+	while (active)
+	{
+		active = 0;
+		for (int i = 0; i < d; i++)
+		{
+			cl_int count = wf[i].counts[WF_NEXT];
+			if (count == 0)
+				continue;
+			active = 1;
+			wf[i].iterations++;
+			wf[i].paths[wf[i].iterations - 1 < WF_DEPTHS ? wf[i].iterations - 1 : WF_DEPTHS - 1] += count;
+
+			cl_mem swap = wf[i].q_extend;
+			wf[i].q_extend = wf[i].q_next;
+			wf[i].q_next = swap;
+
+			//first iteration is all camera rays, already coherent in pixel order.
+			//counters still hold the last iteration's lengths until the reset below
+			if (sorted && wf[i].iterations > 1)
+			{
+				wf_set_args(key_rays, 0, 2, (cl_mem[]){wf[i].ray_o, wf[i].ray_d});
+				wf_sort(CL->commands[i], &wf[i], key_rays, 4, sort, &wf[i].q_extend, WF_NEXT, count);
+			}
+			clEnqueueWriteBuffer(CL->commands[i], wf[i].counters, CL_FALSE, 0, sizeof(cl_int) * 3, reset, 0, NULL, NULL);
+
+			wf_set_args(extend, 3, 3, (cl_mem[]){wf[i].ray_o, wf[i].ray_d, wf[i].q_extend});
+			clSetKernelArg(extend, 6, sizeof(cl_int), &count);
+			wf_set_args(extend, 7, 4, (cl_mem[]){wf[i].hit_t, wf[i].hit_u, wf[i].hit_v, wf[i].hit_ind});
+			wf_launch(CL->commands[i], extend, count, &wf[i], WF_T_EXTEND);
+
+			wf_set_args(logic, 0, 4, (cl_mem[]){wf[i].mask, d_outputs[i], wf[i].hit_ind, wf[i].samples});
+			clSetKernelArg(logic, 5, sizeof(cl_mem), &wf[i].q_extend);
+			clSetKernelArg(logic, 6, sizeof(cl_int), &count);
+			wf_set_args(logic, 7, 3, (cl_mem[]){wf[i].q_shade, wf[i].q_regen, wf[i].counters});
+			wf_launch(CL->commands[i], logic, count, &wf[i], WF_T_SHADE);
+
+			if (sorted)
+			{
+				clSetKernelArg(key_mats, 0, sizeof(cl_mem), &wf[i].hit_ind);
+				wf_sort(CL->commands[i], &wf[i], key_mats, 2, sort, &wf[i].q_shade, WF_SHADE, count);
+			}
+
+			//shade and generate can't see more paths than were extended, the counters trim the rest
+			wf_set_args(shade, 3, 11, (cl_mem[]){d_seeds[i], wf[i].ray_o, wf[i].ray_d, wf[i].mask, wf[i].depth, wf[i].cone,
+				wf[i].hit_t, wf[i].hit_u, wf[i].hit_v, wf[i].hit_ind, wf[i].samples});
+			wf_set_args(shade, 15, 4, (cl_mem[]){wf[i].q_shade, wf[i].q_next, wf[i].q_regen, wf[i].counters});
+			wf_launch(CL->commands[i], shade, count, &wf[i], WF_T_SHADE);
+
+			wf_set_args(generate, 5, 9, (cl_mem[]){d_seeds[i], wf[i].ray_o, wf[i].ray_d, wf[i].mask, wf[i].depth, wf[i].cone, wf[i].q_regen, wf[i].q_next, wf[i].counters});
+			wf_launch(CL->commands[i], generate, count, &wf[i], WF_T_SHADE);
+
+			clEnqueueReadBuffer(CL->commands[i], wf[i].counters, CL_FALSE, 0, sizeof(cl_int) * 3, wf[i].counts, 0, NULL, NULL);
+			clFlush(CL->commands[i]);
+		}
+		for (int i = 0; i < d; i++)
+		{
+			clFinish(CL->commands[i]);
+			wf_collect(&wf[i]);
+		}
+	}
+
+	for (int i = 0; i < d; i++)
+		clEnqueueReadBuffer(CL->commands[i], d_outputs[i], CL_TRUE, 0, sizeof(cl_float3) * resolution, outputs[i], 0, NULL, NULL);
+	wf_report(wf, d, sorted, wall_clock() - start);
+
+	for (int i = 0; i < d; i++)
+	{
+		clReleaseMemObject(wf[i].ray_o);
+		clReleaseMemObject(wf[i].ray_d);
+		clReleaseMemObject(wf[i].mask);
+		clReleaseMemObject(wf[i].depth);
+		clReleaseMemObject(wf[i].cone);
+		clReleaseMemObject(wf[i].samples);
+		clReleaseMemObject(wf[i].hit_t);
+		clReleaseMemObject(wf[i].hit_u);
+		clReleaseMemObject(wf[i].hit_v);
+		clReleaseMemObject(wf[i].hit_ind);
+		clReleaseMemObject(wf[i].q_extend);
+		clReleaseMemObject(wf[i].q_next);
+		clReleaseMemObject(wf[i].q_shade);
+		clReleaseMemObject(wf[i].q_regen);
+		clReleaseMemObject(wf[i].counters);
+		clReleaseMemObject(wf[i].q_sort);
+		clReleaseMemObject(wf[i].keys);
+		clReleaseMemObject(wf[i].hist);
+	}
+	free(wf);
+	clReleaseKernel(generate);
+	clReleaseKernel(extend);
+	clReleaseKernel(logic);
+	clReleaseKernel(shade);
+	clReleaseKernel(key_rays);
+	clReleaseKernel(key_mats);
+	for (int i = 0; i < 3; i++)
+		clReleaseKernel(sort[i]);
+}
+
+//PERSISTENT: enough work items to fill every compute unit, never more than there are pixels (seeds)
+#define PERSISTENT_GROUPS_PER_CU 8
+
+static size_t persistent_size(cl_command_queue queue, size_t groupsize, size_t resolution)
+{
+	cl_device_id dev;
+	cl_uint units;
+	clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(dev), &dev, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+	size_t size = units * PERSISTENT_GROUPS_PER_CU * groupsize;
+	size_t cap = resolution / groupsize * groupsize;
+	return size < cap ? size : cap;
+}
+
+static void regen_report(cl_command_queue queue, cl_mem d_counts, size_t resolution, float seconds)
+{
+	//regenerated paths: how many samples each pixel actually got out of its bounce budget
+	cl_int *counts = calloc(resolution, sizeof(cl_int));
+	clEnqueueReadBuffer(queue, d_counts, CL_TRUE, 0, sizeof(cl_int) * resolution, counts, 0, NULL, NULL);
+	long total = 0;
+	int min = INT_MAX;
+	int max = 0;
+	for (int i = 0; i < resolution; i++)
+	{
+		total += counts[i];
+		min = counts[i] < min ? counts[i] : min;
+		max = counts[i] > max ? counts[i] : max;
+	}
+	printf(", %.2f Mpaths/s, samples per pixel %d / %.1f / %d (min / mean / max)\n",
+		(float)total / seconds / 1000000.0f, min, (double)total / resolution, max);
+	free(counts);
+}
+
 cl_double3 *gpu_render(Scene *S, t_camera cam, int xdim, int ydim)
 {
 	static gpu_context *CL;
 	if (!CL)
-		CL = prep_gpu();
+		CL = prep_gpu(S->accel->type, S->accel->traversal, S);
+	if (!CL)
+	{
+		printf("no OpenCL devices\n");
+		exit(0);
+	}
 	static gpu_scene *scene;
 	if (!scene)
 		scene = prep_scene(S, CL, xdim, ydim);
@@ -309,28 +1635,31 @@ cl_double3 *gpu_render(Scene *S, t_camera cam, int xdim, int ydim)
 	//for simplicity assuming one platform for now. can easily be extended, see old gpu_launch.c
 
 	//per-platform pointers
-	cl_mem d_V;
-	cl_mem d_T;
-	cl_mem d_N;
-	cl_mem d_M;
+	cl_mem d_A;
 	cl_mem d_bins;
 	cl_mem d_mats;
 	cl_mem d_tex;
-	cl_mem d_TN;
-	cl_mem d_BTN;
+	cl_mem d_I;
+	cl_mem d_W;
+	cl_mem d_O;
 
 	 printf("alloc:\n");
 	
 	//per-platform allocs
-	d_V = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_float3) * scene->tri_count, NULL, NULL);
-	d_T = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_float3) * scene->tri_count, NULL, NULL);
-	d_N = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_float3) * scene->tri_count, NULL, NULL);
-	d_M = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_int) * scene->tri_count / 3, NULL, NULL);
-	d_TN = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_float3) * scene->tri_count / 3, NULL, NULL);
-	d_BTN = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_float3) * scene->tri_count / 3, NULL, NULL);
+	d_A = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_uint) * ATTR_STRIDE * scene->tri_count / 3, NULL, NULL);
 	d_mats = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(gpu_mat) * scene->mat_count, NULL, NULL);
-	d_bins = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(gpu_bin) * scene->bin_count, NULL, NULL);
-	d_tex = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_uchar) * scene->tex_size, NULL, NULL);
+	d_bins = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, scene->node_size, NULL, NULL);
+	d_I = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_int) * scene->ref_count, NULL, NULL);
+	d_W = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, scene->w_size, NULL, NULL);
+	d_O = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_uint) * OMM_STRIDE * (scene->omm_count ? scene->omm_count : 1), NULL, NULL);
+	if (CL->tex_images)
+	{
+		cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
+		cl_image_desc desc = {CL_MEM_OBJECT_IMAGE2D_ARRAY, atlas_width(scene->tex_w), atlas_height(scene->tex_w, scene->tex_h), 1, scene->tex_layers, 0, 0, 0, 0, NULL};
+		d_tex = clCreateImage(CL->contexts[0], CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format, &desc, scene->tex, NULL);
+	}
+	else
+		d_tex = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_uchar) * scene->tex_size, NULL, NULL);
 
 	// printf("copy:\n");
 
@@ -342,6 +1671,11 @@ cl_double3 *gpu_render(Scene *S, t_camera cam, int xdim, int ydim)
 	//per-device pointers
 	cl_mem *d_outputs = calloc(CL->numDevices, sizeof(cl_mem));;
 	cl_mem *d_seeds = calloc(CL->numDevices, sizeof(cl_mem));;
+	cl_mem *d_work = calloc(CL->numDevices, sizeof(cl_mem));
+	cl_mem *d_counts = calloc(CL->numDevices, sizeof(cl_mem));
+	size_t *launch = calloc(CL->numDevices, sizeof(size_t));
+	int persistent = S->render_mode == RENDER_PERSISTENT;
+	int regen = S->render_mode == RENDER_REGEN;
 	
 	cl_uint d;
 	clGetDeviceIDs(CL->platform[0], CL_DEVICE_TYPE_GPU, 0, NULL, &d);
@@ -353,47 +1687,60 @@ cl_double3 *gpu_render(Scene *S, t_camera cam, int xdim, int ydim)
 
 	 printf("per-device alloc and copy\n");
 
+	//persistent threads accumulate into output and count work, so both start at 0
+	cl_float3 *zeroes = persistent ? calloc(resolution, sizeof(cl_float3)) : NULL;
+	cl_uint no_work = 0;
+
 	//per-device allocs and copies
 	for (int i = 0; i < d; i++)
 	{
-		d_seeds[i] = clCreateBuffer(CL->contexts[0], CL_MEM_READ_ONLY, sizeof(cl_uint) * 2 * resolution, NULL, NULL);
+		d_seeds[i] = clCreateBuffer(CL->contexts[0], CL_MEM_READ_WRITE, sizeof(cl_uint) * 2 * resolution, NULL, NULL);
 		clEnqueueWriteBuffer(CL->commands[i], d_seeds[i], CL_FALSE, 0, sizeof(cl_uint) * 2 * resolution, &scene->seeds[2 * resolution * i], 0, NULL, NULL);
-		d_outputs[i] = clCreateBuffer(CL->contexts[0], CL_MEM_WRITE_ONLY, sizeof(cl_float3) * resolution, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_V, CL_FALSE, 0, sizeof(cl_float3) * scene->tri_count, scene->V, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_T, CL_FALSE, 0, sizeof(cl_float3) * scene->tri_count, scene->T, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_N, CL_FALSE, 0, sizeof(cl_float3) * scene->tri_count, scene->N, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_M, CL_FALSE, 0, sizeof(cl_int) * scene->tri_count / 3, scene->M, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_TN, CL_FALSE, 0, sizeof(cl_float3) * scene->tri_count / 3, scene->TN, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_BTN, CL_FALSE, 0, sizeof(cl_float3) * scene->tri_count / 3, scene->BTN, 0, NULL, NULL);
+		d_outputs[i] = clCreateBuffer(CL->contexts[0], CL_MEM_READ_WRITE, sizeof(cl_float3) * resolution, NULL, NULL);
+		d_work[i] = clCreateBuffer(CL->contexts[0], CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+		launch[i] = persistent ? persistent_size(CL->commands[i], groupsize, resolution) : resolution;
+		if (regen)
+			d_counts[i] = clCreateBuffer(CL->contexts[0], CL_MEM_WRITE_ONLY, sizeof(cl_int) * resolution, NULL, NULL);
+		if (persistent)
+		{
+			clEnqueueWriteBuffer(CL->commands[i], d_outputs[i], CL_FALSE, 0, sizeof(cl_float3) * resolution, zeroes, 0, NULL, NULL);
+			clEnqueueWriteBuffer(CL->commands[i], d_work[i], CL_FALSE, 0, sizeof(cl_uint), &no_work, 0, NULL, NULL);
+		}
+		clEnqueueWriteBuffer(CL->commands[i], d_A, CL_FALSE, 0, sizeof(cl_uint) * ATTR_STRIDE * scene->tri_count / 3, scene->A, 0, NULL, NULL);
 		clEnqueueWriteBuffer(CL->commands[i], d_mats, CL_FALSE, 0, sizeof(gpu_mat) * scene->mat_count, scene->mats, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_bins, CL_FALSE, 0, sizeof(gpu_bin) * scene->bin_count, scene->bins, 0, NULL, NULL);
-		clEnqueueWriteBuffer(CL->commands[i], d_tex, CL_FALSE, 0, sizeof(cl_uchar) * scene->tex_size, scene->tex, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], d_bins, CL_FALSE, 0, scene->node_size, scene->nodes, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], d_I, CL_FALSE, 0, sizeof(cl_int) * scene->ref_count, scene->I, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], d_W, CL_FALSE, 0, scene->w_size, scene->W, 0, NULL, NULL);
+		clEnqueueWriteBuffer(CL->commands[i], d_O, CL_FALSE, 0, sizeof(cl_uint) * OMM_STRIDE * (scene->omm_count ? scene->omm_count : 1), scene->O, 0, NULL, NULL);
+		if (!CL->tex_images)
+			clEnqueueWriteBuffer(CL->commands[i], d_tex, CL_FALSE, 0, sizeof(cl_uchar) * scene->tex_size, scene->tex, 0, NULL, NULL);
 	}
 
 	for (int i = 0; i < d; i++)
 		clFinish(CL->commands[i]);
+	free(zeroes);
 
 	printf("per-device copies done\n");
 
-	cl_kernel render = clCreateKernel(CL->programs[0], "render_kernel", NULL);
+	cl_kernel render = clCreateKernel(CL->programs[0], persistent ? "render_persistent" : (regen ? "render_regen" : "render_kernel"), NULL);
 	printf("made kernel\n");
 
 	//per-platform args
-	clSetKernelArg(render, 0, sizeof(cl_mem), &d_V);
-	clSetKernelArg(render, 1, sizeof(cl_mem), &d_T);
-	clSetKernelArg(render, 2, sizeof(cl_mem), &d_N);
-	clSetKernelArg(render, 3, sizeof(cl_mem), &d_bins);
-	clSetKernelArg(render, 4, sizeof(cl_mem), &d_mats);
-	clSetKernelArg(render, 5, sizeof(cl_mem), &d_tex);
-	clSetKernelArg(render, 6, sizeof(cl_float3), &cam.origin);
-	clSetKernelArg(render, 7, sizeof(cl_float3), &cam.focus);
-	clSetKernelArg(render, 8, sizeof(cl_float3), &cam.d_x);
-	clSetKernelArg(render, 9, sizeof(cl_float3), &cam.d_y);
-	clSetKernelArg(render, 10, sizeof(cl_uint), &samples);
-	clSetKernelArg(render, 11, sizeof(cl_uint), &width);
-	clSetKernelArg(render, 14, sizeof(cl_mem), &d_M);
-	clSetKernelArg(render, 15, sizeof(cl_mem), &d_TN);
-	clSetKernelArg(render, 16, sizeof(cl_mem), &d_BTN);
+	clSetKernelArg(render, 0, sizeof(cl_mem), &d_A);
+	clSetKernelArg(render, 1, sizeof(cl_mem), &d_bins);
+	clSetKernelArg(render, 2, sizeof(cl_mem), &d_mats);
+	clSetKernelArg(render, 3, sizeof(cl_mem), &d_tex);
+	clSetKernelArg(render, 4, sizeof(cl_float3), &cam.origin);
+	clSetKernelArg(render, 5, sizeof(cl_float3), &cam.focus);
+	clSetKernelArg(render, 6, sizeof(cl_float3), &cam.d_x);
+	clSetKernelArg(render, 7, sizeof(cl_float3), &cam.d_y);
+	clSetKernelArg(render, 8, sizeof(cl_uint), &samples);
+	clSetKernelArg(render, 9, sizeof(cl_uint), &width);
+	cl_uint height = ydim;
+	clSetKernelArg(render, 10, sizeof(cl_uint), &height);
+	clSetKernelArg(render, 13, sizeof(cl_mem), &d_I);
+	clSetKernelArg(render, 14, sizeof(cl_mem), &d_W);
+	clSetKernelArg(render, 15, sizeof(cl_mem), &d_O);
 
 	//per-device args and launch
 	printf("about to launch\n");
@@ -404,47 +1751,68 @@ cl_double3 *gpu_render(Scene *S, t_camera cam, int xdim, int ydim)
 	for (int i = 0; i < d; i++)
 		outputs[i] = calloc(resolution, sizeof(cl_float3));
 
-	for (int i = 0; i < d; i++)
+	if (S->render_mode == RENDER_WAVEFRONT || S->render_mode == RENDER_WAVEFRONT_SORTED)
+		render_wavefront(CL, d, cam, width, resolution, samples, S->render_mode == RENDER_WAVEFRONT_SORTED, scene, d_seeds, d_outputs, outputs,
+			(cl_mem[]){d_W, d_I, d_bins, d_O}, (cl_mem[]){d_A, d_mats, d_tex});
+	else
 	{
-		// printf("device %d\n", i);
-		clSetKernelArg(render, 12, sizeof(cl_mem), &d_seeds[i]);
-		clSetKernelArg(render, 13, sizeof(cl_mem), &d_outputs[i]);
-		cl_int err = clEnqueueNDRangeKernel(CL->commands[i], render, 1, 0, &resolution, &groupsize, 0, NULL, &done[i]);
-		clEnqueueReadBuffer(CL->commands[i], d_outputs[i], CL_FALSE, 0, sizeof(cl_float3) * resolution, outputs[i], 1, &done[i], NULL);
-	}
+		for (int i = 0; i < d; i++)
+		{
+			// printf("device %d\n", i);
+			clSetKernelArg(render, 11, sizeof(cl_mem), &d_seeds[i]);
+			clSetKernelArg(render, 12, sizeof(cl_mem), &d_outputs[i]);
+			if (persistent)
+				clSetKernelArg(render, 16, sizeof(cl_mem), &d_work[i]);
+			if (regen)
+				clSetKernelArg(render, 16, sizeof(cl_mem), &d_counts[i]);
+			cl_int err = clEnqueueNDRangeKernel(CL->commands[i], render, 1, 0, &launch[i], &groupsize, 0, NULL, &done[i]);
+			clEnqueueReadBuffer(CL->commands[i], d_outputs[i], CL_FALSE, 0, sizeof(cl_float3) * resolution, outputs[i], 1, &done[i], NULL);
+		}
 
-	for (int i = 0; i < d; i++)
-		clFlush(CL->commands[i]);
+		for (int i = 0; i < d; i++)
+			clFlush(CL->commands[i]);
 
-	// printf("all enqueued\n");
-	for (int i = 0; i < d; i++)
-	{
-		clFinish(CL->commands[i]);
-		cl_ulong start, end;
-		clGetEventProfilingInfo(done[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-		clGetEventProfilingInfo(done[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-		printf("device %d took %.3f seconds\n", i, (float)(end - start) / 1000000000.0f);
-		clReleaseEvent(done[i]);
+		// printf("all enqueued\n");
+		for (int i = 0; i < d; i++)
+		{
+			clFinish(CL->commands[i]);
+			cl_ulong start, end;
+			clGetEventProfilingInfo(done[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+			clGetEventProfilingInfo(done[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+			float seconds = (float)(end - start) / 1000000000.0f;
+			printf("device %d took %.3f seconds", i, seconds);
+			if (persistent)
+				printf(" (%zu persistent work items)", launch[i]);
+			if (regen)
+				regen_report(CL->commands[i], d_counts[i], resolution, seconds);
+			else
+				printf(", %.2f Mpaths/s\n", (float)(resolution * samples) / seconds / 1000000.0f);
+			clReleaseEvent(done[i]);
+		}
+		//printf("done?\n");
 	}
-	//printf("done?\n");
 
-	clReleaseMemObject(d_V);
-	clReleaseMemObject(d_T);
-	clReleaseMemObject(d_N);
+	clReleaseMemObject(d_A);
 	clReleaseMemObject(d_bins);
 	clReleaseMemObject(d_mats);
 	clReleaseMemObject(d_tex);
-	clReleaseMemObject(d_M);
-	clReleaseMemObject(d_TN);
-	clReleaseMemObject(d_BTN);
+	clReleaseMemObject(d_I);
+	clReleaseMemObject(d_W);
+	clReleaseMemObject(d_O);
 	for (int i = 0; i < d; i++)
 	{
 		clReleaseMemObject(d_seeds[i]);
 		clReleaseMemObject(d_outputs[i]);
+		clReleaseMemObject(d_work[i]);
+		if (regen)
+			clReleaseMemObject(d_counts[i]);
 	}
 
 	free(d_seeds);
 	free(d_outputs);
+	free(d_work);
+	free(d_counts);
+	free(launch);
 
 	clReleaseKernel(render);
 
@@ -16,6 +16,65 @@
 #define MAT_REFRACTIVE 3
 #define MAT_NULL 4
 
+//acceleration structures, selected at build time with -D ACCEL=n (see rt.h)
+#define ACCEL_BVH 0
+#define ACCEL_KD 1
+#define ACCEL_GRID 2
+
+#ifndef ACCEL
+# define ACCEL ACCEL_BVH
+#endif
+
+//split axis and child order packed into Box.lind (see rt.h)
+#define BIN_AXIS_SHIFT 29
+#define BIN_FLIP (1 << 28)
+#define BIN_IND_MASK (BIN_FLIP - 1)
+
+//bvh traversal flavour, -D BVH_TRAVERSAL=n (see rt.h)
+#define BVH_STACK 0
+#define BVH_RESTART 1
+#define BVH_PAIRS 2
+#define SHORT_STACK 4
+#define PAIR_SENTINEL 0x7fffffff
+#define TRAIL_TOP ((ulong)1 << 63)
+
+#ifndef BVH_TRAVERSAL
+# define BVH_TRAVERSAL BVH_STACK
+#endif
+
+//entries in the private stacks, -D BVH_STACK_SIZE from the tree's depth so they can't overflow (see bvh_stack_size)
+#ifndef BVH_STACK_SIZE
+# define BVH_STACK_SIZE 32
+#endif
+
+//sbvh leaves read 16 bit positions out of W instead of floats, -D QUANTIZED (see quantize.c)
+#ifndef QUANTIZED
+# define QUANTIZED 0
+#endif
+#define QUANT_HEADER 8
+#define QUANT_FALLBACK -32768
+
+//leaf triangles stored right behind their node in boxes (-D INLINE_LEAVES=1, see inline_accel)
+#ifndef INLINE_LEAVES
+# define INLINE_LEAVES 0
+#endif
+
+//textures: one RGBA8 image2d_array read through a sampler, or the packed RGB byte buffer (-D TEX_IMAGES)
+#ifndef TEX_IMAGES
+# define TEX_IMAGES 0
+#endif
+#if TEX_IMAGES
+# define TEXTURES __read_only image2d_array_t
+#else
+# define TEXTURES __global uchar *
+#endif
+
+//how a map's texels sit in the packed buffer, see pack_map
+#define TEX_RGB 0
+#define TEX_GRAY 1
+#define TEX_BC1 2
+#define TEX_BC4 3
+
 #define BLACK (float3)(0.0f, 0.0f, 0.0f)
 #define WHITE (float3)(1.0f, 1.0f, 1.0f)
 #define GREY (float3)(0.5f, 0.5f, 0.5f)
@@ -32,6 +91,40 @@
 
 #define stop_prob 0.3f
 
+//map types present in the scene (same values as rt.h), prep_gpu passes the scene's set so
+//branches for maps no material uses compile away. MAX_BOUNCES 0 leaves path length to russian roulette
+#define MAPS_DIFF 1
+#define MAPS_SPEC 2
+#define MAPS_BUMP 4
+#define MAPS_TRANS 8
+#ifndef SCENE_MAPS
+# define SCENE_MAPS (MAPS_DIFF | MAPS_SPEC | MAPS_BUMP | MAPS_TRANS)
+#endif
+#ifndef MAX_BOUNCES
+# define MAX_BOUNCES 0
+#endif
+//whether the scene has spheres at all, the sphere branches in traversal and shading go without
+#ifndef SCENE_SPHERES
+# define SCENE_SPHERES 1
+#endif
+
+//OPACITY RECORDS (see opacity.c), one per alpha tested face, OMM_STRIDE uints: the face, its uvs as
+//halves, its map_d (index, height, width, format) and 2 bit states for 4^OMM_LEVEL micro-triangles.
+//refs to those faces are ALPHA_TEST | record slot, refs to quads QUAD_REF | first of their two
+//triangles, everything else in I is a plain triangle index
+#define ALPHA_TEST (1 << 30)
+#define QUAD_REF (1 << 29)
+#define SPHERE_REF (1 << 28) //W holds the sphere's center and radius
+#define OMM_LEVEL 3
+#define OMM_STRIDE 12
+#define OMM_FACE 0
+#define OMM_UV 1
+#define OMM_MAP 4
+#define OMM_STATES 8
+#define OMM_TRANSPARENT 0
+#define OMM_OPAQUE 1
+#define OMM_UNKNOWN 2
+
 typedef struct s_ray {
 	float3 origin;
 	float3 direction;
@@ -49,18 +142,22 @@ typedef struct s_material
 	int d_index;
 	int d_height;
 	int d_width;
+	int d_format;
 
 	int s_index;
 	int s_height;
 	int s_width;
+	int s_format;
 
 	int b_index;
 	int b_height;
 	int b_width;
+	int b_format;
 
 	int t_index;
 	int t_height;
 	int t_width;
+	int t_format;
 }				Material;
 
 typedef struct s_camera
@@ -85,6 +182,51 @@ typedef struct s_box
 
 #define NULL_BOX (Box){0.0f, 0.0f, 0.0f, 0, 0.0f, 0.0f, 0.0f, 0};
 
+typedef struct s_kd_node
+{
+	float minx;
+	float miny;
+	float minz;
+	int axis; //-1 for leaves
+	float maxx;
+	float maxy;
+	float maxz;
+	float split;
+	int left; //leaves: first ref
+	int right; //leaves: ref count
+	int ropes[6];
+}				KdNode;
+
+typedef struct s_grid
+{
+	float minx;
+	float miny;
+	float minz;
+	int resx;
+	float maxx;
+	float maxy;
+	float maxz;
+	int resy;
+	int resz;
+	int top_count;
+	int sub_count;
+	int cell_count;
+}				Grid;
+
+typedef struct s_grid_cell
+{
+	int start; //subgrid index when count is -1
+	int count;
+}				GridCell;
+
+typedef struct s_subgrid
+{
+	int resx;
+	int resy;
+	int resz;
+	int first_cell;
+}				SubGrid;
+
 static float get_random(unsigned int *seed0, unsigned int *seed1) {
 
 	/* hash the seeds using bitwise AND operations and bitshifts */
@@ -112,10 +254,10 @@ static int inside_box(const float3 pt, const Box box) //currently unused. origin
 	return 0;
 }
 
-//intersect_box
-static const int intersect_box(const Ray ray, const Box b, const float t)
+//box_entry
+static float box_entry(const Ray ray, const Box b, const float t)
 {
-	//the if tmin >=t checks are new, should be fine, should help. will toggle to see effect.
+	//entry distance, FLT_MAX if the ray misses or the box starts beyond t
 
 	float tx0 = (b.minx - ray.origin.x) * ray.inv_dir.x;
 	float tx1 = (b.maxx - ray.origin.x) * ray.inv_dir.x;
@@ -129,7 +271,7 @@ static const int intersect_box(const Ray ray, const Box b, const float t)
 
 
 	if ((tmin >= tymax) || (tymin >= tmax))
-		return (0);
+		return (FLT_MAX);
 
 	tmin = fmax(tymin, tmin);
 	tmax = fmin(tymax, tmax);
@@ -140,91 +282,449 @@ static const int intersect_box(const Ray ray, const Box b, const float t)
 	float tzmax = fmax(tz0, tz1);
 
 	if ((tmin >= tzmax) || (tzmin >= tmax))
-		return (0);
+		return (FLT_MAX);
 
     tmin = fmax(tzmin, tmin);
 	tmax = fmin(tzmax, tmax);
 
 	if (tmin > t)
-		return (0);
+		return (FLT_MAX);
 
 	if (tmin <= 0.0 && tmax <= 0.0)
-		return (0);
-	return (1);
+		return (FLT_MAX);
+	return (tmin);
+}
+
+//intersect_box
+static const int intersect_box(const Ray ray, const Box b, const float t)
+{
+	//the if tmin >=t checks are new, should be fine, should help. will toggle to see effect.
+	return box_entry(ray, b, t) != FLT_MAX;
+}
+
+static float axis_of(const float3 v, const int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
 }
 
-static void intersect_triangle(const Ray ray, __global float3 *V, int test_i, int *best_i, float *t, float *u, float *v)
+//TEXTURE FETCHES, here rather than with the shading code because traversal's alpha test reads map_d too
+static float mip_level(const float lod, const int height, const int width)
 {
-	//we don't need v1 or v2 after initial calc of e1, e2. could just store them in same memory. wonder if compiler does this.
-	float this_t, this_u, this_v;
-	const float3 v0 = V[test_i];
-	const float3 v1 = V[test_i + 1];
-	const float3 v2 = V[test_i + 2];
+	//NaNs from degenerate uvs land on level 0
+	const int top = 31 - clz(max(width, height));
+	return fmin(fmax(lod + 0.5f * log2((float)width * (float)height), 0.0f), (float)top);
+}
 
-	float3 e1 = v1 - v0;
-	float3 e2 = v2 - v0;
+#if TEX_IMAGES
+//index is the layer. levels 1+ are stacked in a column to the right of level 0 (see pack_map),
+//so wrapping is already done by fetch_NT and filtering is clamped to the level's own texels
+__constant sampler_t tex_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
 
-	float3 h = cross(ray.direction, e2);
-	float a = dot(h, e1);
+static float3 fetch_level(TEXTURES tex, const int layer, const int height, const int width, const float2 uv, const int level)
+{
+	int2 size = (int2)(width, height);
+	float2 org = (float2)(0.0f, 0.0f);
+	for (int l = 1; l <= level; l++)
+	{
+		org = l == 1 ? (float2)((float)width, 0.0f) : org + (float2)(0.0f, (float)size.y);
+		size = max(size >> 1, 1);
+	}
+	const float2 s = convert_float2(size);
+	const float2 p = org + clamp(uv * s, (float2)(0.5f, 0.5f), s - 0.5f);
+	return read_imagef(tex, tex_sampler, (float4)(p.x, p.y, (float)layer, 0.0f)).xyz;
+}
 
-	if (fabs(a) < 0)
-		return;
-	float f = 1.0f / a;
-	float3 s = ray.origin - v0;
-	this_u = f * dot(s, h);
-	if (this_u < 0.0 || this_u > 1.0)
+static float3 fetch_tex(	const float3 txcrd,
+							const int layer,
+							const int height,
+							const int width,
+							const int format,
+							TEXTURES tex,
+							const float lod)
+{
+	//trilinear: bilinear from the hardware on two levels, blended here. layers are always RGBA8, format is unused
+	const float level = mip_level(lod, height, width);
+	const int l0 = (int)level;
+	const float3 a = fetch_level(tex, layer, height, width, txcrd.xy, l0);
+	if (level == (float)l0)
+		return a;
+	return mix(a, fetch_level(tex, layer, height, width, txcrd.xy, l0 + 1), level - (float)l0);
+}
+#else
+static int level_bytes(const int format, const int width, const int height)
+{
+	if (format == TEX_BC1 || format == TEX_BC4)
+		return ((width + 3) >> 2) * ((height + 3) >> 2) * 8;
+	return width * height * (format == TEX_GRAY ? 1 : 3);
+}
+
+static float3 rgb565(const uint c)
+{
+	return (float3)((float)(c >> 11) / 31.0f, (float)((c >> 5) & 63) / 63.0f, (float)(c & 31) / 31.0f);
+}
+
+static float3 fetch_texel(TEXTURES tex, const int offset, const int width, const int format, const int x, const int y)
+{
+	if (format == TEX_RGB)
+	{
+		uchar R = tex[offset + (y * width + x) * 3];
+		uchar G = tex[offset + (y * width + x) * 3 + 1];
+		uchar B = tex[offset + (y * width + x) * 3 + 2];
+		return (float3)((float)R, (float)G, (float)B) / 255.0f;
+	}
+	if (format == TEX_GRAY)
+		return (float3)((float)tex[offset + y * width + x] / 255.0f);
+
+	//one 8 byte block per 4x4 texels, maps start 8 byte aligned
+	const ulong block = *(__global const ulong *)(tex + offset + ((y >> 2) * ((width + 3) >> 2) + (x >> 2)) * 8);
+	const int t = (y & 3) * 4 + (x & 3);
+	if (format == TEX_BC4)
+	{
+		const float r0 = (float)(block & 0xff);
+		const float r1 = (float)((block >> 8) & 0xff);
+		const int i = (block >> (16 + 3 * t)) & 7;
+		float r;
+		if (i < 2)
+			r = i ? r1 : r0;
+		else if (r0 > r1)
+			r = ((float)(8 - i) * r0 + (float)(i - 1) * r1) / 7.0f;
+		else
+			r = i == 6 ? 0.0f : (i == 7 ? 255.0f : ((float)(6 - i) * r0 + (float)(i - 1) * r1) / 5.0f);
+		return (float3)(r / 255.0f);
+	}
+	const uint c0 = block & 0xffff;
+	const uint c1 = (block >> 16) & 0xffff;
+	const int i = (block >> (32 + 2 * t)) & 3;
+	const float3 p0 = rgb565(c0);
+	const float3 p1 = rgb565(c1);
+	if (i < 2)
+		return i ? p1 : p0;
+	if (c0 > c1)
+		return i == 2 ? (2.0f * p0 + p1) / 3.0f : (p0 + 2.0f * p1) / 3.0f;
+	return i == 2 ? (p0 + p1) * 0.5f : BLACK;
+}
+
+static float3 fetch_tex(	const float3 txcrd,
+							int offset,
+							int height,
+							int width,
+							const int format,
+							TEXTURES tex,
+							const float lod)
+{
+	//nearest texel of the nearest level, levels follow each other from offset
+	const int level = (int)(mip_level(lod, height, width) + 0.5f);
+	for (int l = 0; l < level; l++)
+	{
+		offset += level_bytes(format, width, height);
+		width = max(width >> 1, 1);
+		height = max(height >> 1, 1);
+	}
+
+	int x = floor((float)width * txcrd.x);
+	int y = floor((float)height * txcrd.y);
+	return fetch_texel(tex, offset, width, format, x, y);
+}
+#endif
+
+typedef struct s_shear
+{
+	int kx;
+	int ky;
+	int kz;
+	float Sx;
+	float Sy;
+	float Sz;
+}				Shear;
+
+static Shear shear_from_ray(const Ray ray)
+{
+	//per-ray half of the watertight test (Woop, Benthin, Wald 2013): kz is the dominant
+	//direction axis, kx/ky swap when it's negative so winding is kept
+	Shear sh;
+	const float3 a = fabs(ray.direction);
+	sh.kz = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+	sh.kx = sh.kz == 2 ? 0 : sh.kz + 1;
+	sh.ky = sh.kx == 2 ? 0 : sh.kx + 1;
+	if (axis_of(ray.direction, sh.kz) < 0.0f)
+	{
+		const int tmp = sh.kx;
+		sh.kx = sh.ky;
+		sh.ky = tmp;
+	}
+	sh.Sz = 1.0f / axis_of(ray.direction, sh.kz);
+	sh.Sx = axis_of(ray.direction, sh.kx) * sh.Sz;
+	sh.Sy = axis_of(ray.direction, sh.ky) * sh.Sz;
+	return sh;
+}
+
+static float3 shear_vert(const Ray ray, const Shear sh, const float3 p)
+{
+	//vertex relative to the origin, x and y sheared along the ray, z left for the distance
+	const float3 d = p - ray.origin;
+	const float z = axis_of(d, sh.kz);
+	return (float3)(axis_of(d, sh.kx) - sh.Sx * z, axis_of(d, sh.ky) - sh.Sy * z, z);
+}
+
+static void edge_test(const Shear sh, const float U, const float V, const float Wb, const float Az, const float Bz, const float Cz, int test_i, int *best_i, float *t, float *u, float *v)
+{
+	if ((U < 0.0f || V < 0.0f || Wb < 0.0f) && (U > 0.0f || V > 0.0f || Wb > 0.0f))
 		return;
-	float3 q = cross(s, e1);
-	this_v = f * dot(ray.direction, q);
-	if (this_v < 0.0 || this_u + this_v > 1.0)
+	const float det = U + V + Wb;
+	if (det == 0.0f) //edge-on, this is the parallel case the old fabs(a) < 0 check never caught
 		return;
-	this_t = f * dot(e2, q);
+
+	const float rcp = 1.0f / det;
+	const float this_t = (U * Az + V * Bz + Wb * Cz) * sh.Sz * rcp;
 	if (this_t < *t && this_t > COLLIDE_ERR)
 	{
 		*t = this_t;
-		*u = this_u;
-		*v = this_v;
+		*u = V * rcp;
+		*v = Wb * rcp;
 		*best_i = test_i;
 	}
 }
 
+static void intersect_verts(const Ray ray, const Shear sh, const float3 p0, const float3 p1, const float3 p2, int test_i, int *best_i, float *t, float *u, float *v)
+{
+	//watertight: edge functions on the sheared vertices, so neighbours sharing an edge agree
+	//exactly about which side a ray is on
+	const float3 A = shear_vert(ray, sh, p0);
+	const float3 B = shear_vert(ray, sh, p1);
+	const float3 C = shear_vert(ray, sh, p2);
+	edge_test(sh, C.x * B.y - C.y * B.x, A.x * C.y - A.y * C.x, B.x * A.y - B.y * A.x, A.z, B.z, C.z, test_i, best_i, t, u, v);
+}
+
+static void intersect_quad(const Ray ray, const Shear sh, __global float *W, const int tri, int *best_i, float *t, float *u, float *v)
+{
+	//both halves of a quad, triangles tri (a, b, c) and tri + 1 (a, c, d). four vertices sheared instead
+	//of six, and the a-c diagonal's edge function is computed once: it's V of the first half and minus
+	//Wb of the second, so exactly one half takes a ray crossing the diagonal
+	const float3 A = shear_vert(ray, sh, vload3(3 * tri, W));
+	const float3 B = shear_vert(ray, sh, vload3(3 * tri + 1, W));
+	const float3 C = shear_vert(ray, sh, vload3(3 * tri + 2, W));
+	const float3 D = shear_vert(ray, sh, vload3(3 * tri + 5, W));
+	const float diag = A.x * C.y - A.y * C.x;
+	edge_test(sh, C.x * B.y - C.y * B.x, diag, B.x * A.y - B.y * A.x, A.z, B.z, C.z, tri, best_i, t, u, v);
+	edge_test(sh, D.x * C.y - D.y * C.x, A.x * D.y - A.y * D.x, -diag, A.z, C.z, D.z, tri + 1, best_i, t, u, v);
+}
+
+static void intersect_triangle(const Ray ray, const Shear sh, __global float *W, int test_i, int *best_i, float *t, float *u, float *v)
+{
+	//W is 9 packed floats per triangle (see prep_scene)
+	intersect_verts(ray, sh, vload3(3 * test_i, W), vload3(3 * test_i + 1, W), vload3(3 * test_i + 2, W), test_i, best_i, t, u, v);
+}
+
+static int alpha_hit(__global uint *O, TEXTURES tex, const int slot, const float u, const float v)
+{
+	//micro-triangle under (u, v): row i along u, cell j along v, upper half when past the cell's diagonal.
+	//only unknown micro-triangles read map_d, at level 0 like any-hit has no cone to pick a level with
+	__global uint *rec = O + slot * OMM_STRIDE;
+	const int n = 1 << OMM_LEVEL;
+	const int i = clamp((int)(u * (float)n), 0, n - 1);
+	int j = clamp((int)(v * (float)n), 0, n - 1);
+	int upper = 0;
+	if (i + j >= n - 1)
+		j = n - 1 - i;
+	else
+		upper = u * (float)n - (float)i + v * (float)n - (float)j > 1.0f;
+	const int k = i * (2 * n - i) + 2 * j + upper;
+	const uint state = (rec[OMM_STATES + (k >> 4)] >> ((k & 15) * 2)) & 3;
+	if (state != OMM_UNKNOWN)
+		return state == OMM_OPAQUE;
+
+	__global half *uv = (__global half *)(rec + OMM_UV);
+	float2 txcrd = (1.0f - u - v) * vload_half2(0, uv) + u * vload_half2(1, uv) + v * vload_half2(2, uv);
+	txcrd -= floor(txcrd);
+	return fetch_tex((float3)(txcrd, 0.0f), rec[OMM_MAP], rec[OMM_MAP + 1], rec[OMM_MAP + 2], rec[OMM_MAP + 3], tex, -FLT_MAX).x >= 1.0f;
+}
+
+static int ref_face(__global uint *O, const int ref)
+{
+	return ref & ALPHA_TEST ? (int)O[(ref & ~ALPHA_TEST) * OMM_STRIDE + OMM_FACE] : ref;
+}
+
+static void intersect_alpha(const Ray ray, const Shear sh, const float3 p0, const float3 p1, const float3 p2, __global uint *O, TEXTURES tex, const int ref, int *best_i, float *t, float *u, float *v)
+{
+	//a closer hit on an alpha tested face only counts where it's opaque, so the ray carries on
+	//through cutouts inside this one traversal
+	const int face = ref_face(O, ref);
+#if SCENE_MAPS & MAPS_TRANS
+	if (ref & ALPHA_TEST)
+	{
+		int hit = -1;
+		float t_hit = *t;
+		float u_hit, v_hit;
+		intersect_verts(ray, sh, p0, p1, p2, face, &hit, &t_hit, &u_hit, &v_hit);
+		if (hit != -1 && alpha_hit(O, tex, ref & ~ALPHA_TEST, u_hit, v_hit))
+		{
+			*t = t_hit;
+			*u = u_hit;
+			*v = v_hit;
+			*best_i = face;
+		}
+		return;
+	}
+#endif
+	intersect_verts(ray, sh, p0, p1, p2, face, best_i, t, u, v);
+}
+
+static void intersect_sphere(const Ray ray, __global float *W, const int prim, int *best_i, float *t, float *u, float *v)
+{
+	//analytic, with the discriminant from the ray's closest approach to the center so big spheres
+	//far away don't cancel out. (u, v) are the hit's longitude and latitude over [0, 1]: the sphere's
+	//uvs, and all shading needs to rebuild its normal (sphere_normal)
+	const float4 s = vload4(0, W + 9 * prim);
+	const float3 oc = ray.origin - s.xyz;
+	const float b = dot(oc, ray.direction);
+	const float3 h = oc - b * ray.direction;
+	const float disc = s.w * s.w - dot(h, h);
+	if (disc < 0.0f)
+		return;
+	const float q = sqrt(disc);
+	float this_t = -b - q;
+	if (this_t <= COLLIDE_ERR)
+		this_t = -b + q; //origin inside or just leaving
+	if (this_t <= COLLIDE_ERR || this_t >= *t)
+		return;
+	const float3 n = (oc + this_t * ray.direction) / s.w;
+	*t = this_t;
+	*u = atan2(n.z, n.x) * (0.5f / M_PI_F) + 0.5f;
+	*v = acos(clamp(n.y, -1.0f, 1.0f)) / M_PI_F;
+	*best_i = prim;
+}
+
+static void intersect_ref(const Ray ray, const Shear sh, __global float *W, __global uint *O, TEXTURES tex, const int ref, int *best_i, float *t, float *u, float *v)
+{
+	//masked quads were split by classify_opacity, so a quad is never alpha tested, nor is a sphere
+	if (ref & QUAD_REF)
+	{
+		intersect_quad(ray, sh, W, ref & ~QUAD_REF, best_i, t, u, v);
+		return;
+	}
+#if SCENE_SPHERES
+	if (ref & SPHERE_REF)
+	{
+		intersect_sphere(ray, W, ref & ~SPHERE_REF, best_i, t, u, v);
+		return;
+	}
+#endif
+	const int face = ref_face(O, ref);
+	intersect_alpha(ray, sh, vload3(3 * face, W), vload3(3 * face + 1, W), vload3(3 * face + 2, W), O, tex, ref, best_i, t, u, v);
+}
+
+#if QUANTIZED
+static void intersect_leaf(const Ray ray, const Shear sh, __global float *W, __global int *I, __global uint *O, TEXTURES tex, __global Box *boxes, const Box b, int *ind, float *t, float *u, float *v)
+{
+	//the leaf's cell comes from its box min with the same float ops as quantize_accel, and a vertex is
+	//the same grid point from every leaf, so shared edges still dequantize bit-identical
+	const float3 org = vload3(0, W);
+	const float unit = W[3];
+	const int3 cell = convert_int3(floor(((float3)(b.minx, b.miny, b.minz) - org) * W[4]));
+	__global short *q = (__global short *)(W + as_uint(W[5]));
+	const int start = -1 * b.lind;
+	const int count = -1 * b.rind;
+	for (int i = start; i < start + count; i++)
+	{
+		__global short *r = q + 9 * i;
+		if (r[0] == QUANT_FALLBACK)
+		{
+			__global float *f = W + QUANT_HEADER + 9 * ((int)(ushort)r[1] | (int)r[2] << 16);
+			intersect_alpha(ray, sh, vload3(0, f), vload3(1, f), vload3(2, f), O, tex, I[i], ind, t, u, v);
+		}
+		else
+			intersect_alpha(ray, sh,	convert_float3(cell + convert_int3(vload3(0, r))) * unit + org,
+										convert_float3(cell + convert_int3(vload3(1, r))) * unit + org,
+										convert_float3(cell + convert_int3(vload3(2, r))) * unit + org, O, tex, I[i], ind, t, u, v);
+	}
+}
+#elif INLINE_LEAVES
+static void intersect_leaf(const Ray ray, const Shear sh, __global float *W, __global int *I, __global uint *O, TEXTURES tex, __global Box *boxes, const Box b, int *ind, float *t, float *u, float *v)
+{
+	//-lind is the first record in float4s: 3 per triangle, v0 with the ref in w, v1, v2.
+	//they follow the leaf node, so it's the next few lines of the same buffer instead of a jump into W
+	__global float4 *r = (__global float4 *)boxes - b.lind;
+	const int count = -1 * b.rind;
+	for (int i = 0; i < count; i++, r += 3)
+	{
+		const float4 v0 = r[0];
+		intersect_alpha(ray, sh, v0.xyz, r[1].xyz, r[2].xyz, O, tex, as_int(v0.w), ind, t, u, v);
+	}
+}
+#else
+static void intersect_leaf(const Ray ray, const Shear sh, __global float *W, __global int *I, __global uint *O, TEXTURES tex, __global Box *boxes, const Box b, int *ind, float *t, float *u, float *v)
+{
+	const int start = -1 * b.lind;
+	const int count = -1 * b.rind;
+	for (int i = start; i < start + count; i++)
+		intersect_ref(ray, sh, W, O, tex, I[i], ind, t, u, v); //will update if success
+}
+#endif
+
 static int hit_bvh(	const Ray ray,
-					__global float3 *V,
+					__global float *W,
+					__global int *I,
+					__global uint *O,
+					TEXTURES tex,
 					__global Box *boxes,
 					float *t_out,
 					float *u_out,
 					float *v_out)
 {
-
-	int stack[32];
-	int s_i = 1;
-	stack[0] = 0;
+	//children get tested when their parent is popped and pushed far first, near on top.
+	//entry distances ride along on the stack so nodes behind a closer hit are dropped unread
+	const Shear sh = shear_from_ray(ray);
+	int stack[BVH_STACK_SIZE];
+	float entry[BVH_STACK_SIZE];
+	int s_i = 0;
 
 	float t = FLT_MAX;
 	float u, v;
 	int ind = -1;
 
-	Box b;
+	Box b = boxes[0];
+	const float root_in = box_entry(ray, b, t);
+	if (root_in != FLT_MAX)
+	{
+		stack[0] = 0;
+		entry[0] = root_in;
+		s_i = 1;
+	}
+
 	while (s_i)
 	{
 		//pop
-		b = boxes[stack[--s_i]];
+		s_i--;
+		if (entry[s_i] > t)
+			continue;
+		b = boxes[stack[s_i]];
 
-		//check
-		if (intersect_box(ray, b, t))
+		//leaf? brute check.
+		if (b.rind < 0)
+			intersect_leaf(ray, sh, W, I, O, tex, boxes, b, &ind, &t, &u, &v);
+		else
 		{
-			//leaf? brute check.
-			if (b.rind < 0)
+			const int l = b.lind & BIN_IND_MASK;
+			const float l_in = box_entry(ray, boxes[l], t);
+			const float r_in = box_entry(ray, boxes[b.rind], t);
+
+			//lind is the low side of the split axis unless BIN_FLIP says otherwise
+			const float d = axis_of(ray.direction, (b.lind >> BIN_AXIS_SHIFT) & 3);
+			const int left_near = (d >= 0.0f) == ((b.lind & BIN_FLIP) == 0);
+			const int near = left_near ? l : b.rind;
+			const int far = left_near ? b.rind : l;
+			const float near_in = left_near ? l_in : r_in;
+			const float far_in = left_near ? r_in : l_in;
+
+			if (far_in != FLT_MAX)
 			{
-				const int start = -1 * b.lind;
-				const int count = -1 * b.rind;
-				for (int i = start; i < start + count; i += 3)
-					intersect_triangle(ray, V, i, &ind, &t, &u, &v); //will update if success
+				stack[s_i] = far;
+				entry[s_i++] = far_in;
 			}
-			else
+			if (near_in != FLT_MAX)
 			{
-				stack[s_i++] = b.lind;
-				stack[s_i++] = b.rind;
+				stack[s_i] = near;
+				entry[s_i++] = near_in;
 			}
 		}
 	}
@@ -235,169 +735,1032 @@ static int hit_bvh(	const Ray ray,
 	return ind;
 }
 
-static float3 fetch_tex(	const float3 txcrd,
-							const int offset,
-							const int height,
-							const int width,
-							__global uchar *tex)
+static int hit_bvh_restart(	const Ray ray,
+								__global float *W,
+								__global int *I,
+								__global uint *O,
+								TEXTURES tex,
+								__global Box *boxes,
+								float *t_out,
+								float *u_out,
+								float *v_out)
 {
-	int x = floor((float)width * txcrd.x);
-	int y = floor((float)height * txcrd.y);
+	//restart trail (Laine 2010) with a short stack. one trail bit per level says whether the
+	//near side there is finished. the last SHORT_STACK far children are kept, anything older
+	//is found again by walking down from the root along the trail. 64 levels deep at most,
+	//main falls back to BVH_STACK for deeper trees (RESTART_MAX_DEPTH)
+	const Shear sh = shear_from_ray(ray);
+	ulong trail = 0;
+	ulong level = TRAIL_TOP;
+	int st_node[SHORT_STACK];
+	float st_in[SHORT_STACK];
+	ulong st_level[SHORT_STACK];
+	int s_top = 0;
+	int s_n = 0;
+
+	float t = FLT_MAX;
+	float u, v;
+	int ind = -1;
+
+	int node = box_entry(ray, boxes[0], t) != FLT_MAX ? 0 : -1;
+	while (node != -1)
+	{
+		const Box b = boxes[node];
+		if (b.rind >= 0)
+		{
+			const int l = b.lind & BIN_IND_MASK;
+			const float l_in = box_entry(ray, boxes[l], t);
+			const float r_in = box_entry(ray, boxes[b.rind], t);
+			const float d = axis_of(ray.direction, (b.lind >> BIN_AXIS_SHIFT) & 3);
+			const int left_near = (d >= 0.0f) == ((b.lind & BIN_FLIP) == 0);
+			const int near = left_near ? l : b.rind;
+			const int far = left_near ? b.rind : l;
+			const int hit_near = (left_near ? l_in : r_in) != FLT_MAX;
+			const int hit_far = (left_near ? r_in : l_in) != FLT_MAX;
+
+			//a set trail bit means only the last child is left. at the lowest set bit (where a restart is headed)
+			//that's the far child after a finished near one, if a closer hit has culled it the subtree is done
+			const int finished = (trail & level) && !hit_far && !(trail & (level - 1));
+			if ((hit_near || hit_far) && !finished)
+			{
+				if (trail & level)
+					node = hit_far ? far : near;
+				else if (hit_near && hit_far)
+				{
+					s_top = (s_top + 1) % SHORT_STACK;
+					st_node[s_top] = far;
+					st_in[s_top] = left_near ? r_in : l_in;
+					st_level[s_top] = level;
+					s_n = min(s_n + 1, SHORT_STACK);
+					node = near;
+				}
+				else
+				{
+					node = hit_near ? near : far;
+					trail |= level;
+				}
+				level >>= 1;
+				continue;
+			}
+		}
+		else
+			intersect_leaf(ray, sh, W, I, O, tex, boxes, b, &ind, &t, &u, &v);
 
-	uchar R = tex[offset + (y * width + x) * 3];
-	uchar G = tex[offset + (y * width + x) * 3 + 1];
-	uchar B = tex[offset + (y * width + x) * 3 + 2];
+		//subtree done. carry the trail up to the deepest level with a far child left
+		node = -1;
+		while (level != TRAIL_TOP)
+		{
+			const ulong done = level << 1;
+			trail = (trail & ~(done - 1)) + done;
+			if (!trail)
+				break;
+			const ulong target = trail & (~trail + 1);
+			level = target >> 1;
+			if (s_n && st_level[s_top] == target)
+			{
+				const float entry = st_in[s_top];
+				node = st_node[s_top];
+				s_top = (s_top + SHORT_STACK - 1) % SHORT_STACK;
+				s_n--;
+				if (entry > t)
+				{
+					node = -1;
+					continue;
+				}
+			}
+			else
+			{
+				s_n = 0;
+				node = 0;
+				level = TRAIL_TOP;
+			}
+			break;
+		}
+	}
 
-	float3 out = ((float3)((float)R, (float)G, (float)B) / 255.0f);
-	return out;
+	*t_out = t;
+	*u_out = u;
+	*v_out = v;
+	return ind;
 }
 
-static void fetch_all_tex(__global Material *mats, const int m_ind, __global uchar *tex, const float3 txcrd, float3 *trans, float3 *bump, float3 *spec, float3 *diff)
+static Box pair_leaf(__global float4 *nodes, const int leaf)
 {
-	Material mat = mats[m_ind];
-	*trans = mat.t_height ? fetch_tex(txcrd, mat.t_index, mat.t_height, mat.t_width, tex) : UNIT_X;
-	*bump = mat.b_height ? fetch_tex(txcrd, mat.b_index, mat.b_height, mat.b_width, tex) * 2.0f - 1.0f : UNIT_Z;
-	*spec = mat.s_height ? fetch_tex(txcrd, mat.s_index, mat.s_height, mat.s_width, tex) : BLACK;
-	*diff = mat.d_height ? fetch_tex(txcrd, mat.d_index, mat.d_height, mat.d_width, tex) : (float3)(0.6f, 0.6f, 0.6f);
+	//leaves on the stack are ~(parent * 2 + side), the refs and the box min for -quantize come from the parent
+	const int p = ~leaf;
+	const float4 n0 = nodes[(p >> 1) * 4];
+	const float4 n1 = nodes[(p >> 1) * 4 + 1];
+	const float4 n2 = nodes[(p >> 1) * 4 + 2];
+	const int4 n3 = as_int4(nodes[(p >> 1) * 4 + 3]);
+	Box b;
+	b.minx = p & 1 ? n1.x : n0.x;
+	b.miny = p & 1 ? n1.z : n0.z;
+	b.minz = p & 1 ? n2.z : n2.x;
+	b.lind = -1 * ~(p & 1 ? n3.y : n3.x);
+	b.rind = -1 * (p & 1 ? n3.w : n3.z);
+	return b;
 }
 
-static void fetch_NT(__global float3 *V, __global float3 *N, __global float3 *T, const float3 dir, const int ind, const float u, const float v, float3 *N_out, float3 *txcrd_out)
+static int hit_bvh_pairs(	const Ray ray,
+							__global float *W,
+							__global int *I,
+							__global uint *O,
+							TEXTURES tex,
+							__global Box *boxes,
+							float *t_out,
+							float *u_out,
+							float *v_out)
 {
-	float3 v0 = V[ind];
-	float3 v1 = V[ind + 1];
-	float3 v2 = V[ind + 2];
-	float3 geom_N = normalize(cross(v1 - v0, v2 - v0));
+	//while-while (Aila & Laine 2009) over child-pair nodes: one 64 byte node gives both children's
+	//bounds, so a step is one fetch and two slab tests. the inner loop keeps descending after the
+	//first leaf it finds (postponed in leaf) and only stops for a second one or an empty stack,
+	//then the leaf loop works through what it collected
+	__global float4 *nodes = (__global float4 *)boxes;
+	const Shear sh = shear_from_ray(ray);
+	const float3 ood = ray.origin * ray.inv_dir;
+	int stack[BVH_STACK_SIZE];
+	int s_i = 0;
+	stack[0] = PAIR_SENTINEL;
 
-	v0 = N[ind];
-	v1 = N[ind + 1];
-	v2 = N[ind + 2];
-	float3 sample_N = normalize((1.0f - u - v) * v0 + u * v1 + v * v2);
+	float t = FLT_MAX;
+	float u, v;
+	int ind = -1;
 
-	*N_out = dot(dir, geom_N) <= 0.0f ? sample_N : -1.0f * sample_N;
+	int node = 0;
+	int leaf = 0;
+	while (node != PAIR_SENTINEL)
+	{
+		while ((uint)node < (uint)PAIR_SENTINEL)
+		{
+			const float4 n0 = nodes[node * 4];
+			const float4 n1 = nodes[node * 4 + 1];
+			const float4 n2 = nodes[node * 4 + 2];
+			const int4 n3 = as_int4(nodes[node * 4 + 3]);
+
+			const float l_lox = n0.x * ray.inv_dir.x - ood.x;
+			const float l_hix = n0.y * ray.inv_dir.x - ood.x;
+			const float l_loy = n0.z * ray.inv_dir.y - ood.y;
+			const float l_hiy = n0.w * ray.inv_dir.y - ood.y;
+			const float l_loz = n2.x * ray.inv_dir.z - ood.z;
+			const float l_hiz = n2.y * ray.inv_dir.z - ood.z;
+			const float r_lox = n1.x * ray.inv_dir.x - ood.x;
+			const float r_hix = n1.y * ray.inv_dir.x - ood.x;
+			const float r_loy = n1.z * ray.inv_dir.y - ood.y;
+			const float r_hiy = n1.w * ray.inv_dir.y - ood.y;
+			const float r_loz = n2.z * ray.inv_dir.z - ood.z;
+			const float r_hiz = n2.w * ray.inv_dir.z - ood.z;
+			const float l_in = fmax(fmax(fmin(l_lox, l_hix), fmin(l_loy, l_hiy)), fmax(fmin(l_loz, l_hiz), 0.0f));
+			const float l_out = fmin(fmin(fmax(l_lox, l_hix), fmax(l_loy, l_hiy)), fmin(fmax(l_loz, l_hiz), t));
+			const float r_in = fmax(fmax(fmin(r_lox, r_hix), fmin(r_loy, r_hiy)), fmax(fmin(r_loz, r_hiz), 0.0f));
+			const float r_out = fmin(fmin(fmax(r_lox, r_hix), fmax(r_loy, r_hiy)), fmin(fmax(r_loz, r_hiz), t));
+			const int go_l = l_out >= l_in;
+			const int go_r = r_out >= r_in;
+
+			//leaf children go by ~(this node * 2 + side)
+			const int l = n3.x < 0 ? ~(node * 2) : n3.x;
+			const int r = n3.y < 0 ? ~(node * 2 + 1) : n3.y;
+			if (!go_l && !go_r)
+				node = stack[s_i--];
+			else
+			{
+				node = go_l ? l : r;
+				if (go_l && go_r)
+				{
+					int far = r;
+					if (r_in < l_in)
+					{
+						far = l;
+						node = r;
+					}
+					stack[++s_i] = far;
+				}
+			}
 
-	float3 txcrd = (1.0f - u - v) * T[ind] + u * T[ind + 1] + v * T[ind + 2];
-	txcrd.x -= floor(txcrd.x);
-	txcrd.y -= floor(txcrd.y);
-	if (txcrd.x < 0.0f)
-		txcrd.x = 1.0f + txcrd.x;
-	if (txcrd.y < 0.0f)
-		txcrd.y = 1.0f + txcrd.y;
-	*txcrd_out = txcrd;	
+			if (node < 0 && leaf >= 0)
+			{
+				leaf = node;
+				node = stack[s_i--];
+			}
+		}
+
+		while (leaf < 0)
+		{
+			intersect_leaf(ray, sh, W, I, O, tex, boxes, pair_leaf(nodes, leaf), &ind, &t, &u, &v);
+			leaf = node;
+			if (node < 0)
+				node = stack[s_i--];
+		}
+	}
+
+	*t_out = t;
+	*u_out = u;
+	*v_out = v;
+	return ind;
 }
 
-static float3 bump_map(__global float3 *TN, __global float3 *BTN, const int ind, const float3 sample_N, const float3 bump)
+static int ray_span(const Ray ray, const float3 bmin, const float3 bmax, float *t_in, float *t_out)
 {
-	float3 tangent = TN[ind];
-	float3 bitangent = BTN[ind];
-	tangent = normalize(tangent - sample_N * dot(sample_N, tangent));
-	return normalize(tangent * bump.x + bitangent * bump.y + sample_N * bump.z);
+	//entry and exit distance of the ray through a box
+	float3 t0 = (bmin - ray.origin) * ray.inv_dir;
+	float3 t1 = (bmax - ray.origin) * ray.inv_dir;
+	float3 tsmall = fmin(t0, t1);
+	float3 tbig = fmax(t0, t1);
+	*t_in = fmax(fmax(tsmall.x, tsmall.y), fmax(tsmall.z, 0.0f));
+	*t_out = fmin(fmin(tbig.x, tbig.y), tbig.z);
+	return *t_in < *t_out;
 }
 
-static float3 trace(Ray ray,
-					__global float3 *V,
-					__global float3 *T,
-					__global float3 *N,
-					__global Box *boxes,
-					__global Material *mats,
-					__global uchar *tex, 
-					unsigned int *seed0, 
-					unsigned int *seed1,
-					__global int *M,
-					__global float3 *TN,
-					__global float3 *BTN)
+static int hit_kd(	const Ray ray,
+					__global float *W,
+					__global int *I,
+					__global uint *O,
+					TEXTURES tex,
+					__global KdNode *nodes,
+					float *t_out,
+					float *u_out,
+					float *v_out)
 {
+	//stackless rope traversal (Popov et al. 2007)
+	const Shear sh = shear_from_ray(ray);
+	float t = FLT_MAX;
+	float u, v;
+	int ind = -1;
 
-	float3 color = BLACK;
-	float3 mask = WHITE;
+	float t_in, t_end;
+	KdNode n = nodes[0];
+	int node = ray_span(ray, (float3)(n.minx, n.miny, n.minz), (float3)(n.maxx, n.maxy, n.maxz), &t_in, &t_end) ? 0 : -1;
 
-	for (int j = 0; j < 5 || get_random(seed0, seed1) < stop_prob; j++)
+	while (node != -1 && t_in < t_end)
 	{
-		//collide
-		float t, u, v;
-		const int hit_ind = hit_bvh(ray, V, boxes, &t, &u, &v);
-
-		if (hit_ind == -1)
+		//descend to the leaf holding the entry point
+		const float3 p = ray.origin + ray.direction * t_in;
+		n = nodes[node];
+		while (n.axis != -1)
 		{
-			color = mask * SUN_BRIGHTNESS;
-			break;
+			const float pa = axis_of(p, n.axis);
+			node = pa < n.split || (pa == n.split && axis_of(ray.direction, n.axis) <= 0.0f) ? n.left : n.right;
+			n = nodes[node];
 		}
 
-		//get normal at collision point. geom_N is used for the normal_shift step, but might not be necessary.
-		float3 sample_N, txcrd;
-		fetch_NT(V, N, T, ray.direction, hit_ind, u, v, &sample_N, &txcrd);
-
-		//get material data
-		float3 trans, bump, spec, diff;
-		fetch_all_tex(mats, M[hit_ind / 3], tex, txcrd, &trans, &bump, &spec, &diff);
+		//exit face
+		const float3 far = (float3)(ray.direction.x > 0.0f ? n.maxx : n.minx,
+									ray.direction.y > 0.0f ? n.maxy : n.miny,
+									ray.direction.z > 0.0f ? n.maxz : n.minz);
+		const float3 exits = (far - ray.origin) * ray.inv_dir;
+		const int a = exits.x < exits.y ? (exits.x < exits.z ? 0 : 2) : (exits.y < exits.z ? 1 : 2);
+		const float t_exit = axis_of(exits, a);
+
+		for (int i = n.left; i < n.left + n.right; i++)
+			intersect_ref(ray, sh, W, O, tex, I[i], &ind, &t, &u, &v);
+		if (t <= t_exit)
+			break;
+		t_in = fmax(t_in, t_exit);
+		node = n.ropes[2 * a + (axis_of(ray.direction, a) > 0.0f ? 1 : 0)];
+	}
 
-		if (trans.x < 1.0f)
-		{
-			ray.origin = ray.origin + ray.direction * (t + NORMAL_SHIFT);
-			j--;
-			continue;
-		}
+	*t_out = t;
+	*u_out = u;
+	*v_out = v;
+	return ind;
+}
 
-		sample_N = bump_map(TN, BTN, hit_ind / 3, sample_N, bump);
-		
-		mask *= j >= 5 ? 1.0f / (1.0f - stop_prob) : 1.0f;
-		float spec_importance = spec.x + spec.y + spec.z;
-		float diff_importance = diff.x + diff.y + diff.z;
-		float total = spec_importance + diff_importance;
-		spec_importance /= total;
-		diff_importance /= total;
-		float3 new_dir;
-		float r1 = get_random(seed0, seed1);
-		float r2 = get_random(seed0, seed1);
-		if(get_random(seed0, seed1) < spec_importance)
-		{
-			float3 spec_dir = normalize(ray.direction - 2.0f * dot(ray.direction, sample_N) * sample_N);
-
-			//local orthonormal system
-			float3 axis = fabs(spec_dir.x) > fabs(spec_dir.y) ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
-			float3 hem_x = cross(axis, spec_dir);
-			float3 hem_y = cross(spec_dir, hem_x);
-
-			float phi = 2.0f * PI * r1;
-			float theta = acos(pow((1.0f - r2), 1.0f / (100.0f * spec.x)));
-
-			float3 x = hem_x * sin(theta) * cos(phi);
-			float3 y = hem_y * sin(theta) * sin(phi);
-			float3 z = spec_dir * cos(theta);
-			new_dir = x + y + z;
-			if (dot(new_dir, sample_N) < 0.0f) // pick mirror of sample (same importance)
-				new_dir = z - x - y;
-			mask *= spec;
-		}
-		else
-		{
-			//Diffuse reflection (default)
-			//local orthonormal system
-			float3 axis = fabs(sample_N.x) > fabs(sample_N.y) ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
-			float3 hem_x = cross(axis, sample_N);
-			float3 hem_y = cross(sample_N, hem_x);
-
-			//generate random direction on the unit hemisphere (cosine-weighted for importance sampling)
-			float r = sqrt(r1);
-			float theta = 2 * PI * r2;
-
-			//combine for new direction
-			new_dir = normalize(hem_x * r * cos(theta) + hem_y * r * sin(theta) + sample_N * sqrt(max(0.0f, 1.0f - r1)));
-			mask *= diff;
-		}
+typedef struct s_dda
+{
+	int3 cell;
+	int3 step;
+	int3 res;
+	float3 next;
+	float3 delta;
+}				DDA;
+
+static DDA dda_setup(const Ray ray, const float3 gmin, const float3 size, const int3 res, const float t_in)
+{
+	//Amanatides & Woo grid walk, starting at distance t_in
+	DDA d;
+	const float3 p = ray.origin + ray.direction * t_in;
+	const float3 c = floor((p - gmin) / size);
+	d.res = res;
+	d.cell = (int3)(clamp((int)c.x, 0, res.x - 1), clamp((int)c.y, 0, res.y - 1), clamp((int)c.z, 0, res.z - 1));
+	d.step = (int3)(ray.direction.x > 0.0f ? 1 : (ray.direction.x < 0.0f ? -1 : 0),
+					ray.direction.y > 0.0f ? 1 : (ray.direction.y < 0.0f ? -1 : 0),
+					ray.direction.z > 0.0f ? 1 : (ray.direction.z < 0.0f ? -1 : 0));
+	const float3 cellf = (float3)((float)d.cell.x, (float)d.cell.y, (float)d.cell.z);
+	const float3 bound = gmin + size * (cellf + (float3)(d.step.x > 0 ? 1.0f : 0.0f, d.step.y > 0 ? 1.0f : 0.0f, d.step.z > 0 ? 1.0f : 0.0f));
+	d.next = (bound - ray.origin) * ray.inv_dir;
+	d.delta = fabs(size * ray.inv_dir);
+	if (d.step.x == 0)
+		d.next.x = FLT_MAX;
+	if (d.step.y == 0)
+		d.next.y = FLT_MAX;
+	if (d.step.z == 0)
+		d.next.z = FLT_MAX;
+	return d;
+}
 
-		ray.origin = ray.origin + ray.direction * t + sample_N * NORMAL_SHIFT;
-		ray.direction = new_dir;
-		ray.inv_dir = 1.0f / new_dir;
+static int dda_axis(const DDA *d)
+{
+	return d->next.x < d->next.y ? (d->next.x < d->next.z ? 0 : 2) : (d->next.y < d->next.z ? 1 : 2);
+}
 
+static int dda_advance(DDA *d, float *t_in)
+{
+	//step into the next cell, 0 when the walk leaves the grid
+	const int a = dda_axis(d);
+	if (a == 0)
+	{
+		d->cell.x += d->step.x;
+		*t_in = d->next.x;
+		d->next.x += d->delta.x;
+		return d->cell.x >= 0 && d->cell.x < d->res.x;
 	}
-	return color;
+	if (a == 1)
+	{
+		d->cell.y += d->step.y;
+		*t_in = d->next.y;
+		d->next.y += d->delta.y;
+		return d->cell.y >= 0 && d->cell.y < d->res.y;
+	}
+	d->cell.z += d->step.z;
+	*t_in = d->next.z;
+	d->next.z += d->delta.z;
+	return d->cell.z >= 0 && d->cell.z < d->res.z;
 }
 
-#define DOF_rad 0.0f
+static float dda_exit(const DDA *d)
+{
+	return fmin(fmin(d->next.x, d->next.y), d->next.z);
+}
 
-static Ray ray_from_cam(const Camera cam, float x, float y, uint *s0, uint *s1)
+static int hit_grid(const Ray ray,
+					__global float *W,
+					__global int *I,
+					__global uint *O,
+					TEXTURES tex,
+					__global Grid *grid,
+					float *t_out,
+					float *u_out,
+					float *v_out)
 {
-	Ray ray;
+	const Shear sh = shear_from_ray(ray);
+	float t = FLT_MAX;
+	float u, v;
+	int ind = -1;
+
+	const Grid g = *grid;
+	__global GridCell *top = (__global GridCell *)(grid + 1);
+	__global SubGrid *subs = (__global SubGrid *)(top + g.top_count);
+	__global GridCell *cells = (__global GridCell *)(subs + g.sub_count);
+
+	const float3 gmin = (float3)(g.minx, g.miny, g.minz);
+	const int3 res = (int3)(g.resx, g.resy, g.resz);
+	const float3 size = ((float3)(g.maxx, g.maxy, g.maxz) - gmin) / (float3)((float)res.x, (float)res.y, (float)res.z);
+
+	float t_in, t_end;
+	int inside = ray_span(ray, gmin, (float3)(g.maxx, g.maxy, g.maxz), &t_in, &t_end);
+	DDA d = dda_setup(ray, gmin, size, res, t_in);
+
+	while (inside && t_in < t_end)
+	{
+		const float t_exit = fmin(dda_exit(&d), t_end);
+		const GridCell c = top[(d.cell.z * res.y + d.cell.y) * res.x + d.cell.x];
+		if (c.count == -1)
+		{
+			//walk this cell's subgrid between t_in and t_exit
+			const SubGrid sg = subs[c.start];
+			const int3 sub_res = (int3)(sg.resx, sg.resy, sg.resz);
+			const float3 cmin = gmin + size * (float3)((float)d.cell.x, (float)d.cell.y, (float)d.cell.z);
+			const float3 sub_size = size / (float3)((float)sub_res.x, (float)sub_res.y, (float)sub_res.z);
+			float sub_in = t_in;
+			DDA sd = dda_setup(ray, cmin, sub_size, sub_res, sub_in);
+			int sub_inside = 1;
+			while (sub_inside && sub_in < t_exit)
+			{
+				const float sub_exit = fmin(dda_exit(&sd), t_exit);
+				const GridCell sc = cells[sg.first_cell + (sd.cell.z * sub_res.y + sd.cell.y) * sub_res.x + sd.cell.x];
+				for (int i = sc.start; i < sc.start + sc.count; i++)
+					intersect_ref(ray, sh, W, O, tex, I[i], &ind, &t, &u, &v);
+				if (t <= sub_exit)
+					break;
+				sub_inside = dda_advance(&sd, &sub_in);
+			}
+		}
+		else
+			for (int i = c.start; i < c.start + c.count; i++)
+				intersect_ref(ray, sh, W, O, tex, I[i], &ind, &t, &u, &v);
+		if (t <= t_exit)
+			break;
+		inside = dda_advance(&d, &t_in);
+	}
+
+	*t_out = t;
+	*u_out = u;
+	*v_out = v;
+	return ind;
+}
+
+static int hit_scene(	const Ray ray,
+						__global float *W,
+						__global int *I,
+						__global uint *O,
+						TEXTURES tex,
+						__global Box *boxes,
+						float *t_out,
+						float *u_out,
+						float *v_out)
+{
+	//boxes holds whichever structure the host built, see Accel in rt.h
+#if ACCEL == ACCEL_KD
+	return hit_kd(ray, W, I, O, tex, (__global KdNode *)boxes, t_out, u_out, v_out);
+#elif ACCEL == ACCEL_GRID
+	return hit_grid(ray, W, I, O, tex, (__global Grid *)boxes, t_out, u_out, v_out);
+#elif BVH_TRAVERSAL == BVH_PAIRS
+	return hit_bvh_pairs(ray, W, I, O, tex, boxes, t_out, u_out, v_out);
+#elif BVH_TRAVERSAL == BVH_RESTART
+	return hit_bvh_restart(ray, W, I, O, tex, boxes, t_out, u_out, v_out);
+#else
+	return hit_bvh(ray, W, I, O, tex, boxes, t_out, u_out, v_out);
+#endif
+}
+
+static int occluded_bvh(	const Ray ray,
+							__global float *W,
+							__global int *I,
+							__global uint *O,
+							TEXTURES tex,
+							__global Box *boxes,
+							const float t_max,
+							uint *nodes,
+							uint *refs)
+{
+	//any hit before t_max will do, so no ordering and out on the first one.
+	//nodes and refs count what it read, the same numbers the lab keeps for occluded_bins
+	const Shear sh = shear_from_ray(ray);
+	int stack[BVH_STACK_SIZE];
+	int s_i = 1;
+	stack[0] = 0;
+
+	float t = t_max;
+	float u, v;
+	int ind = -1;
+
+	while (s_i)
+	{
+		const Box b = boxes[stack[--s_i]];
+		(*nodes)++;
+		if (!intersect_box(ray, b, t_max))
+			continue;
+		if (b.rind < 0)
+		{
+			*refs -= b.rind;
+			intersect_leaf(ray, sh, W, I, O, tex, boxes, b, &ind, &t, &u, &v);
+			if (ind != -1)
+				return 1;
+		}
+		else
+		{
+			stack[s_i++] = b.lind & BIN_IND_MASK;
+			stack[s_i++] = b.rind;
+		}
+	}
+	return 0;
+}
+
+static int occluded_pairs(	const Ray ray,
+							__global float *W,
+							__global int *I,
+							__global uint *O,
+							TEXTURES tex,
+							__global Box *boxes,
+							const float t_max,
+							uint *visits,
+							uint *refs)
+{
+	//hit_bvh_pairs' while-while as an any-hit: the boxes are cut at t_max, children go left first
+	//without sorting, and it's out on the first leaf that hits. nodes counts two boxes per pair node
+	__global float4 *nodes = (__global float4 *)boxes;
+	const Shear sh = shear_from_ray(ray);
+	const float3 ood = ray.origin * ray.inv_dir;
+	int stack[BVH_STACK_SIZE];
+	int s_i = 0;
+	stack[0] = PAIR_SENTINEL;
+
+	float t = t_max;
+	float u, v;
+	int ind = -1;
+
+	int node = 0;
+	int leaf = 0;
+	while (node != PAIR_SENTINEL)
+	{
+		while ((uint)node < (uint)PAIR_SENTINEL)
+		{
+			const float4 n0 = nodes[node * 4];
+			const float4 n1 = nodes[node * 4 + 1];
+			const float4 n2 = nodes[node * 4 + 2];
+			const int4 n3 = as_int4(nodes[node * 4 + 3]);
+			*visits += 2;
+
+			const float l_lox = n0.x * ray.inv_dir.x - ood.x;
+			const float l_hix = n0.y * ray.inv_dir.x - ood.x;
+			const float l_loy = n0.z * ray.inv_dir.y - ood.y;
+			const float l_hiy = n0.w * ray.inv_dir.y - ood.y;
+			const float l_loz = n2.x * ray.inv_dir.z - ood.z;
+			const float l_hiz = n2.y * ray.inv_dir.z - ood.z;
+			const float r_lox = n1.x * ray.inv_dir.x - ood.x;
+			const float r_hix = n1.y * ray.inv_dir.x - ood.x;
+			const float r_loy = n1.z * ray.inv_dir.y - ood.y;
+			const float r_hiy = n1.w * ray.inv_dir.y - ood.y;
+			const float r_loz = n2.z * ray.inv_dir.z - ood.z;
+			const float r_hiz = n2.w * ray.inv_dir.z - ood.z;
+			const int go_l = fmin(fmin(fmax(l_lox, l_hix), fmax(l_loy, l_hiy)), fmin(fmax(l_loz, l_hiz), t_max))
+							>= fmax(fmax(fmin(l_lox, l_hix), fmin(l_loy, l_hiy)), fmax(fmin(l_loz, l_hiz), 0.0f));
+			const int go_r = fmin(fmin(fmax(r_lox, r_hix), fmax(r_loy, r_hiy)), fmin(fmax(r_loz, r_hiz), t_max))
+							>= fmax(fmax(fmin(r_lox, r_hix), fmin(r_loy, r_hiy)), fmax(fmin(r_loz, r_hiz), 0.0f));
+
+			const int l = n3.x < 0 ? ~(node * 2) : n3.x;
+			const int r = n3.y < 0 ? ~(node * 2 + 1) : n3.y;
+			if (!go_l && !go_r)
+				node = stack[s_i--];
+			else
+			{
+				node = go_l ? l : r;
+				if (go_l && go_r)
+					stack[++s_i] = r;
+			}
+
+			if (node < 0 && leaf >= 0)
+			{
+				leaf = node;
+				node = stack[s_i--];
+			}
+		}
+
+		while (leaf < 0)
+		{
+			const Box b = pair_leaf(nodes, leaf);
+			*refs -= b.rind;
+			intersect_leaf(ray, sh, W, I, O, tex, boxes, b, &ind, &t, &u, &v);
+			if (ind != -1)
+				return 1;
+			leaf = node;
+			if (node < 0)
+				node = stack[s_i--];
+		}
+	}
+	return 0;
+}
+
+static int occluded_kd(	const Ray ray,
+							__global float *W,
+							__global int *I,
+							__global uint *O,
+							TEXTURES tex,
+							__global KdNode *nodes,
+							const float t_max,
+							uint *visits,
+							uint *refs)
+{
+	//hit_kd's rope walk cut off at t_max, out on the first ref that hits before it
+	const Shear sh = shear_from_ray(ray);
+	float t = t_max;
+	float u, v;
+	int ind = -1;
+
+	float t_in, t_end;
+	KdNode n = nodes[0];
+	int node = ray_span(ray, (float3)(n.minx, n.miny, n.minz), (float3)(n.maxx, n.maxy, n.maxz), &t_in, &t_end) ? 0 : -1;
+	t_end = fmin(t_end, t_max);
+
+	while (node != -1 && t_in < t_end)
+	{
+		const float3 p = ray.origin + ray.direction * t_in;
+		n = nodes[node];
+		(*visits)++;
+		while (n.axis != -1)
+		{
+			const float pa = axis_of(p, n.axis);
+			node = pa < n.split || (pa == n.split && axis_of(ray.direction, n.axis) <= 0.0f) ? n.left : n.right;
+			n = nodes[node];
+			(*visits)++;
+		}
+
+		const float3 far = (float3)(ray.direction.x > 0.0f ? n.maxx : n.minx,
+									ray.direction.y > 0.0f ? n.maxy : n.miny,
+									ray.direction.z > 0.0f ? n.maxz : n.minz);
+		const float3 exits = (far - ray.origin) * ray.inv_dir;
+		const int a = exits.x < exits.y ? (exits.x < exits.z ? 0 : 2) : (exits.y < exits.z ? 1 : 2);
+
+		for (int i = n.left; i < n.left + n.right; i++)
+		{
+			(*refs)++;
+			intersect_ref(ray, sh, W, O, tex, I[i], &ind, &t, &u, &v);
+			if (ind != -1)
+				return 1;
+		}
+		t_in = fmax(t_in, axis_of(exits, a));
+		node = n.ropes[2 * a + (axis_of(ray.direction, a) > 0.0f ? 1 : 0)];
+	}
+	return 0;
+}
+
+static int cell_occluded(	const Ray ray,
+							const Shear sh,
+							__global float *W,
+							__global int *I,
+							__global uint *O,
+							TEXTURES tex,
+							const GridCell c,
+							float *t,
+							uint *refs)
+{
+	float u, v;
+	int ind = -1;
+	for (int i = c.start; i < c.start + c.count; i++)
+	{
+		(*refs)++;
+		intersect_ref(ray, sh, W, O, tex, I[i], &ind, t, &u, &v);
+		if (ind != -1)
+			return 1;
+	}
+	return 0;
+}
+
+static int occluded_grid(	const Ray ray,
+							__global float *W,
+							__global int *I,
+							__global uint *O,
+							TEXTURES tex,
+							__global Grid *grid,
+							const float t_max,
+							uint *visits,
+							uint *refs)
+{
+	//hit_grid's two level walk cut off at t_max, out on the first ref that hits before it
+	const Shear sh = shear_from_ray(ray);
+	float t = t_max;
+
+	const Grid g = *grid;
+	__global GridCell *top = (__global GridCell *)(grid + 1);
+	__global SubGrid *subs = (__global SubGrid *)(top + g.top_count);
+	__global GridCell *cells = (__global GridCell *)(subs + g.sub_count);
+
+	const float3 gmin = (float3)(g.minx, g.miny, g.minz);
+	const int3 res = (int3)(g.resx, g.resy, g.resz);
+	const float3 size = ((float3)(g.maxx, g.maxy, g.maxz) - gmin) / (float3)((float)res.x, (float)res.y, (float)res.z);
+
+	float t_in, t_end;
+	int inside = ray_span(ray, gmin, (float3)(g.maxx, g.maxy, g.maxz), &t_in, &t_end);
+	t_end = fmin(t_end, t_max);
+	DDA d = dda_setup(ray, gmin, size, res, t_in);
+
+	while (inside && t_in < t_end)
+	{
+		const float t_exit = fmin(dda_exit(&d), t_end);
+		const GridCell c = top[(d.cell.z * res.y + d.cell.y) * res.x + d.cell.x];
+		(*visits)++;
+		if (c.count == -1)
+		{
+			const SubGrid sg = subs[c.start];
+			const int3 sub_res = (int3)(sg.resx, sg.resy, sg.resz);
+			const float3 cmin = gmin + size * (float3)((float)d.cell.x, (float)d.cell.y, (float)d.cell.z);
+			const float3 sub_size = size / (float3)((float)sub_res.x, (float)sub_res.y, (float)sub_res.z);
+			float sub_in = t_in;
+			DDA sd = dda_setup(ray, cmin, sub_size, sub_res, sub_in);
+			int sub_inside = 1;
+			while (sub_inside && sub_in < t_exit)
+			{
+				(*visits)++;
+				if (cell_occluded(ray, sh, W, I, O, tex, cells[sg.first_cell + (sd.cell.z * sub_res.y + sd.cell.y) * sub_res.x + sd.cell.x], &t, refs))
+					return 1;
+				sub_inside = dda_advance(&sd, &sub_in);
+			}
+		}
+		else if (cell_occluded(ray, sh, W, I, O, tex, c, &t, refs))
+			return 1;
+		inside = dda_advance(&d, &t_in);
+	}
+	return 0;
+}
+
+static int occluded(	const Ray ray,
+						__global float *W,
+						__global int *I,
+						__global uint *O,
+						TEXTURES tex,
+						__global Box *boxes,
+						const float t_max,
+						uint *nodes,
+						uint *refs)
+{
+	//visibility between ray.origin and ray.origin + t_max * ray.direction, for light sampling and AO.
+	//nodes counts nodes or cells visited, refs the refs tested
+#if ACCEL == ACCEL_KD
+	return occluded_kd(ray, W, I, O, tex, (__global KdNode *)boxes, t_max, nodes, refs);
+#elif ACCEL == ACCEL_GRID
+	return occluded_grid(ray, W, I, O, tex, (__global Grid *)boxes, t_max, nodes, refs);
+#elif BVH_TRAVERSAL == BVH_PAIRS
+	return occluded_pairs(ray, W, I, O, tex, boxes, t_max, nodes, refs);
+#else
+	return occluded_bvh(ray, W, I, O, tex, boxes, t_max, nodes, refs);
+#endif
+}
+
+//RAY CONES (Akenine-Moller et al. 2019). every path carries a cone (x width, y spread angle) that starts
+//at one pixel's angle and widens with distance. at a hit its width against the triangle's uv density
+//gives a mip level, so far away and post-diffuse lookups read small levels instead of the full map
+#define CONE_DIFFUSE_SPREAD 0.25f //rough stand-in for a cosine lobe, spec bounces keep their spread
+
+//HIT ATTRIBUTES: everything shading needs about a face in one record of ATTR_STRIDE uints, kept apart
+//from the W positions traversal reads (see prep_scene). normals and the tangent are octahedral snorm16
+//pairs, uvs are halves relative to the face's integer uv cell (so tiling uvs keep their precision)
+//and the bitangent is rebuilt from the tangent and the face normal. a sphere's record only has its
+//lod bias and material, with ATTR_SPHERE in the tangent slot
+#define ATTR_STRIDE 10
+#define ATTR_N 0
+#define ATTR_GEOM 3
+#define ATTR_TAN 4
+#define ATTR_UV 5
+#define ATTR_LOD 8
+#define ATTR_MAT 9
+#define ATTR_SPHERE 0x80008000u //snorm16 -32768 twice, oct_encode never makes it
+
+static float3 oct_decode(const uint p)
+{
+	const float2 e = convert_float2((short2)((short)(p & 0xffff), (short)(p >> 16))) / 32767.0f;
+	float3 n = (float3)(e.x, e.y, 1.0f - fabs(e.x) - fabs(e.y));
+	if (n.z < 0.0f)
+		n.xy = (1.0f - fabs(n.yx)) * (float2)(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+	return normalize(n);
+}
+
+static float cam_spread(const Camera cam, const float x, const float y)
+{
+	return length(cam.d_x) / length(cam.focus - (cam.origin + cam.d_x * x + cam.d_y * y));
+}
+
+static float3 sphere_normal(const float u, const float v)
+{
+	//inverse of intersect_sphere's (u, v)
+	const float phi = (u - 0.5f) * 2.0f * M_PI_F;
+	const float theta = v * M_PI_F;
+	return (float3)(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+static float tex_lod(__global uint *A, const int ind, const float3 dir, const float width)
+{
+	//log2 of the footprint in uv units, fetch_tex adds log2 of the map's own size.
+	//the face's half log2 of uv area over world area is baked into its record
+#if SCENE_SPHERES
+	if (A[ind * ATTR_STRIDE + ATTR_TAN] == ATTR_SPHERE)
+		return as_float(A[ind * ATTR_STRIDE + ATTR_LOD]) + log2(width); //no one normal to take the grazing angle from
+#endif
+	const float3 n = oct_decode(A[ind * ATTR_STRIDE + ATTR_GEOM]);
+	return as_float(A[ind * ATTR_STRIDE + ATTR_LOD]) + log2(width / fabs(dot(dir, n)));
+}
+
+static void fetch_all_tex(__global Material *mats, const int m_ind, TEXTURES tex, const float3 txcrd, const float lod, float3 *bump, float3 *spec, float3 *diff)
+{
+	Material mat = mats[m_ind];
+#if SCENE_MAPS & MAPS_BUMP
+	*bump = mat.b_height ? fetch_tex(txcrd, mat.b_index, mat.b_height, mat.b_width, mat.b_format, tex, lod) * 2.0f - 1.0f : UNIT_Z;
+#else
+	*bump = UNIT_Z;
+#endif
+#if SCENE_MAPS & MAPS_SPEC
+	*spec = mat.s_height ? fetch_tex(txcrd, mat.s_index, mat.s_height, mat.s_width, mat.s_format, tex, lod) : BLACK;
+#else
+	*spec = BLACK;
+#endif
+#if SCENE_MAPS & MAPS_DIFF
+	*diff = mat.d_height ? fetch_tex(txcrd, mat.d_index, mat.d_height, mat.d_width, mat.d_format, tex, lod) : (float3)(0.6f, 0.6f, 0.6f);
+#else
+	*diff = (float3)(0.6f, 0.6f, 0.6f);
+#endif
+}
+
+static void fetch_NT(__global uint *A, const float3 dir, const int ind, const float u, const float v, float3 *N_out, float3 *txcrd_out)
+{
+	__global uint *rec = A + ind * ATTR_STRIDE;
+#if SCENE_SPHERES
+	if (rec[ATTR_TAN] == ATTR_SPHERE)
+	{
+		const float3 n = sphere_normal(u, v);
+		*N_out = dot(dir, n) <= 0.0f ? n : -1.0f * n;
+		*txcrd_out = (float3)(u, v, 0.0f);
+		return;
+	}
+#endif
+	float3 geom_N = oct_decode(rec[ATTR_GEOM]);
+
+	float3 v0 = oct_decode(rec[ATTR_N]);
+	float3 v1 = oct_decode(rec[ATTR_N + 1]);
+	float3 v2 = oct_decode(rec[ATTR_N + 2]);
+	float3 sample_N = normalize((1.0f - u - v) * v0 + u * v1 + v * v2);
+
+	*N_out = dot(dir, geom_N) <= 0.0f ? sample_N : -1.0f * sample_N;
+
+	__global half *uv = (__global half *)(rec + ATTR_UV);
+	float3 txcrd = (float3)((1.0f - u - v) * vload_half2(0, uv) + u * vload_half2(1, uv) + v * vload_half2(2, uv), 0.0f);
+	txcrd.x -= floor(txcrd.x);
+	txcrd.y -= floor(txcrd.y);
+	if (txcrd.x < 0.0f)
+		txcrd.x = 1.0f + txcrd.x;
+	if (txcrd.y < 0.0f)
+		txcrd.y = 1.0f + txcrd.y;
+	*txcrd_out = txcrd;	
+}
+
+static float3 bump_map(__global uint *A, const int ind, const float3 sample_N, const float3 bump)
+{
+#if SCENE_SPHERES
+	if (A[ind * ATTR_STRIDE + ATTR_TAN] == ATTR_SPHERE)
+	{
+		//along increasing longitude, anything at the poles
+		const float3 tangent = fabs(sample_N.y) < 0.9999f ? normalize((float3)(-sample_N.z, 0.0f, sample_N.x)) : (float3)(1.0f, 0.0f, 0.0f);
+		return normalize(tangent * bump.x + cross(tangent, sample_N) * bump.y + sample_N * bump.z);
+	}
+#endif
+	float3 tangent = oct_decode(A[ind * ATTR_STRIDE + ATTR_TAN]);
+	float3 bitangent = normalize(cross(tangent, oct_decode(A[ind * ATTR_STRIDE + ATTR_GEOM])));
+	tangent = normalize(tangent - sample_N * dot(sample_N, tangent));
+	return normalize(tangent * bump.x + bitangent * bump.y + sample_N * bump.z);
+}
+
+static void scatter(	Ray *ray,
+						float3 *mask,
+						float2 *cone,
+						const int j,
+						const int hit_ind,
+						const float t,
+						const float u,
+						const float v,
+						__global uint *A,
+						__global Material *mats,
+						TEXTURES tex,
+						unsigned int *seed0,
+						unsigned int *seed1)
+{
+	//shading half of a bounce: texture fetch, bump, BSDF sample, new ray.
+	//cutouts never get here, traversal already skipped them (alpha_hit)
+	//get normal at collision point. geom_N is used for the normal_shift step, but might not be necessary.
+	float3 sample_N, txcrd;
+	fetch_NT(A, ray->direction, hit_ind, u, v, &sample_N, &txcrd);
+
+	//get material data, at the mip level the cone's footprint asks for
+	cone->x += cone->y * t;
+	const float lod = tex_lod(A, hit_ind, ray->direction, cone->x);
+	float3 bump, spec, diff;
+	fetch_all_tex(mats, A[hit_ind * ATTR_STRIDE + ATTR_MAT], tex, txcrd, lod, &bump, &spec, &diff);
+
+#if SCENE_MAPS & MAPS_BUMP
+	sample_N = bump_map(A, hit_ind, sample_N, bump);
+#endif
+	
+	*mask *= j >= 5 ? 1.0f / (1.0f - stop_prob) : 1.0f;
+	float3 new_dir;
+	float r1 = get_random(seed0, seed1);
+	float r2 = get_random(seed0, seed1);
+#if SCENE_MAPS & MAPS_SPEC
+	//without specular maps spec is always black and every bounce is diffuse
+	float spec_importance = spec.x + spec.y + spec.z;
+	float diff_importance = diff.x + diff.y + diff.z;
+	float total = spec_importance + diff_importance;
+	spec_importance /= total;
+	diff_importance /= total;
+	if(get_random(seed0, seed1) < spec_importance)
+	{
+		float3 spec_dir = normalize(ray->direction - 2.0f * dot(ray->direction, sample_N) * sample_N);
+
+		//local orthonormal system
+		float3 axis = fabs(spec_dir.x) > fabs(spec_dir.y) ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
+		float3 hem_x = cross(axis, spec_dir);
+		float3 hem_y = cross(spec_dir, hem_x);
+
+		float phi = 2.0f * PI * r1;
+		float theta = acos(pow((1.0f - r2), 1.0f / (100.0f * spec.x)));
+
+		float3 x = hem_x * sin(theta) * cos(phi);
+		float3 y = hem_y * sin(theta) * sin(phi);
+		float3 z = spec_dir * cos(theta);
+		new_dir = x + y + z;
+		if (dot(new_dir, sample_N) < 0.0f) // pick mirror of sample (same importance)
+			new_dir = z - x - y;
+		*mask *= spec;
+	}
+	else
+#endif
+	{
+		//Diffuse reflection (default)
+		//local orthonormal system
+		float3 axis = fabs(sample_N.x) > fabs(sample_N.y) ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
+		float3 hem_x = cross(axis, sample_N);
+		float3 hem_y = cross(sample_N, hem_x);
+
+		//generate random direction on the unit hemisphere (cosine-weighted for importance sampling)
+		float r = sqrt(r1);
+		float theta = 2 * PI * r2;
+
+		//combine for new direction
+		new_dir = normalize(hem_x * r * cos(theta) + hem_y * r * sin(theta) + sample_N * sqrt(max(0.0f, 1.0f - r1)));
+		*mask *= diff;
+		cone->y = fmax(cone->y, CONE_DIFFUSE_SPREAD);
+	}
+
+	ray->origin = ray->origin + ray->direction * t + sample_N * NORMAL_SHIFT;
+	ray->direction = new_dir;
+	ray->inv_dir = 1.0f / new_dir;
+}
+
+static int keep_going(const int j, unsigned int *seed0, unsigned int *seed1)
+{
+	//russian roulette past the first 5 bounces, with -bounces as a hard cap on top
+#if MAX_BOUNCES
+	if (j >= MAX_BOUNCES)
+		return 0;
+#endif
+	return j < 5 || get_random(seed0, seed1) < stop_prob;
+}
+
+static float3 trace(Ray ray,
+					float spread,
+					__global uint *A,
+					__global Box *boxes,
+					__global Material *mats,
+					TEXTURES tex, 
+					unsigned int *seed0, 
+					unsigned int *seed1,
+					__global int *I,
+					__global float *W,
+					__global uint *O)
+{
+
+	float3 color = BLACK;
+	float3 mask = WHITE;
+	float2 cone = (float2)(0.0f, spread);
+
+	for (int j = 0; keep_going(j, seed0, seed1); j++)
+	{
+		//collide
+		float t, u, v;
+		const int hit_ind = hit_scene(ray, W, I, O, tex, boxes, &t, &u, &v);
+
+		if (hit_ind == -1)
+		{
+			color = mask * SUN_BRIGHTNESS;
+			break;
+		}
+
+		scatter(&ray, &mask, &cone, j, hit_ind, t, u, v, A, mats, tex, seed0, seed1);
+	}
+	return color;
+}
+
+#define DOF_rad 0.0f
+
+//PIXEL ORDER. a work item's index goes through pixel_of instead of straight to (i % width, i / width):
+//the image is cut into PIXEL_TILE x PIXEL_TILE tiles, left to right in bands of PIXEL_TILE rows, and a
+//tile's pixels are walked in Morton order. with 256 wide work groups a group traces one square tile
+//instead of a 256x1 strip, so its primary rays start close together and hit the same nodes and texels.
+//tiles cut off by the right or bottom edge are walked row by row, so any width x height maps one to one
+//and nothing is padded. the result is the linear pixel, output and seeds keep the framebuffer layout
+#define PIXEL_TILE 16
+#define PIXEL_TILED 0
+#define PIXEL_LINEAR 1
+#ifndef PIXEL_ORDER
+# define PIXEL_ORDER PIXEL_TILED
+#endif
+
+static uint morton_even(uint m)
+{
+	//squeezes the even bits of m together, enough for a 16x16 tile
+	m &= 0x5555;
+	m = (m | (m >> 1)) & 0x3333;
+	m = (m | (m >> 2)) & 0x0f0f;
+	m = (m | (m >> 4)) & 0x00ff;
+	return m;
+}
+
+static uint pixel_of(const uint i, const uint width, const uint height)
+{
+#if PIXEL_ORDER == PIXEL_LINEAR
+	return i;
+#else
+	//every band and every tile in a band is full except the last, so plain division finds both
+	const uint y0 = i / (width * PIXEL_TILE) * PIXEL_TILE;
+	const uint h = min((uint)PIXEL_TILE, height - y0);
+	const uint in_band = i - y0 * width;
+	const uint x0 = in_band / (PIXEL_TILE * h) * PIXEL_TILE;
+	const uint w = min((uint)PIXEL_TILE, width - x0);
+	const uint k = in_band - x0 * h;
+	if (w == PIXEL_TILE && h == PIXEL_TILE)
+		return (y0 + morton_even(k >> 1)) * width + x0 + morton_even(k);
+	return (y0 + k / w) * width + x0 + k % w;
+#endif
+}
+
+static Ray ray_from_cam(const Camera cam, float x, float y, uint *s0, uint *s1)
+{
+	Ray ray;
 	ray.origin = cam.focus;
 	float3 through = cam.origin + cam.d_x * x + cam.d_y * y;
 	ray.direction = normalize(cam.focus - through);
@@ -405,25 +1768,24 @@ static Ray ray_from_cam(const Camera cam, float x, float y, uint *s0, uint *s1)
 	return ray;
 }
 
-__kernel void render_kernel(__global float3 *V,
-							__global float3 *T,
-							__global float3 *N,
+__kernel void render_kernel(__global uint *A,
 							__global Box *boxes,
 							__global Material *mats,
-							__global uchar *tex,
+							TEXTURES tex,
 							const float3 cam_origin,
 							const float3 cam_focus,
 							const float3 cam_dx,
 							const float3 cam_dy,
 							const uint sample_count,
 							const uint width,
+							const uint height,
 							__global uint* seeds,
 							__global float3* output,
-							__global int *M,
-							__global float3 *TN,
-							__global float3 *BTN)
+							__global int *I,
+							__global float *W,
+							__global uint *O)
 {
-	unsigned int pixel_id = get_global_id(0);
+	unsigned int pixel_id = pixel_of(get_global_id(0), width, height);
 	unsigned int x = pixel_id % width;
 	unsigned int y = pixel_id / width;
 
@@ -443,8 +1805,504 @@ __kernel void render_kernel(__global float3 *V,
 		float x_coord = (float)x + get_random(&seed0, &seed1);
 		float y_coord = (float)y + get_random(&seed0, &seed1);
 		Ray ray = ray_from_cam(cam, x_coord, y_coord, &seed0, &seed1);
-		sum_color += trace(ray, V, T, N, boxes, mats, tex, &seed0, &seed1, M, TN, BTN);
+		sum_color += trace(ray, cam_spread(cam, x_coord, y_coord), A, boxes, mats, tex, &seed0, &seed1, I, W, O);
 	}
 	
 	output[pixel_id] = sum_color;
-}
\ No newline at end of file
+}
+
+//PERSISTENT THREADS (Aila & Laine 2009). launched with about as many work items as the device keeps
+//resident; each one pulls a single path (pixel, sample) off a global counter until the frame is done,
+//so a lane whose path ends early takes the next one instead of idling behind its neighbours.
+//work is sample-major, so lanes fetching together get neighbouring pixels. two samples of a pixel can
+//be in flight at once, hence the atomic adds into output. random state belongs to the work item
+static void atomic_add_float(volatile __global float *p, const float x)
+{
+	uint old = as_uint(*p);
+	uint seen;
+	while ((seen = atomic_cmpxchg((volatile __global uint *)p, old, as_uint(as_float(old) + x))) != old)
+		old = seen;
+}
+
+__kernel void render_persistent(__global uint *A,
+								__global Box *boxes,
+								__global Material *mats,
+								TEXTURES tex,
+								const float3 cam_origin,
+								const float3 cam_focus,
+								const float3 cam_dx,
+								const float3 cam_dy,
+								const uint sample_count,
+								const uint width,
+								const uint height,
+								__global uint* seeds,
+								__global float3* output,
+								__global int *I,
+								__global float *W,
+								__global uint *O,
+								__global uint *work)
+{
+	const int gid = get_global_id(0);
+	unsigned int seed0 = seeds[gid * 2];
+	unsigned int seed1 = seeds[gid * 2 + 1];
+
+	Camera cam;
+	cam.origin = cam_origin;
+	cam.focus = cam_focus;
+	cam.d_x = cam_dx;
+	cam.d_y = cam_dy;
+
+	const uint resolution = width * height;
+	const uint total = resolution * sample_count;
+	for (uint w = atomic_inc(work); w < total; w = atomic_inc(work))
+	{
+		const uint pixel_id = pixel_of(w % resolution, width, height);
+		float x_coord = (float)(pixel_id % width) + get_random(&seed0, &seed1);
+		float y_coord = (float)(pixel_id / width) + get_random(&seed0, &seed1);
+		Ray ray = ray_from_cam(cam, x_coord, y_coord, &seed0, &seed1);
+		float3 c = trace(ray, cam_spread(cam, x_coord, y_coord), A, boxes, mats, tex, &seed0, &seed1, I, W, O);
+
+		volatile __global float *out = (volatile __global float *)&output[pixel_id];
+		atomic_add_float(&out[0], c.x);
+		atomic_add_float(&out[1], c.y);
+		atomic_add_float(&out[2], c.z);
+	}
+
+	seeds[gid * 2] = seed0;
+	seeds[gid * 2 + 1] = seed1;
+}
+
+//PATH REGENERATION (Novák et al. 2010). render_kernel's lanes wait at the end of every sample for the
+//longest path in the warp; here one loop iteration is one bounce, and a lane whose path ended starts its
+//next sample right away. each work item gets a budget of REGEN_BOUNCES bounces per requested sample and
+//stops starting new paths once it's spent (the path in flight always finishes, dropping it would bias
+//towards short paths), so the sample count varies per pixel. output is rescaled to sample_count samples
+//so composite stays the same, counts gets the real number
+#define REGEN_BOUNCES 6
+
+__kernel void render_regen(	__global uint *A,
+							__global Box *boxes,
+							__global Material *mats,
+							TEXTURES tex,
+							const float3 cam_origin,
+							const float3 cam_focus,
+							const float3 cam_dx,
+							const float3 cam_dy,
+							const uint sample_count,
+							const uint width,
+							const uint height,
+							__global uint* seeds,
+							__global float3* output,
+							__global int *I,
+							__global float *W,
+							__global uint *O,
+							__global int *counts)
+{
+	unsigned int pixel_id = pixel_of(get_global_id(0), width, height);
+	unsigned int x = pixel_id % width;
+	unsigned int y = pixel_id / width;
+
+	unsigned int seed0 = seeds[pixel_id * 2];
+	unsigned int seed1 = seeds[pixel_id * 2 + 1];
+
+	Camera cam;
+	cam.origin = cam_origin;
+	cam.focus = cam_focus;
+	cam.d_x = cam_dx;
+	cam.d_y = cam_dy;
+
+	const int budget = sample_count * REGEN_BOUNCES;
+	float3 sum_color = BLACK;
+	int done = 0;
+
+	float x_coord = (float)x + get_random(&seed0, &seed1);
+	float y_coord = (float)y + get_random(&seed0, &seed1);
+	Ray ray = ray_from_cam(cam, x_coord, y_coord, &seed0, &seed1);
+	float3 mask = WHITE;
+	float2 cone = (float2)(0.0f, cam_spread(cam, x_coord, y_coord));
+	int j = 0;
+	for (int bounce = 0; ; bounce++)
+	{
+		float t, u, v;
+		const int hit_ind = hit_scene(ray, W, I, O, tex, boxes, &t, &u, &v);
+
+		int ended = 0;
+		if (hit_ind == -1)
+		{
+			sum_color += mask * SUN_BRIGHTNESS;
+			ended = 1;
+		}
+		else
+		{
+			scatter(&ray, &mask, &cone, j, hit_ind, t, u, v, A, mats, tex, &seed0, &seed1);
+			j++;
+			ended = !keep_going(j, &seed0, &seed1);
+		}
+
+		if (ended)
+		{
+			done++;
+			if (bounce + 1 >= budget)
+				break;
+			x_coord = (float)x + get_random(&seed0, &seed1);
+			y_coord = (float)y + get_random(&seed0, &seed1);
+			ray = ray_from_cam(cam, x_coord, y_coord, &seed0, &seed1);
+			mask = WHITE;
+			cone = (float2)(0.0f, cam_spread(cam, x_coord, y_coord));
+			j = 0;
+		}
+	}
+
+	output[pixel_id] = sum_color * ((float)sample_count / (float)done);
+	counts[pixel_id] = done;
+	seeds[pixel_id * 2] = seed0;
+	seeds[pixel_id * 2 + 1] = seed1;
+}
+
+//WAVEFRONT (Laine et al. 2013). one path per pixel, path state lives in SoA buffers between launches
+//and every stage is its own small kernel over a compacted queue of path indices, so shading never
+//waits on a long traversal in the same warp. the host loops extend -> logic -> shade -> generate.
+//counters: [WF_NEXT] next extend queue, [WF_SHADE] shade queue, [WF_REGEN] paths wanting a new sample.
+//stages that run over a queue filled on the device read its length from the counter, the host launches an upper bound
+#define WF_NEXT 0
+#define WF_SHADE 1
+#define WF_REGEN 2
+
+static void wf_finish(const int p, __global int *samples, const uint sample_count, __global int *q_regen, __global int *counters)
+{
+	if (++samples[p] < sample_count)
+		q_regen[atomic_inc(&counters[WF_REGEN])] = p;
+}
+
+__kernel void wf_generate(	const float3 cam_origin,
+							const float3 cam_focus,
+							const float3 cam_dx,
+							const float3 cam_dy,
+							const uint width,
+							__global uint *seeds,
+							__global float3 *ray_o,
+							__global float3 *ray_d,
+							__global float3 *mask,
+							__global int *depth,
+							__global float2 *cone,
+							__global int *q_regen,
+							__global int *q_next,
+							__global int *counters)
+{
+	const int gid = get_global_id(0);
+	if (gid >= counters[WF_REGEN])
+		return;
+	const int p = q_regen[gid];
+
+	unsigned int seed0 = seeds[p * 2];
+	unsigned int seed1 = seeds[p * 2 + 1];
+
+	Camera cam;
+	cam.origin = cam_origin;
+	cam.focus = cam_focus;
+	cam.d_x = cam_dx;
+	cam.d_y = cam_dy;
+
+	float x_coord = (float)(p % width) + get_random(&seed0, &seed1);
+	float y_coord = (float)(p / width) + get_random(&seed0, &seed1);
+	Ray ray = ray_from_cam(cam, x_coord, y_coord, &seed0, &seed1);
+
+	ray_o[p] = ray.origin;
+	ray_d[p] = ray.direction;
+	mask[p] = WHITE;
+	depth[p] = 0;
+	cone[p] = (float2)(0.0f, cam_spread(cam, x_coord, y_coord));
+	seeds[p * 2] = seed0;
+	seeds[p * 2 + 1] = seed1;
+	q_next[atomic_inc(&counters[WF_NEXT])] = p;
+}
+
+__kernel void wf_extend(	__global float *W,
+							__global int *I,
+							__global Box *boxes,
+							__global float3 *ray_o,
+							__global float3 *ray_d,
+							__global int *q_extend,
+							const int extend_count,
+							__global float *hit_t,
+							__global float *hit_u,
+							__global float *hit_v,
+							__global int *hit_ind,
+							__global uint *O,
+							TEXTURES tex)
+{
+	const int gid = get_global_id(0);
+	if (gid >= extend_count)
+		return;
+	const int p = q_extend[gid];
+
+	Ray ray;
+	ray.origin = ray_o[p];
+	ray.direction = ray_d[p];
+	ray.inv_dir = 1.0f / ray.direction;
+
+	float t, u, v;
+	hit_ind[p] = hit_scene(ray, W, I, O, tex, boxes, &t, &u, &v);
+	hit_t[p] = t;
+	hit_u[p] = u;
+	hit_v[p] = v;
+}
+
+__kernel void wf_logic(	__global float3 *mask,
+						__global float3 *output,
+						__global int *hit_ind,
+						__global int *samples,
+						const uint sample_count,
+						__global int *q_extend,
+						const int extend_count,
+						__global int *q_shade,
+						__global int *q_regen,
+						__global int *counters)
+{
+	const int gid = get_global_id(0);
+	if (gid >= extend_count)
+		return;
+	const int p = q_extend[gid];
+
+	if (hit_ind[p] == -1)
+	{
+		output[p] += mask[p] * SUN_BRIGHTNESS;
+		wf_finish(p, samples, sample_count, q_regen, counters);
+	}
+	else
+		q_shade[atomic_inc(&counters[WF_SHADE])] = p;
+}
+
+__kernel void wf_shade(	__global uint *A,
+						__global Material *mats,
+						TEXTURES tex,
+						__global uint *seeds,
+						__global float3 *ray_o,
+						__global float3 *ray_d,
+						__global float3 *mask,
+						__global int *depth,
+						__global float2 *cone,
+						__global float *hit_t,
+						__global float *hit_u,
+						__global float *hit_v,
+						__global int *hit_ind,
+						__global int *samples,
+						const uint sample_count,
+						__global int *q_shade,
+						__global int *q_next,
+						__global int *q_regen,
+						__global int *counters)
+{
+	const int gid = get_global_id(0);
+	if (gid >= counters[WF_SHADE])
+		return;
+	const int p = q_shade[gid];
+
+	unsigned int seed0 = seeds[p * 2];
+	unsigned int seed1 = seeds[p * 2 + 1];
+
+	Ray ray;
+	ray.origin = ray_o[p];
+	ray.direction = ray_d[p];
+	float3 m = mask[p];
+	float2 c = cone[p];
+	int j = depth[p];
+
+	//same russian roulette as trace(), just checked after the bounce instead of before the next one
+	scatter(&ray, &m, &c, j, hit_ind[p], hit_t[p], hit_u[p], hit_v[p], A, mats, tex, &seed0, &seed1);
+	j++;
+	const int alive = keep_going(j, &seed0, &seed1);
+
+	ray_o[p] = ray.origin;
+	ray_d[p] = ray.direction;
+	mask[p] = m;
+	cone[p] = c;
+	depth[p] = j;
+	seeds[p * 2] = seed0;
+	seeds[p * 2 + 1] = seed1;
+
+	if (alive)
+		q_next[atomic_inc(&counters[WF_NEXT])] = p;
+	else
+		wf_finish(p, samples, sample_count, q_regen, counters);
+}
+
+//SORTING between wavefront stages (Garanzha & Loop 2010, Eisenacher et al. 2013): counting sort of a
+//queue into WF_BINS bins. rays key on direction octant over a morton code of the origin cell, so
+//neighbouring lanes walk the same part of the tree. hits key on material so fetch_all_tex reads one texture at a time.
+//order inside a bin is whatever the atomics give, nothing downstream cares
+#define WF_CELL_BITS 3
+#define WF_BINS (1 << (3 + 3 * WF_CELL_BITS))
+#define WF_SCAN_GROUP 256
+
+static uint spread_bits(uint x)
+{
+	//puts two zero bits between each of the low 10 bits of x
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+__kernel void wf_key_rays(	__global float3 *ray_o,
+							__global float3 *ray_d,
+							const float3 scene_min,
+							const float3 scene_max,
+							__global int *queue,
+							__global int *counters,
+							const int which,
+							__global int *keys)
+{
+	const int gid = get_global_id(0);
+	if (gid >= counters[which])
+		return;
+	const int p = queue[gid];
+	const float3 o = ray_o[p];
+	const float3 d = ray_d[p];
+
+	const float cells = (float)(1 << WF_CELL_BITS);
+	uint3 c = convert_uint3(clamp((o - scene_min) / (scene_max - scene_min) * cells, 0.0f, cells - 1.0f));
+	uint morton = spread_bits(c.x) | (spread_bits(c.y) << 1) | (spread_bits(c.z) << 2);
+	uint octant = (d.x < 0.0f) | ((d.y < 0.0f) << 1) | ((d.z < 0.0f) << 2);
+	keys[gid] = (octant << (3 * WF_CELL_BITS)) | morton;
+}
+
+__kernel void wf_key_mats(	__global int *hit_ind,
+							__global uint *A,
+							__global int *queue,
+							__global int *counters,
+							const int which,
+							__global int *keys)
+{
+	const int gid = get_global_id(0);
+	if (gid >= counters[which])
+		return;
+	keys[gid] = A[hit_ind[queue[gid]] * ATTR_STRIDE + ATTR_MAT] % WF_BINS;
+}
+
+__kernel void wf_histogram(	__global int *keys,
+							__global int *counters,
+							const int which,
+							__global int *hist)
+{
+	const int gid = get_global_id(0);
+	if (gid >= counters[which])
+		return;
+	atomic_inc(&hist[keys[gid]]);
+}
+
+__kernel void wf_scan(__global int *hist)
+{
+	//exclusive prefix sum over the bins, one work group. each lane owns a run of bins
+	__local int sums[WF_SCAN_GROUP];
+	const int lid = get_local_id(0);
+	const int run = WF_BINS / WF_SCAN_GROUP;
+
+	int total = 0;
+	for (int i = 0; i < run; i++)
+		total += hist[lid * run + i];
+	sums[lid] = total;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid == 0)
+	{
+		int offset = 0;
+		for (int i = 0; i < WF_SCAN_GROUP; i++)
+		{
+			int s = sums[i];
+			sums[i] = offset;
+			offset += s;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int offset = sums[lid];
+	for (int i = 0; i < run; i++)
+	{
+		int h = hist[lid * run + i];
+		hist[lid * run + i] = offset;
+		offset += h;
+	}
+}
+
+__kernel void wf_scatter(	__global int *queue,
+							__global int *keys,
+							__global int *counters,
+							const int which,
+							__global int *hist,
+							__global int *sorted)
+{
+	const int gid = get_global_id(0);
+	if (gid >= counters[which])
+		return;
+	sorted[atomic_inc(&hist[keys[gid]])] = queue[gid];
+}
+
+//occlusion queries from the lab (gpu_occlusion): each ray is two float4s, origin and max distance,
+//then the direction. per ray the answer, then the nodes and refs occluded read for it
+__kernel void occlusion_test(	__global Box *boxes,
+								__global float *W,
+								__global int *I,
+								__global uint *O,
+								TEXTURES tex,
+								__global float4 *rays,
+								const int ray_count,
+								__global int *hits,
+								__global uint *counts)
+{
+	const int gid = get_global_id(0);
+	if (gid >= ray_count)
+		return;
+	const float4 o = rays[2 * gid];
+	Ray ray;
+	ray.origin = o.xyz;
+	ray.direction = rays[2 * gid + 1].xyz;
+	ray.inv_dir = 1.0f / ray.direction;
+
+	uint nodes = 0;
+	uint refs = 0;
+	hits[gid] = occluded(ray, W, I, O, tex, boxes, o.w, &nodes, &refs);
+	counts[2 * gid] = nodes;
+	counts[2 * gid + 1] = refs;
+}
+
+//calibration: same box and triangle tests the traversal uses, timed from the host (see calibrate.c).
+//prims come in a power of two and get picked with a mask, a modulo in the loop costs about a box test
+__kernel void calibrate_boxes(	__global Box *boxes,
+								__global float3 *rays,
+								const int prim_mask,
+								const int tests,
+								__global int *out)
+{
+	const int gid = get_global_id(0);
+	Ray ray;
+	ray.origin = rays[2 * gid];
+	ray.direction = rays[2 * gid + 1];
+	ray.inv_dir = 1.0f / ray.direction;
+
+	int hits = 0;
+	for (int i = 0; i < tests; i++)
+		hits += intersect_box(ray, boxes[(gid + i) & prim_mask], FLT_MAX);
+	out[gid] = hits;
+}
+
+__kernel void calibrate_tris(	__global float *W,
+								__global float3 *rays,
+								const int prim_mask,
+								const int tests,
+								__global int *out)
+{
+	const int gid = get_global_id(0);
+	Ray ray;
+	ray.origin = rays[2 * gid];
+	ray.direction = rays[2 * gid + 1];
+	ray.inv_dir = 1.0f / ray.direction;
+
+	const Shear sh = shear_from_ray(ray);
+	int ind = -1;
+	float t = FLT_MAX;
+	float u, v;
+	for (int i = 0; i < tests; i++)
+		intersect_triangle(ray, sh, W, (gid + i) & prim_mask, &ind, &t, &u, &v);
+	out[gid] = ind;
+}
@@ -151,6 +151,56 @@ void load_mats(Scene *S, char *rel_path, char *filename)
 
 }
 
+static void default_mats(Scene *S)
+{
+	//for .obj files without a usable mtllib
+	S->materials = calloc(1, sizeof(Material));
+	S->mat_count = 1;
+	S->materials[0].friendly_name = strdup("default");
+	S->materials[0].Kd = (cl_float3){0.6f, 0.6f, 0.6f};
+	S->materials[0].d = 1.0f;
+}
+
+static int read_face(char *line, int *v, int *vt, int *vn)
+{
+	//each corner is "v", "v/vt", "v//vn" or "v/vt/vn" (sponza has the last, teapot.obj the first).
+	//missing vt and vn come back 0, anything past 4 corners is ignored. returns vertex count
+	bzero(vt, 4 * sizeof(int));
+	bzero(vn, 4 * sizeof(int));
+	char *p = line + 1;
+	int count = 0;
+	while (count < 4)
+	{
+		char *end;
+		v[count] = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		p = end;
+		if (*p == '/')
+		{
+			vt[count] = strtol(p + 1, &p, 10);
+			if (*p == '/')
+				vn[count] = strtol(p + 1, &p, 10);
+		}
+		count++;
+	}
+	return count;
+}
+
+static int planar_quad(cl_float3 *p)
+{
+	//kept whole when (a, b, c) and (a, c, d) face the same way (convex across the a-c diagonal)
+	//and d sits on abc's plane to within QUAD_PLANAR. that's close, not exact: the a-c diagonal can be
+	//up to quad_slack off the polygon the builders clip, so the kd-tree and grid pad quads by it
+	cl_float3 n1 = cross(vec_sub(p[1], p[0]), vec_sub(p[2], p[0]));
+	cl_float3 n2 = cross(vec_sub(p[2], p[0]), vec_sub(p[3], p[0]));
+	float len = sqrtf(dot(n1, n1));
+	if (len == 0.0f || dot(n1, n2) <= 0.0f)
+		return 0;
+	float size = fmax(sqrtf(dot(vec_sub(p[2], p[0]), vec_sub(p[2], p[0]))), sqrtf(dot(vec_sub(p[3], p[1]), vec_sub(p[3], p[1]))));
+	return fabs(dot(vec_sub(p[3], p[0]), n1)) / len <= QUAD_PLANAR * size;
+}
+
 Scene *scene_from_obj(char *rel_path, char *filename)
 {
 	//meta function to load whole scene from file (ie sponza.obj + sponza.mtl)
@@ -190,16 +240,33 @@ Scene *scene_from_obj(char *rel_path, char *filename)
 			vt_count++;
 		else if (strncmp(line, "f ", 2) == 0)
 		{
-			int va, vna, vta, vb, vnb, vtb, vc, vnc, vtc, vd, vnd, vtd;
-			int count = sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d", &va, &vta, &vna, &vb, &vtb, &vnb, &vc, &vtc, &vnc, &vd, &vtd, &vnd);
-			face_count += count == 9 ? 1 : 2;
+			int v[4], vt[4], vn[4];
+			int count = read_face(line, v, vt, vn);
+			face_count += count == 4 ? 2 : count == 3 ? 1 : 0;
 		}
+		else if (strncmp(line, "sphere ", 7) == 0)
+			face_count++;
 		else if (strncmp(line, "g ", 2) == 0)
 			obj_count++;
 	}
 
 	//load mats
-	load_mats(S, rel_path, matpath);
+	FILE *mtl = NULL;
+	if (matpath[0])
+	{
+		char *mtl_file = malloc(strlen(rel_path) + strlen(matpath) + 1);
+		strcpy(mtl_file, rel_path);
+		strcat(mtl_file, matpath);
+		mtl = fopen(mtl_file, "r");
+		free(mtl_file);
+	}
+	if (mtl)
+	{
+		fclose(mtl);
+		load_mats(S, rel_path, matpath);
+	}
+	else
+		default_mats(S);
 	printf("basics counted\n");
 
 	//back to top of file, alloc objects, count faces, load v, vt, vn
@@ -219,7 +286,7 @@ Scene *scene_from_obj(char *rel_path, char *filename)
 	int *obj_indices = calloc(obj_count, sizeof(int));
 	obj_count = 0;
 
-	int mat_ind = -1;
+	int mat_ind = 0; //until the first usemtl
 	int smoothing = 0;
 	while(fgets(line, 512, fp))
 	{
@@ -260,60 +327,57 @@ Scene *scene_from_obj(char *rel_path, char *filename)
 			obj_indices[obj_count] = face_count;
 			obj_count++;
 		}
-		else if (strncmp(line, "f ", 2) == 0)
+		else if (strncmp(line, "sphere ", 7) == 0)
 		{
+			//not obj, our own statement: "sphere x y z radius" with the current material
 			Face f;
-			int va, vna, vta, vb, vnb, vtb, vc, vnc, vtc, vd, vnd, vtd;
-			int count = sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d", &va, &vta, &vna, &vb, &vtb, &vnb, &vc, &vtc, &vnc, &vd, &vtd, &vnd);
-			f.shape = 3;
-			f.center = ORIGIN;
-			f.verts[0] = V[va - 1];
-			f.center = vec_add(f.center, f.verts[0]);
-			f.verts[1] = V[vb - 1]; 
-			f.center = vec_add(f.center, f.verts[1]);
-			f.verts[2] = V[vc - 1];
-			f.center = vec_add(f.center, f.verts[2]);
-
-			f.center = vec_scale(f.center, 1.0f / (float)f.shape);
-
-			f.norms[0] = VN[vna - 1]; 
-			f.norms[1] = VN[vnb - 1]; 
-			f.norms[2] = VN[vnc - 1]; 
-
-			f.tex[0] = VT[vta - 1];
-			f.tex[1] = VT[vtb - 1];
-			f.tex[2] = VT[vtc - 1];
-
-			f.N = unit_vec(cross(vec_sub(f.verts[1], f.verts[0]), vec_sub(f.verts[2], f.verts[0])));
-			if (dot(f.N, f.norms[0]) < 0)
-				f.N = vec_rev(f.N);
+			bzero(&f, sizeof(Face));
+			sscanf(line, "sphere %f %f %f %f", &f.verts[0].x, &f.verts[0].y, &f.verts[0].z, &f.verts[1].x);
+			f.shape = GPU_SPHERE;
+			f.center = f.verts[0];
 			f.smoothing = smoothing;
 			f.mat_type = GPU_MAT_DIFFUSE;
 			f.mat_ind = mat_ind;
-			f.next = NULL;
 			faces[face_count++] = f;
-
-			if (count == 12)
+		}
+		else if (strncmp(line, "f ", 2) == 0)
+		{
+			Face f;
+			int v[4], vt[4], vn[4];
+			int count = read_face(line, v, vt, vn);
+			if (count < 3)
+			{
+				printf("skipping face with %d vertices: %s", count, line);
+				continue;
+			}
+			//planar quads stay one face, the rest are split into (a, b, c) and (a, c, d)
+			int tris[3][4] = {{0, 1, 2}, {0, 2, 3}, {0, 1, 2, 3}};
+			int whole = 0;
+			if (count == 4)
 			{
+				cl_float3 p[4] = {V[v[0] - 1], V[v[1] - 1], V[v[2] - 1], V[v[3] - 1]};
+				whole = planar_quad(p);
+			}
+			for (int k = 0; k < (count == 4 && !whole ? 2 : 1); k++)
+			{
+				int *corners = whole ? tris[2] : tris[k];
+				f.shape = whole ? GPU_QUAD : GPU_TRIANGLE;
 				f.center = ORIGIN;
-				f.verts[0] = V[va - 1];
-				f.center = vec_add(f.center, f.verts[0]);
-				f.verts[1] = V[vc - 1]; 
-				f.center = vec_add(f.center, f.verts[1]);
-				f.verts[2] = V[vd - 1];
-				f.center = vec_add(f.center, f.verts[2]);
+				for (int j = 0; j < f.shape; j++)
+				{
+					f.verts[j] = V[v[corners[j]] - 1];
+					f.center = vec_add(f.center, f.verts[j]);
+				}
 
 				f.center = vec_scale(f.center, 1.0f / (float)f.shape);
+				f.N = unit_vec(cross(vec_sub(f.verts[1], f.verts[0]), vec_sub(f.verts[2], f.verts[0])));
 
-				f.norms[0] = VN[vna - 1]; 
-				f.norms[1] = VN[vnc - 1]; 
-				f.norms[2] = VN[vnd - 1]; 
-
-				f.tex[0] = VT[vta - 1];
-				f.tex[1] = VT[vtc - 1];
-				f.tex[2] = VT[vtd - 1];
+				for (int j = 0; j < f.shape; j++)
+				{
+					f.norms[j] = vn[corners[j]] ? VN[vn[corners[j]] - 1] : f.N;
+					f.tex[j] = vt[corners[j]] ? VT[vt[corners[j]] - 1] : ORIGIN;
+				}
 
-				f.N = unit_vec(cross(vec_sub(f.verts[1], f.verts[0]), vec_sub(f.verts[2], f.verts[0])));
 				if (dot(f.N, f.norms[0]) < 0)
 					f.N = vec_rev(f.N);
 				f.smoothing = smoothing;
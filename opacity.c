@@ -0,0 +1,134 @@
+#include "rt.h"
+
+//OPACITY MICROMAPS. every face whose material has a map_d gets its barycentric domain cut into
+//OMM_LEVEL subdivisions (4^OMM_LEVEL micro-triangles), each marked opaque, transparent or unknown from
+//the map_d texels under its uv bounds (one texel of margin, bilinear reaches that far). faces that come
+//out all opaque are plain faces again, all transparent ones are dropped before the accel is built, the
+//rest keep their states in scene->omm and get alpha tested inside traversal: the micromap answers for
+//opaque and transparent micro-triangles, only unknown ones fetch the texture (see alpha_hit in the kernel).
+//micro-triangle order is row by row along u, lower and upper triangle of each cell in turn, same as the kernel.
+//masked quads are split back into triangles first, micromaps are per triangle. spheres have no
+//uv domain to cut up and always count as opaque
+
+#define OMM_MAX_TEXELS 4096 //micro-triangles covering more texels than this are just unknown
+
+static int micro_state(Map *m, cl_float3 *uv)
+{
+	float lo_u = fmin(uv[0].x, fmin(uv[1].x, uv[2].x));
+	float hi_u = fmax(uv[0].x, fmax(uv[1].x, uv[2].x));
+	float lo_v = fmin(uv[0].y, fmin(uv[1].y, uv[2].y));
+	float hi_v = fmax(uv[0].y, fmax(uv[1].y, uv[2].y));
+	int x0 = (int)floorf(lo_u * m->width) - 1;
+	int x1 = (int)floorf(hi_u * m->width) + 1;
+	int y0 = (int)floorf(lo_v * m->height) - 1;
+	int y1 = (int)floorf(hi_v * m->height) + 1;
+	if ((long)(x1 - x0 + 1) * (y1 - y0 + 1) > OMM_MAX_TEXELS)
+		return OMM_UNKNOWN;
+
+	int opaque = 0;
+	int clear = 0;
+	for (int y = y0; y <= y1; y++)
+		for (int x = x0; x <= x1; x++)
+		{
+			//same test as the kernel: anything under full opacity lets the ray through
+			int tx = ((x % m->width) + m->width) % m->width;
+			int ty = ((y % m->height) + m->height) % m->height;
+			if (m->pixels[(ty * m->width + tx) * 3] == 255)
+				opaque++;
+			else
+				clear++;
+		}
+	return clear == 0 ? OMM_OPAQUE : (opaque == 0 ? OMM_TRANSPARENT : OMM_UNKNOWN);
+}
+
+static cl_float3 bary_uv(Face *f, float u, float v)
+{
+	return vec_add(vec_add(vec_scale(f->tex[0], 1.0f - u - v), vec_scale(f->tex[1], u)), vec_scale(f->tex[2], v));
+}
+
+static void face_states(Face *f, Map *m, cl_uint *states, int *opaque, int *clear)
+{
+	const int n = 1 << OMM_LEVEL;
+	const float step = 1.0f / (float)n;
+	int k = 0;
+	memset(states, 0, OMM_STATE_WORDS * sizeof(cl_uint));
+	*opaque = 0;
+	*clear = 0;
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n - i; j++)
+			for (int upper = 0; upper < (i + j < n - 1 ? 2 : 1); upper++)
+			{
+				cl_float3 uv[3];
+				if (upper)
+				{
+					uv[0] = bary_uv(f, (i + 1) * step, j * step);
+					uv[1] = bary_uv(f, (i + 1) * step, (j + 1) * step);
+					uv[2] = bary_uv(f, i * step, (j + 1) * step);
+				}
+				else
+				{
+					uv[0] = bary_uv(f, i * step, j * step);
+					uv[1] = bary_uv(f, (i + 1) * step, j * step);
+					uv[2] = bary_uv(f, i * step, (j + 1) * step);
+				}
+				int s = micro_state(m, uv);
+				*opaque += s == OMM_OPAQUE;
+				*clear += s == OMM_TRANSPARENT;
+				states[k >> 4] |= (cl_uint)s << ((k & 15) * 2);
+				k++;
+			}
+}
+
+void classify_opacity(Scene *scene)
+{
+	const int micro = 1 << (2 * OMM_LEVEL);
+	cl_uint *omm = NULL;
+	int omm_count = 0;
+	int kept = 0;
+	int dropped = 0;
+	int opaque_faces = 0;
+	int unknown = 0;
+	cl_uint states[OMM_STATE_WORDS];
+	int masked_quads = 0;
+	for (int i = 0; i < scene->face_count; i++)
+		masked_quads += scene->faces[i].shape == GPU_QUAD && scene->materials[scene->faces[i].mat_ind].map_d;
+	Face *faces = malloc((scene->face_count + masked_quads) * sizeof(Face));
+	for (int i = 0; i < scene->face_count; i++)
+	{
+		Map *m = scene->faces[i].shape == GPU_SPHERE ? NULL : scene->materials[scene->faces[i].mat_ind].map_d;
+		for (int h = 0; h < (m && scene->faces[i].shape == GPU_QUAD ? 2 : 1); h++)
+		{
+			Face f = m ? quad_half(&scene->faces[i], h) : scene->faces[i];
+			f.alpha = -1;
+			if (m)
+			{
+				int opaque, clear;
+				face_states(&f, m, states, &opaque, &clear);
+				if (clear == micro)
+				{
+					dropped++;
+					continue;
+				}
+				if (opaque == micro)
+					opaque_faces++;
+				else
+				{
+					if (omm_count % 1024 == 0)
+						omm = realloc(omm, (omm_count + 1024) * OMM_STATE_WORDS * sizeof(cl_uint));
+					memcpy(&omm[omm_count * OMM_STATE_WORDS], states, sizeof(states));
+					f.alpha = omm_count++;
+					unknown += micro - opaque - clear;
+				}
+			}
+			faces[kept++] = f;
+		}
+	}
+
+	printf("opacity: %d faces dropped as transparent, %d alpha tested (%.1f%% of their micro-triangles need the texture), %d masked faces fully opaque, %d masked quads split\n",
+		dropped, omm_count, omm_count ? 100.0f * unknown / (float)(omm_count * micro) : 0.0f, opaque_faces, masked_quads);
+	free(scene->faces);
+	scene->faces = faces;
+	scene->face_count = kept;
+	scene->omm = omm;
+	scene->omm_count = omm_count;
+}
@@ -0,0 +1,103 @@
+#include "rt.h"
+
+//QUANTIZED POSITIONS (-quantize, sbvh only). every leaf reference gets its triangle as 9 signed 16 bit
+//offsets on one power-of-two grid over the scene, counted from a cell the kernel derives from the leaf's
+//box min, so a reference costs 18 bytes instead of the face's 36 in W. a vertex snaps to the same grid
+//point whichever leaf reads it, so neighbours still share bit-identical edges and the watertight test
+//stays watertight. every box grows by one grid step so the snapped triangles stay inside their leaves.
+//references reaching further than 16 bits from their leaf's cell keep full floats.
+//the blob goes to the device in place of W: QUANT_HEADER floats (grid origin, step, 1 / step, offset of
+//the shorts in floats), the fallback triangles at 9 floats each, then 9 shorts per reference in I order
+
+#define QUANT_GRID_BITS 20
+
+static int grid_cell(float v, float origin, float inv)
+{
+	//same float ops as the kernel, so both sides agree on every leaf's cell
+	return (int)floorf((v - origin) * inv);
+}
+
+void quantize_accel(Scene *scene, Accel *accel)
+{
+	gpu_bin *nodes = accel->nodes;
+	gpu_bin root = nodes[0];
+	float extent = fmax(root.maxx - root.minx, fmax(root.maxy - root.miny, root.maxz - root.minz));
+	float unit = exp2f(ceilf(log2f(fmax(extent, FLT_MIN) / (float)(1 << QUANT_GRID_BITS))));
+	float inv = 1.0f / unit;
+	float origin[3] = {root.minx, root.miny, root.minz};
+
+	for (int i = 0; i < accel->node_count; i++)
+	{
+		nodes[i].minx -= unit;
+		nodes[i].miny -= unit;
+		nodes[i].minz -= unit;
+		nodes[i].maxx += unit;
+		nodes[i].maxy += unit;
+		nodes[i].maxz += unit;
+	}
+
+	cl_short *q = calloc(accel->ref_count * 9, sizeof(cl_short));
+	int *fallback = malloc(scene->face_count * sizeof(int));
+	memset(fallback, -1, scene->face_count * sizeof(int));
+	int fallback_count = 0;
+	int fallback_refs = 0;
+	for (int n = 0; n < accel->node_count; n++)
+	{
+		gpu_bin *b = &nodes[n];
+		if (b->rind >= 0)
+			continue;
+		int cell[3] = {grid_cell(b->minx, origin[0], inv), grid_cell(b->miny, origin[1], inv), grid_cell(b->minz, origin[2], inv)};
+		for (int r = -b->lind; r < -b->lind - b->rind; r++)
+		{
+			Face *f = &scene->faces[accel->refs[r]];
+			cl_short *out = &q[r * 9];
+			int fits = 1;
+			for (int v = 0; v < 3 && fits; v++)
+			{
+				float p[3] = {f->verts[v].x, f->verts[v].y, f->verts[v].z};
+				for (int a = 0; a < 3; a++)
+				{
+					long offset = lrintf((p[a] - origin[a]) * inv) - cell[a];
+					if (offset < -32767 || offset > 32767)
+						fits = 0;
+					out[v * 3 + a] = (cl_short)offset;
+				}
+			}
+			if (fits)
+				continue;
+			if (fallback[accel->refs[r]] == -1)
+				fallback[accel->refs[r]] = fallback_count++;
+			out[0] = QUANT_FALLBACK;
+			out[1] = (cl_short)(fallback[accel->refs[r]] & 0xffff);
+			out[2] = (cl_short)(fallback[accel->refs[r]] >> 16);
+			fallback_refs++;
+		}
+	}
+
+	int shorts_at = QUANT_HEADER + fallback_count * 9;
+	accel->quant_size = shorts_at * sizeof(cl_float) + ((accel->ref_count * 9 * sizeof(cl_short) + 3) & ~(size_t)3);
+	cl_float *blob = calloc(accel->quant_size, 1);
+	blob[0] = origin[0];
+	blob[1] = origin[1];
+	blob[2] = origin[2];
+	blob[3] = unit;
+	blob[4] = inv;
+	memcpy(&blob[5], &shorts_at, sizeof(int));
+	for (int i = 0; i < scene->face_count; i++)
+		if (fallback[i] != -1)
+			for (int v = 0; v < 3; v++)
+			{
+				blob[QUANT_HEADER + fallback[i] * 9 + v * 3] = scene->faces[i].verts[v].x;
+				blob[QUANT_HEADER + fallback[i] * 9 + v * 3 + 1] = scene->faces[i].verts[v].y;
+				blob[QUANT_HEADER + fallback[i] * 9 + v * 3 + 2] = scene->faces[i].verts[v].z;
+			}
+	memcpy(&blob[shorts_at], q, accel->ref_count * 9 * sizeof(cl_short));
+	free(q);
+	free(fallback);
+
+	accel->quant = blob;
+	accel->quantized = 1;
+	printf("quantized: grid step %g, %d of %d refs in 16 bits (%d faces kept as floats), positions %.2f MB instead of %.2f MB\n",
+		unit, accel->ref_count - fallback_refs, accel->ref_count, fallback_count,
+		(float)accel->quant_size / (1024.0f * 1024.0f), (float)(scene->face_count * 9 * sizeof(cl_float)) / (1024.0f * 1024.0f));
+}
@@ -44,6 +44,82 @@
 #define GPU_TRIANGLE 3
 #define GPU_QUAD 4
 
+//acceleration structures, same values as ACCEL in new_kernel.cl
+#define ACCEL_BVH 0
+#define ACCEL_KD 1
+#define ACCEL_GRID 2
+
+//how gpu_render runs paths: one long kernel per pixel, wavefront stages over path queues
+//(optionally sorted between stages, WF_* must match new_kernel.cl), persistent threads on a work counter,
+//or the megakernel with path regeneration
+#define RENDER_MEGAKERNEL 0
+#define RENDER_WAVEFRONT 1
+#define RENDER_WAVEFRONT_SORTED 2
+#define RENDER_PERSISTENT 3
+#define RENDER_REGEN 4
+#define WF_BINS 4096
+#define WF_SCAN_GROUP 256
+
+//which pixel a render work item traces (PIXEL_ORDER in new_kernel.cl): 16x16 Morton-ordered tiles,
+//one per work group, or the plain row-major strips
+#define PIXEL_TILED 0
+#define PIXEL_LINEAR 1
+
+//how a map's texels sit in the packed texture buffer, same values as TEX_* in new_kernel.cl
+#define TEX_RGB 0
+#define TEX_GRAY 1
+#define TEX_BC1 2
+#define TEX_BC4 3
+
+//hit attribute record layout in uints, same as ATTR_* in new_kernel.cl
+#define ATTR_STRIDE 10
+#define ATTR_N 0
+#define ATTR_GEOM 3
+#define ATTR_TAN 4
+#define ATTR_UV 5
+#define ATTR_LOD 8
+#define ATTR_MAT 9
+
+//quantized positions blob, same as QUANT_* in new_kernel.cl
+#define QUANT_HEADER 8
+#define QUANT_FALLBACK -32768
+
+//map types a scene has, -D SCENE_MAPS for new_kernel.cl (same values there)
+#define MAPS_DIFF 1
+#define MAPS_SPEC 2
+#define MAPS_BUMP 4
+#define MAPS_TRANS 8
+
+//opacity records for alpha tested faces (see opacity.c), same as OMM_* in new_kernel.cl.
+//refs to those faces carry ALPHA_TEST and the record's slot instead of the face index
+#define ALPHA_TEST (1 << 30)
+#define OMM_LEVEL 3
+#define OMM_STATE_WORDS 4
+#define OMM_STRIDE 12
+#define OMM_FACE 0
+#define OMM_UV 1
+#define OMM_MAP 4
+#define OMM_STATES 8
+#define OMM_TRANSPARENT 0
+#define OMM_OPAQUE 1
+#define OMM_UNKNOWN 2
+
+//planar quads stay one face (shape 4) through the builders and go to the device as two triangles,
+//(a, b, c) then (a, c, d). their refs carry QUAD_REF and the first triangle (same in new_kernel.cl)
+#define QUAD_REF (1 << 29)
+#define QUAD_PLANAR 1e-4f //how far d may be off abc's plane, relative to the quad's longer diagonal
+
+//spheres are faces with shape GPU_SPHERE: verts[0] is the center, verts[1].x the radius. they're one
+//device record each (center and radius in W) and their refs carry SPHERE_REF (same in new_kernel.cl).
+//their hit records have ATTR_SPHERE for a tangent, a value oct_encode never makes (snorm16 -32768)
+#define SPHERE_REF (1 << 28)
+#define ATTR_SPHERE 0x80008000u
+
+//state of a node built by sbvh_lazy
+#define LAZY_DONE 0
+#define LAZY_PENDING 1
+#define LAZY_BUILDING 2
+
 enum type {SPHERE, PLANE, CYLINDER, TRIANGLE};
 enum mat {MAT_DIFFUSE, MAT_SPECULAR, MAT_REFRACTIVE, MAT_NULL};
 
@@ -114,6 +190,7 @@ typedef struct s_face
 	cl_float3 norms[4];
 	cl_float3 tex[4];
 	cl_float3 N;
+	cl_int alpha; //micromap slot in scene->omm when the face is alpha tested, -1 otherwise
 
 	cl_float3 center;
 	struct s_face *next;
@@ -141,6 +218,106 @@ typedef struct s_gpu_bin
 	cl_int rind;
 }				gpu_bin;
 
+//internal gpu_bins keep the split axis (bits 29-30) and whether lind is the high side
+//of the split (BIN_FLIP) above the child index in lind. leaves have rind < 0 and no flags
+#define BIN_AXIS_SHIFT 29
+#define BIN_FLIP (1 << 28)
+#define BIN_IND_MASK (BIN_FLIP - 1)
+
+//bvh traversal in the kernel: full private stack, restart trail + short stack, or child-pair nodes
+//walked while-while (-D BVH_TRAVERSAL)
+#define BVH_STACK 0
+#define BVH_RESTART 1
+#define BVH_PAIRS 2
+#define SHORT_STACK 4
+#define TRAIL_TOP ((cl_ulong)1 << 63)
+#define RESTART_MAX_DEPTH 64 //one trail bit per inner level, deeper sbvhs fall back to BVH_STACK
+#define BVH_STACK_MIN 32 //private stack entries, more when the tree is deeper (see bvh_stack_size)
+
+//BVH_PAIRS node (Aila & Laine 2009): both children's bounds in the parent, 64 bytes read as 4 float4s.
+//a child is a pair node index, or ~first ref for a leaf, with its ref count next to it
+typedef struct s_gpu_pair_node
+{
+	cl_float lminx;
+	cl_float lmaxx;
+	cl_float lminy;
+	cl_float lmaxy;
+	cl_float rminx;
+	cl_float rmaxx;
+	cl_float rminy;
+	cl_float rmaxy;
+	cl_float lminz;
+	cl_float lmaxz;
+	cl_float rminz;
+	cl_float rmaxz;
+	cl_int left;
+	cl_int right;
+	cl_int lcount; //leaves only
+	cl_int rcount;
+}				gpu_pair_node;
+
+typedef struct s_gpu_kd_node
+{
+	cl_float minx;
+	cl_float miny;
+	cl_float minz;
+	cl_int axis; //-1 for leaves
+	cl_float maxx;
+	cl_float maxy;
+	cl_float maxz;
+	cl_float split;
+	cl_int left; //leaves: first ref
+	cl_int right; //leaves: ref count
+	cl_int ropes[6]; //neighbor across -x +x -y +y -z +z, -1 leaves the scene
+}				gpu_kd_node;
+
+typedef struct s_gpu_grid
+{
+	cl_float minx;
+	cl_float miny;
+	cl_float minz;
+	cl_int resx;
+	cl_float maxx;
+	cl_float maxy;
+	cl_float maxz;
+	cl_int resy;
+	cl_int resz;
+	cl_int top_count;
+	cl_int sub_count;
+	cl_int cell_count;
+}				gpu_grid;
+
+typedef struct s_gpu_grid_cell
+{
+	cl_int start; //first ref, or subgrid index when count is -1
+	cl_int count;
+}				gpu_grid_cell;
+
+typedef struct s_gpu_subgrid
+{
+	cl_int resx;
+	cl_int resy;
+	cl_int resz;
+	cl_int first_cell;
+}				gpu_subgrid;
+
+typedef struct s_accel
+{
+	int type; //ACCEL_BVH, ACCEL_KD, ACCEL_GRID
+	int traversal; //BVH_STACK, BVH_RESTART or BVH_PAIRS (nodes are gpu_pair_nodes then), bvh only
+	int depth; //edges from the root to the deepest leaf, bvh only (bins_depth)
+	void *nodes; //flat nodes exactly as they go to the gpu
+	size_t node_size; //bytes
+	int node_count;
+	cl_int *refs; //face indices referenced by leaves or cells
+	int ref_count;
+	double build_time;
+	int quantized; //-quantize, bvh only: quant replaces W on the device (see quantize.c)
+	cl_float *quant;
+	size_t quant_size; //bytes
+	int inlined; //-inline, bvh only: leaf triangles sit behind their node in nodes (see inline_accel)
+}				Accel;
+
 typedef struct bvh_struct
 {
 	cl_float3 min; //spatial boundary
@@ -169,6 +346,9 @@ typedef struct s_AABB
 	int start_ind;
 	int member_count;
 	int flat_ind;
+	int pending; //LAZY_DONE, LAZY_PENDING or LAZY_BUILDING, only the lazy builder uses it
+	int visits; //profile counts, filled in by profile_bvh
+	int hits;
 
 	Face *f;
 }				AABB;
@@ -179,8 +359,17 @@ typedef struct s_new_scene
 	int mat_count;
 	Face *faces;
 	int face_count;
+	cl_int *refs; //face indices for each leaf reference, in leaf order
+	int ref_count;
 	AABB *bins;
 	int bin_count;
+	Accel *accel;
+	int render_mode; //one of RENDER_*
+	int tex_compress; //-compress: BC1/BC4 blocks in the packed texture buffer
+	int max_bounces; //-bounces n: hard cap on path length, 0 leaves it to russian roulette
+	int pixel_order; //PIXEL_TILED, or PIXEL_LINEAR with -linear
+	cl_uint *omm; //OMM_STATE_WORDS per alpha tested face, from classify_opacity
+	int omm_count;
 }				Scene;
 
 typedef struct s_gpu_context
@@ -189,6 +378,7 @@ typedef struct s_gpu_context
 	cl_command_queue *commands;
 	cl_program *programs;
 	cl_uint numPlatforms;
+	int tex_images; //textures as an image2d_array (-D TEX_IMAGES=1) instead of the packed buffer
 	cl_uint numDevices;
 	cl_platform_id *platform;
 }				gpu_context;
@@ -203,35 +393,47 @@ typedef struct s_gpu_mat
 	cl_int diff_ind;
 	cl_int diff_h;
 	cl_int diff_w;
+	cl_int diff_format;
 
 	cl_int spec_ind;
 	cl_int spec_h;
 	cl_int spec_w;
+	cl_int spec_format;
 
 	cl_int bump_ind;
 	cl_int bump_h;
 	cl_int bump_w;
+	cl_int bump_format;
 
 	cl_int trans_ind;
 	cl_int trans_h;
 	cl_int trans_w;
+	cl_int trans_format;
 }				gpu_mat;
 
 typedef struct s_gpu_scene
 {
-	cl_float3 *V;
-	cl_float3 *T;
-	cl_float3 *N;
-	cl_int *M;
-	cl_float3 *TN;
-	cl_float3 *BTN;
+	cl_uint *A; //hit attribute records, ATTR_STRIDE uints per device triangle (quads are two)
 	cl_uint tri_count;
-
-	gpu_bin *bins;
-	cl_uint bin_count;
-
-	cl_uchar *tex;
-	cl_uint tex_size;
+	cl_float *W; //intersection records, 9 packed floats per device triangle, or the -quantize blob
+	size_t w_size; //bytes
+	cl_float3 lo; //scene bounds
+	cl_float3 hi;
+
+	cl_int *I;
+	cl_uint ref_count;
+	cl_uint *O; //opacity records, OMM_STRIDE uints per alpha tested face
+	cl_uint omm_count;
+
+	void *nodes; //gpu_bin, gpu_kd_node or grid blob, see accel
+	size_t node_size;
+	cl_int accel;
+
+	cl_uchar *tex; //packed mip chains (TEX_* per map), or tex_layers RGBA8 mip atlases (level 0 is tex_w * tex_h) when the device takes images
+	size_t tex_size; //bytes
+	cl_int tex_w;
+	cl_int tex_h;
+	cl_int tex_layers;
 
 	gpu_mat *mats;
 	cl_uint mat_count;
@@ -244,13 +446,52 @@ typedef struct s_gpu_scene
 
 AABB *sbvh(Face *faces, int *box_count, int *ref_count);
 void study_tree(AABB *tree, int ray_count);
+AABB *sbvh_lazy(Face *faces, int top_levels, int threads);
+void lazy_expand(AABB *box);
+int lazy_finish(AABB *root, int *box_count, int *ref_count);
+void study_lazy(Scene *scene, int ray_count);
+int sbvh_rebuild_hot(AABB *root, int *box_count, int *ref_count);
+void sbvh_order_by_profile(AABB *box);
+void profile_rebuild(Scene *scene, t_camera cam, int xres, int yres);
 void flatten_faces(Scene *scene);
 gpu_bin *flatten_bvh(Scene *scene);
+gpu_bin *flatten_bvh_profiled(Scene *scene);
 float area(AABB *box);
 
+gpu_kd_node *kd_build(Face *faces, int face_count, int *node_count, cl_int **refs, int *ref_count);
+void *grid_build(Face *faces, int face_count, size_t *size, cl_int **refs, int *ref_count);
+Accel *build_accel(Scene *scene, int type);
+void free_accel(Accel *accel);
+void pair_accel(Accel *accel);
+int bins_depth(gpu_bin *bins, int node_count);
+int bvh_stack_size(int depth);
+cl_float4 *inline_blob(Scene *scene, gpu_bin *bins, cl_int *refs, int node_count, size_t *size);
+void inline_accel(Scene *scene, Accel *accel);
+const char *accel_name(int type);
+void quantize_accel(Scene *scene, Accel *accel);
+void classify_opacity(Scene *scene);
+Accel *study_accels(Scene *scene, int ray_count);
+
+//SAH cost calibration
+#define SAH_PROFILE "sah.profile"
+#define CALIBRATE_CPU 0
+#define CALIBRATE_GPU 1
+int sah_costs(float *trav, float *isect);
+void calibrate(int device);
+void calibrate_cpu(double *box_ns, double *tri_ns);
+int gpu_calibrate(double *box_ns, double *tri_ns);
+double gpu_occlusion(Scene *S, Accel *accel, cl_float4 *rays, int ray_count, cl_int *hits, cl_uint *counts);
+double wall_clock(void);
+
 
 Face *ply_import(char *ply_file);
 Face *object_flatten(Face *faces, int *face_count);
+Face quad_half(Face *f, int half);
+void split_quads(Scene *scene);
+void face_bounds(Face *f, cl_float3 *min, cl_float3 *max);
+float quad_slack(Face *f);
+int count_shape(Scene *scene, int shape);
+void scatter_spheres(Scene *scene, int count);
 
 ////Old stuff
 void draw_pixels(void *img, int xres, int yres, cl_double3 *pixels);
@@ -27,4 +27,113 @@ Face *object_flatten(Face *faces, int *face_count)
 	return flat;
 }
 
-//also want a scene_flatten function
\ No newline at end of file
+//also want a scene_flatten function
+
+Face quad_half(Face *f, int half)
+{
+	//triangle half of a quad as the device sees it: (a, b, c) or (a, c, d). a triangle is its own half 0
+	if (f->shape != GPU_QUAD)
+		return *f;
+	Face t = *f;
+	t.shape = GPU_TRIANGLE;
+	if (half)
+	{
+		t.verts[1] = f->verts[2];
+		t.verts[2] = f->verts[3];
+		t.norms[1] = f->norms[2];
+		t.norms[2] = f->norms[3];
+		t.tex[1] = f->tex[2];
+		t.tex[2] = f->tex[3];
+	}
+	t.center = vec_scale(vec_add(vec_add(t.verts[0], t.verts[1]), t.verts[2]), 1.0f / 3.0f);
+	return t;
+}
+
+void face_bounds(Face *f, cl_float3 *min, cl_float3 *max)
+{
+	if (f->shape == GPU_SPHERE)
+	{
+		float r = f->verts[1].x;
+		*min = vec_sub(f->verts[0], (cl_float3){r, r, r});
+		*max = vec_add(f->verts[0], (cl_float3){r, r, r});
+		return;
+	}
+	*min = f->verts[0];
+	*max = f->verts[0];
+	for (int i = 1; i < f->shape; i++)
+	{
+		*min = (cl_float3){fmin(min->x, f->verts[i].x), fmin(min->y, f->verts[i].y), fmin(min->z, f->verts[i].z)};
+		*max = (cl_float3){fmax(max->x, f->verts[i].x), fmax(max->y, f->verts[i].y), fmax(max->z, f->verts[i].z)};
+	}
+}
+
+float quad_slack(Face *f)
+{
+	//how far a quad's (a, c, d) half may be off the (a, b, c) plane, see QUAD_PLANAR. 0 for anything else
+	if (f->shape != GPU_QUAD)
+		return 0.0f;
+	cl_float3 ac = vec_sub(f->verts[2], f->verts[0]);
+	cl_float3 bd = vec_sub(f->verts[3], f->verts[1]);
+	return QUAD_PLANAR * fmax(sqrtf(dot(ac, ac)), sqrtf(dot(bd, bd)));
+}
+
+int count_shape(Scene *scene, int shape)
+{
+	int count = 0;
+	for (int i = 0; i < scene->face_count; i++)
+		count += scene->faces[i].shape == shape;
+	return count;
+}
+
+void scatter_spheres(Scene *scene, int count)
+{
+	//-spheres n: particle-like test load, n spheres of the first material spread through the scene's
+	//bounds, sized so they'd fill about a percent of its volume
+	cl_float3 lo = (cl_float3){FLT_MAX, FLT_MAX, FLT_MAX};
+	cl_float3 hi = (cl_float3){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int i = 0; i < scene->face_count; i++)
+	{
+		cl_float3 a, b;
+		face_bounds(&scene->faces[i], &a, &b);
+		lo = (cl_float3){fmin(lo.x, a.x), fmin(lo.y, a.y), fmin(lo.z, a.z)};
+		hi = (cl_float3){fmax(hi.x, b.x), fmax(hi.y, b.y), fmax(hi.z, b.z)};
+	}
+	if (!scene->face_count)
+	{
+		lo = (cl_float3){-1.0f, -1.0f, -1.0f};
+		hi = (cl_float3){1.0f, 1.0f, 1.0f};
+	}
+	cl_float3 span = vec_sub(hi, lo);
+	float r = cbrtf(0.01f * span.x * span.y * span.z * 3.0f / (4.0f * M_PI * (float)count));
+	scene->faces = realloc(scene->faces, (scene->face_count + count) * sizeof(Face));
+	for (int i = 0; i < count; i++)
+	{
+		Face f;
+		bzero(&f, sizeof(Face));
+		f.shape = GPU_SPHERE;
+		f.verts[0] = (cl_float3){lo.x + span.x * (float)rand() / RAND_MAX, lo.y + span.y * (float)rand() / RAND_MAX, lo.z + span.z * (float)rand() / RAND_MAX};
+		f.verts[1].x = r * (0.5f + (float)rand() / RAND_MAX);
+		f.center = f.verts[0];
+		f.mat_type = GPU_MAT_DIFFUSE;
+		f.alpha = -1;
+		scene->faces[scene->face_count++] = f;
+	}
+	printf("scattered %d spheres, radius around %g\n", count, r);
+}
+
+void split_quads(Scene *scene)
+{
+	//back to triangles only, for the layouts that store exactly one triangle per ref
+	int quads = count_shape(scene, GPU_QUAD);
+	if (!quads)
+		return;
+	Face *faces = calloc(scene->face_count + quads, sizeof(Face));
+	int count = 0;
+	for (int i = 0; i < scene->face_count; i++)
+		for (int h = 0; h < (scene->faces[i].shape == GPU_QUAD ? 2 : 1); h++)
+			faces[count++] = quad_half(&scene->faces[i], h);
+	printf("split %d quads back into triangles\n", quads);
+	free(scene->faces);
+	scene->faces = faces;
+	scene->face_count = count;
+}
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #define SPLIT_TEST_NUM 30
 #define LEAF_THRESHOLD 16
+#define SAH_LEAF_MIN 2
 
 #define ALPHA 0.0001f
 
@@ -66,16 +67,7 @@ AABB *box_from_points(cl_float3 *points, int pt_count)
 AABB *box_from_face(Face *face)
 {
 	AABB *box = empty_box();
-	for (int i = 0; i < face->shape; i++)
-	{
-		box->min.x = fmin(box->min.x, face->verts[i].x);
-		box->min.y = fmin(box->min.y, face->verts[i].y);
-		box->min.z = fmin(box->min.z, face->verts[i].z);
-
-		box->max.x = fmax(box->max.x, face->verts[i].x);
-		box->max.y = fmax(box->max.y, face->verts[i].y);
-		box->max.z = fmax(box->max.z, face->verts[i].z);
-	}
+	face_bounds(face, &box->min, &box->max);
 
 	box->f = face;
 	//calloced so everything else is already null like it should be.
@@ -412,7 +404,10 @@ float SAH(Split *split, AABB *parent)
 	return (SA(split->left_flex) * split->left_count + SA(split->right_flex) * split->right_count) / SA(parent);
 }
 
-#define SPLIT_SPOT ((float)i + 1.0f) / (SPLIT_TEST_NUM + 1.0f) 
+//candidates per axis sweep. the profiled rebuild raises this for hot subtrees
+static int split_test_num = SPLIT_TEST_NUM;
+
+#define SPLIT_SPOT ((float)i + 1.0f) / (split_test_num + 1.0f)
 
 Split **allocate_splits(AABB *box)
 {
@@ -421,9 +416,9 @@ Split **allocate_splits(AABB *box)
 	//print_vec(span);
 	//printf("x %.2f%% y %.2f%% z %.2f%%\n", 100.0f * span.x / spread, 100.0f * span.y / spread, 100.0f * span.z / spread);
 
-	Split **spatials = calloc(SPLIT_TEST_NUM, sizeof(Split *));
+	Split **spatials = calloc(split_test_num, sizeof(Split *));
 
-	for (int i = 0; i < SPLIT_TEST_NUM; i++)
+	for (int i = 0; i < split_test_num; i++)
 		if (SPLIT_SPOT * spread <= span.x)
 			spatials[i] = new_split(box, X_AXIS, SPLIT_SPOT * spread / span.x);
 		else if (SPLIT_SPOT * spread <= (span.y + span.x))
@@ -442,7 +437,7 @@ Split *best_spatial_split(AABB *box)
 	//for each member, "add" to each split (dont actually make copies)
 	int count = 0;
 	//printf("box->member_count %d\n", box->member_count);
-	for (int i = 0; i < SPLIT_TEST_NUM; i++)
+	for (int i = 0; i < split_test_num; i++)
 	{
 		for (AABB *b = box->members; b != NULL; b = b->next)
 			if (box_in_box(b, spatials[i]->left) && box_in_box(b, spatials[i]->right) && !all_in(b, spatials[i]->right) && !all_in(b, spatials[i]->left))
@@ -498,7 +493,7 @@ Split *best_spatial_split(AABB *box)
 
 	float min_SAH = FLT_MAX;
 	int min_ind = -1;
-	for (int i = 0; i < SPLIT_TEST_NUM - 1; i++)
+	for (int i = 0; i < split_test_num - 1; i++)
 	{
 		if (spatials[i]->left_count == 0 || spatials[i]->right_count == 0)
 			continue ;
@@ -512,7 +507,7 @@ Split *best_spatial_split(AABB *box)
 
 	//clean up
 	Split *winner = min_ind == -1 ? NULL : spatials[min_ind];
-	for (int i = 0; i < SPLIT_TEST_NUM - 1; i++)
+	for (int i = 0; i < split_test_num - 1; i++)
 		if (i == min_ind)
 			continue;
 		else
@@ -602,8 +597,8 @@ Split *best_object_split(AABB *box)
 	// printf("%d\n", box->member_count);
 
 	//alloc blank splits
-	Split **objects = calloc(SPLIT_TEST_NUM, sizeof(Split *));
-	for (int i = 0; i < SPLIT_TEST_NUM; i++)
+	Split **objects = calloc(split_test_num, sizeof(Split *));
+	for (int i = 0; i < split_test_num; i++)
 	{
 		objects[i] = calloc(1, sizeof(Split));
 		objects[i]->left_flex = empty_box();
@@ -623,10 +618,10 @@ Split *best_object_split(AABB *box)
 	// printf("sorted x\n");
 
 	for (int i = 0; i < box->member_count; i++)
-		for (int j = 0; j < SPLIT_TEST_NUM / 3; j++)
+		for (int j = 0; j < split_test_num / 3; j++)
 		{
 			cl_float3 c = center(members[i]);
-			if ((float)i / (float)box->member_count < (float)(j + 1) / (float)(SPLIT_TEST_NUM / 3 + 1) || c.x == objects[j]->left->max.x)
+			if ((float)i / (float)box->member_count < (float)(j + 1) / (float)(split_test_num / 3 + 1) || c.x == objects[j]->left->max.x)
 			{
 				flex_box(objects[j]->left_flex, members[i]);
 				objects[j]->left_count++;
@@ -643,19 +638,19 @@ Split *best_object_split(AABB *box)
 	// printf("sorted y\n");
 
 	for (int i = 0; i < box->member_count; i++)
-		for (int j = 0; j < SPLIT_TEST_NUM / 3; j++)
+		for (int j = 0; j < split_test_num / 3; j++)
 		{
 			cl_float3 c = center(members[i]);
-			if ((float)i / (float)box->member_count < (float)(j + 1) / (float)(SPLIT_TEST_NUM / 3 + 1) || c.y == objects[j + SPLIT_TEST_NUM / 3]->left->max.y)
+			if ((float)i / (float)box->member_count < (float)(j + 1) / (float)(split_test_num / 3 + 1) || c.y == objects[j + split_test_num / 3]->left->max.y)
 			{
-				flex_box(objects[j + SPLIT_TEST_NUM / 3]->left_flex, members[i]);
-				objects[j + SPLIT_TEST_NUM / 3]->left_count++;
-				objects[j + SPLIT_TEST_NUM / 3]->left->max.y = c.y;
+				flex_box(objects[j + split_test_num / 3]->left_flex, members[i]);
+				objects[j + split_test_num / 3]->left_count++;
+				objects[j + split_test_num / 3]->left->max.y = c.y;
 			}
 			else
 			{
-				flex_box(objects[j + SPLIT_TEST_NUM / 3]->right_flex, members[i]);
-				objects[j + SPLIT_TEST_NUM / 3]->right_count++;
+				flex_box(objects[j + split_test_num / 3]->right_flex, members[i]);
+				objects[j + split_test_num / 3]->right_count++;
 			}
 		}
 
@@ -663,19 +658,19 @@ Split *best_object_split(AABB *box)
 	// printf("sorted z\n");
 
 	for (int i = 0; i < box->member_count; i++)
-		for (int j = 0; j < SPLIT_TEST_NUM / 3; j++)
+		for (int j = 0; j < split_test_num / 3; j++)
 		{
 			cl_float3 c = center(members[i]);
-			if ((float)i / (float)box->member_count < (float)(j + 1) / (float)(SPLIT_TEST_NUM / 3 + 1) || c.z == objects[j + 2 * SPLIT_TEST_NUM / 3]->left->max.z)
+			if ((float)i / (float)box->member_count < (float)(j + 1) / (float)(split_test_num / 3 + 1) || c.z == objects[j + 2 * split_test_num / 3]->left->max.z)
 			{
-				flex_box(objects[j + 2 * SPLIT_TEST_NUM / 3]->left_flex, members[i]);
-				objects[j + 2 * SPLIT_TEST_NUM / 3]->left_count++;
-				objects[j + 2 * SPLIT_TEST_NUM / 3]->left->max.z = c.z;
+				flex_box(objects[j + 2 * split_test_num / 3]->left_flex, members[i]);
+				objects[j + 2 * split_test_num / 3]->left_count++;
+				objects[j + 2 * split_test_num / 3]->left->max.z = c.z;
 			}
 			else
 			{
-				flex_box(objects[j + 2 * SPLIT_TEST_NUM / 3]->right_flex, members[i]);
-				objects[j + 2 * SPLIT_TEST_NUM / 3]->right_count++;
+				flex_box(objects[j + 2 * split_test_num / 3]->right_flex, members[i]);
+				objects[j + 2 * split_test_num / 3]->right_count++;
 			}
 		}
 	//measure and choose best split
@@ -684,7 +679,7 @@ Split *best_object_split(AABB *box)
 
 	float min_SAH = FLT_MAX;
 	int min_ind = -1;
-	for (int i = 0; i < SPLIT_TEST_NUM - 1; i++)
+	for (int i = 0; i < split_test_num - 1; i++)
 	{
 		if (objects[i]->left_count == 0 || objects[i]->right_count == 0)
 			continue ;
@@ -698,7 +693,7 @@ Split *best_object_split(AABB *box)
 
 	//clean up
 	Split *winner = min_ind == -1 ? NULL : objects[min_ind];
-	for (int i = 0; i < SPLIT_TEST_NUM - 1; i++)
+	for (int i = 0; i < split_test_num - 1; i++)
 		if (i == min_ind)
 			continue;
 		else
@@ -713,6 +708,21 @@ int object_wins;
 
 float root_SA;
 
+//with a calibration profile (see calibrate.c) leaves stop at whatever size the measured
+//box/triangle costs say, instead of the fixed LEAF_THRESHOLD
+static int sah_calibrated;
+static float sah_trav;
+static float sah_isect;
+static int leaf_threshold = LEAF_THRESHOLD;
+
+static void load_costs(void)
+{
+	sah_calibrated = sah_costs(&sah_trav, &sah_isect);
+	leaf_threshold = sah_calibrated ? SAH_LEAF_MIN : LEAF_THRESHOLD;
+	if (sah_calibrated)
+		printf("sbvh using calibrated costs: traversal %.2f, intersection %.2f\n", sah_trav, sah_isect);
+}
+
 float SA_overlap(Split *split)
 {
 	AABB *L = split->left_flex;
@@ -753,7 +763,19 @@ void partition(AABB *box)
 		printf("bailing out!\n");
 		return;
 	}
-	else if (spatial == NULL || (object != NULL && SAH(object, box) < SAH(spatial, box)))
+
+	Split *best = (spatial == NULL || (object != NULL && SAH(object, box) < SAH(spatial, box))) ? object : spatial;
+	if (sah_calibrated && sah_trav + sah_isect * SAH(best, box) >= sah_isect * box->member_count)
+	{
+		//cheaper to test everything here than to descend, stays a leaf
+		if (object)
+			free_split(object);
+		if (spatial)
+			free_split(spatial);
+		return;
+	}
+
+	if (best == object)
 	{
 		//printf("OBJECT, children are %.2f%% of parent area\n", 100.0f * (area(object->left_flex) + area(object->right_flex)) / area(box));
 		//printf("doing the object split\n");
@@ -864,6 +886,7 @@ AABB *sbvh(Face *faces, int *box_count, int *refs)
 	AABB *root_box = box_from_boxes(boxes);
 
 	root_SA = SA(root_box);
+	load_costs();
 
 	printf("root box made\n");
 	print_vec(root_box->min);
@@ -884,19 +907,19 @@ AABB *sbvh(Face *faces, int *box_count, int *refs)
 			box->left->parent = box;
 			box->right->parent = box;
 			count += 2;
-			if (box->left->member_count > LEAF_THRESHOLD)
+			if (box->left->member_count > leaf_threshold)
 				push(&stack, box->left);
 			else
 				ref_count += box->left->member_count;
-			if (box->right->member_count > LEAF_THRESHOLD)
+			if (box->right->member_count > leaf_threshold)
 				push(&stack, box->right);
 			else
 				ref_count += box->right->member_count;
 		}
 		else
 		{
-			// printf("failed to split this box\n");
-			// print_box(box);
+			//didn't split, it's a leaf after all
+			ref_count += box->member_count;
 		}
 	}
 	printf("done?? %d boxes?", count);
@@ -908,18 +931,376 @@ AABB *sbvh(Face *faces, int *box_count, int *refs)
 	return root_box;
 }
 
+///////LAZY SECTION//////////
+//top levels are built up front, everything deeper is left pending with its members attached.
+//pending nodes get LAZY_STEP more levels when a ray reaches them (lazy_expand) or when a
+//background worker gets to them first. new pending nodes go back on the queue.
+
+#define LAZY_STEP 4
+
+typedef struct s_lazy_queue
+{
+	AABB **nodes;
+	int head;
+	int tail;
+	int cap;
+	int active; //expansions in progress, they may still add pending nodes
+	int on_demand; //expansions triggered by rays rather than workers
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *workers;
+	int worker_count;
+}				LazyQueue;
+
+static LazyQueue lazy;
+
+static void lazy_enqueue(AABB *box)
+{
+	//caller holds lazy.lock
+	if (lazy.tail == lazy.cap)
+	{
+		lazy.cap = lazy.cap ? lazy.cap * 2 : 1024;
+		lazy.nodes = realloc(lazy.nodes, lazy.cap * sizeof(AABB *));
+	}
+	lazy.nodes[lazy.tail++] = box;
+}
+
+static void build_levels(AABB *top, int levels)
+{
+	//same loop as sbvh(), but nodes more than levels below top are left pending
+	AABB *stack[256];
+	int depths[256];
+	int s_i = 0;
+	stack[s_i] = top;
+	depths[s_i++] = 0;
+
+	while (s_i)
+	{
+		AABB *box = stack[--s_i];
+		int d = depths[s_i];
+		if (d >= levels || s_i >= 254)
+		{
+			pthread_mutex_lock(&lazy.lock);
+			box->pending = LAZY_PENDING;
+			lazy_enqueue(box);
+			pthread_cond_broadcast(&lazy.cond);
+			pthread_mutex_unlock(&lazy.lock);
+			continue;
+		}
+		partition(box);
+		if (!box->left)
+			continue;
+		box->left->parent = box;
+		box->right->parent = box;
+		if (box->left->member_count > leaf_threshold)
+		{
+			stack[s_i] = box->left;
+			depths[s_i++] = d + 1;
+		}
+		if (box->right->member_count > leaf_threshold)
+		{
+			stack[s_i] = box->right;
+			depths[s_i++] = d + 1;
+		}
+	}
+}
+
+static int lazy_claim(AABB *box)
+{
+	//1 if this thread gets to build box. otherwise waits until whoever has it is done
+	int claimed = 0;
+	pthread_mutex_lock(&lazy.lock);
+	while (box->pending == LAZY_BUILDING)
+		pthread_cond_wait(&lazy.cond, &lazy.lock);
+	if (box->pending == LAZY_PENDING)
+	{
+		box->pending = LAZY_BUILDING;
+		lazy.active++;
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&lazy.lock);
+	return claimed;
+}
+
+static void lazy_publish(AABB *box)
+{
+	pthread_mutex_lock(&lazy.lock);
+	__atomic_store_n(&box->pending, LAZY_DONE, __ATOMIC_RELEASE);
+	lazy.active--;
+	pthread_cond_broadcast(&lazy.cond);
+	pthread_mutex_unlock(&lazy.lock);
+}
+
+void lazy_expand(AABB *box)
+{
+	//called by traversal on a node that isn't LAZY_DONE. returns once it has children (or is a leaf)
+	if (!lazy_claim(box))
+		return;
+	__atomic_add_fetch(&lazy.on_demand, 1, __ATOMIC_RELAXED);
+	build_levels(box, LAZY_STEP);
+	lazy_publish(box);
+}
+
+static void *lazy_worker(void *arg)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&lazy.lock);
+		while (lazy.head == lazy.tail && lazy.active > 0)
+			pthread_cond_wait(&lazy.cond, &lazy.lock);
+		if (lazy.head == lazy.tail)
+		{
+			pthread_mutex_unlock(&lazy.lock);
+			return NULL;
+		}
+		AABB *box = lazy.nodes[lazy.head++];
+		pthread_mutex_unlock(&lazy.lock);
+
+		if (lazy_claim(box))
+		{
+			build_levels(box, LAZY_STEP);
+			lazy_publish(box);
+		}
+	}
+}
+
+AABB *sbvh_lazy(Face *faces, int top_levels, int threads)
+{
+	//returns as soon as the top levels exist, workers keep refining until lazy_finish
+	AABB *boxes = NULL;
+	for (Face *f = faces; f; f = f->next)
+		push(&boxes, box_from_face(f));
+	AABB *root_box = box_from_boxes(boxes);
+	root_SA = SA(root_box);
+	load_costs();
+
+	free(lazy.nodes);
+	bzero(&lazy, sizeof(LazyQueue));
+	pthread_mutex_init(&lazy.lock, NULL);
+	pthread_cond_init(&lazy.cond, NULL);
+
+	if (root_box->member_count > leaf_threshold)
+		build_levels(root_box, top_levels);
+	printf("lazy sbvh: top %d levels built, %d subtrees pending\n", top_levels, lazy.tail);
+
+	lazy.worker_count = threads;
+	lazy.workers = calloc(threads, sizeof(pthread_t));
+	for (int i = 0; i < threads; i++)
+		pthread_create(&lazy.workers[i], NULL, lazy_worker, NULL);
+	return root_box;
+}
+
+int lazy_finish(AABB *root, int *box_count, int *ref_count)
+{
+	//wait for the workers, then count the finished tree like sbvh() would have. returns on-demand expansions
+	for (int i = 0; i < lazy.worker_count; i++)
+		pthread_join(lazy.workers[i], NULL);
+	free(lazy.workers);
+	lazy.workers = NULL;
+	lazy.worker_count = 0;
+
+	//anything still pending (no workers were running) gets built here
+	AABB *stack[256];
+	int s_i = 0;
+	int count = 0;
+	int refs = 0;
+	stack[s_i++] = root;
+	while (s_i)
+	{
+		AABB *box = stack[--s_i];
+		if (box->pending != LAZY_DONE)
+			lazy_expand(box);
+		count++;
+		if (box->left)
+		{
+			stack[s_i++] = box->left;
+			stack[s_i++] = box->right;
+		}
+		else
+			refs += box->member_count;
+	}
+	*box_count = count;
+	*ref_count = refs;
+	return lazy.on_demand;
+}
+
+///////PROFILE SECTION//////////
+//the lab counts visits and hits per node while tracing camera paths (profile_bvh).
+//hot subtrees get collapsed and rebuilt with more split candidates and smaller leaves,
+//and children get ordered so the one rays reach more often comes first.
+
+#define HOT_SHARE 0.02f
+#define HOT_MAX_REFS 4096
+#define HOT_SPLIT_TEST_NUM 90
+#define HOT_LEAF_THRESHOLD 4
+
+static int subtree_refs(AABB *box)
+{
+	if (!box->left)
+		return box->member_count;
+	return subtree_refs(box->left) + subtree_refs(box->right);
+}
+
+static void collapse(AABB *box, AABB *top)
+{
+	//move every leaf reference under top back into top->members, free the nodes in between
+	if (box->left)
+	{
+		collapse(box->left, top);
+		collapse(box->right, top);
+	}
+	else
+		for (AABB *m = box->members; m;)
+		{
+			AABB *tmp = m->next;
+			push(&top->members, m);
+			top->member_count++;
+			m = tmp;
+		}
+	if (box != top)
+		free(box);
+}
+
+static int face_order(const void *a, const void *b)
+{
+	uintptr_t fa = (uintptr_t)*(Face **)a;
+	uintptr_t fb = (uintptr_t)*(Face **)b;
+	return (fa > fb) - (fa < fb);
+}
+
+static void unique_members(AABB *top)
+{
+	//a face that got split further up comes back as several clipped fragments, maybe in the same leaf.
+	//the rebuild starts over from one box per face, cut down to top so the subtree stays inside it
+	Face **faces = malloc(top->member_count * sizeof(Face *));
+	int n = 0;
+	for (AABB *m = top->members; m;)
+	{
+		AABB *tmp = m->next;
+		faces[n++] = m->f;
+		free(m);
+		m = tmp;
+	}
+	qsort(faces, n, sizeof(Face *), face_order);
+	top->members = NULL;
+	top->member_count = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (i && faces[i] == faces[i - 1])
+			continue;
+		AABB *b = box_from_face(faces[i]);
+		b->min = (cl_float3){fmax(b->min.x, top->min.x), fmax(b->min.y, top->min.y), fmax(b->min.z, top->min.z)};
+		b->max = (cl_float3){fmin(b->max.x, top->max.x), fmin(b->max.y, top->max.y), fmin(b->max.z, top->max.z)};
+		push(&top->members, b);
+		top->member_count++;
+	}
+	free(faces);
+}
+
+static void rebuild_subtree(AABB *top)
+{
+	if (top->left)
+	{
+		AABB *left = top->left;
+		AABB *right = top->right;
+		top->left = NULL;
+		top->right = NULL;
+		top->members = NULL;
+		top->member_count = 0;
+		collapse(left, top);
+		collapse(right, top);
+	}
+	unique_members(top);
+
+	split_test_num = HOT_SPLIT_TEST_NUM;
+	top->next = NULL;
+	AABB *stack = top;
+	while (stack)
+	{
+		AABB *box = pop(&stack);
+		partition(box);
+		if (!box->left)
+			continue;
+		box->left->parent = box;
+		box->right->parent = box;
+		if (box->left->member_count > HOT_LEAF_THRESHOLD)
+			push(&stack, box->left);
+		if (box->right->member_count > HOT_LEAF_THRESHOLD)
+			push(&stack, box->right);
+	}
+	split_test_num = SPLIT_TEST_NUM;
+}
+
+static int rebuild_hot(AABB *box, int min_hits)
+{
+	if (box->hits < min_hits)
+		return 0;
+	if (!box->left)
+	{
+		if (box->member_count <= HOT_LEAF_THRESHOLD)
+			return 0;
+		rebuild_subtree(box);
+		return 1;
+	}
+	if (subtree_refs(box) <= HOT_MAX_REFS)
+	{
+		rebuild_subtree(box);
+		return 1;
+	}
+	return rebuild_hot(box->left, min_hits) + rebuild_hot(box->right, min_hits);
+}
+
+static void count_tree(AABB *box, int *box_count, int *ref_count)
+{
+	(*box_count)++;
+	if (box->left)
+	{
+		count_tree(box->left, box_count, ref_count);
+		count_tree(box->right, box_count, ref_count);
+	}
+	else
+		*ref_count += box->member_count;
+}
+
+int sbvh_rebuild_hot(AABB *root, int *box_count, int *ref_count)
+{
+	//needs counts from profile_bvh. returns how many subtrees got rebuilt
+	root_SA = SA(root);
+	int rebuilt = rebuild_hot(root, (int)(HOT_SHARE * (float)root->hits));
+	*box_count = 0;
+	*ref_count = 0;
+	count_tree(root, box_count, ref_count);
+	return rebuilt;
+}
+
+void sbvh_order_by_profile(AABB *box)
+{
+	//hotter child goes left, so flatten_bvh_profiled puts it right after its parent
+	if (!box->left)
+		return;
+	if (box->right->hits > box->left->hits)
+	{
+		AABB *tmp = box->left;
+		box->left = box->right;
+		box->right = tmp;
+	}
+	sbvh_order_by_profile(box->left);
+	sbvh_order_by_profile(box->right);
+}
+
 ///////FLATTENING SECTION//////////
 
 void flatten_faces(Scene *scene)
 {
-	//make array of Faces that's ref_count big
-	Face *faces = calloc(scene->face_count, sizeof(Face));
-	int face_ind = 0;
+	//make array of face indices that's ref_count big. faces stay unique in scene->faces,
+	//so a duplicated reference costs one index instead of a whole Face
+	cl_int *refs = calloc(scene->ref_count, sizeof(cl_int));
+	int ref_ind = 0;
 	//traverse tree, finding leaf nodes
 	scene->bins->next = NULL;
 	AABB *stack = scene->bins;
 	AABB *box = NULL;
-	//populate face array with faces in leaf nodes
+	//populate ref array with indices of faces in leaf nodes
 	while (stack)
 	{
 		box = pop(&stack);
@@ -930,14 +1311,15 @@ void flatten_faces(Scene *scene)
 		}
 		else
 		{
-			box->start_ind = face_ind;
+			box->start_ind = ref_ind;
 			for (AABB *node = box->members; node; node = node->next)
-				memcpy(&faces[face_ind++], node->f, sizeof(Face));
+				refs[ref_ind++] = node->f - scene->faces;
 		}
 			
 	}
 
-	scene->faces = faces;
+	printf("%d refs to %d unique faces\n", ref_ind, scene->face_count);
+	scene->refs = refs;
 }
 
 // typedef struct s_gpu_bin
@@ -966,13 +1348,17 @@ gpu_bin bin_from_box(AABB *box)
 
 	if (box->left)
 	{
-		bin.lind = box->left->flat_ind;
+		//split axis is wherever the child centers are furthest apart
+		cl_float3 d = vec_sub(center(box->right), center(box->left));
+		int axis = fabs(d.x) >= fabs(d.y) && fabs(d.x) >= fabs(d.z) ? X_AXIS : (fabs(d.y) >= fabs(d.z) ? Y_AXIS : Z_AXIS);
+		float along = axis == X_AXIS ? d.x : (axis == Y_AXIS ? d.y : d.z);
+		bin.lind = box->left->flat_ind | (axis << BIN_AXIS_SHIFT) | (along < 0.0f ? BIN_FLIP : 0);
 		bin.rind = box->right->flat_ind;
 	}
 	else
 	{
-		bin.lind = -3 * box->start_ind;
-		bin.rind = -3 * box->member_count;
+		bin.lind = -1 * box->start_ind;
+		bin.rind = -1 * box->member_count;
 	}
 
 	return bin;
@@ -1028,4 +1414,35 @@ gpu_bin *flatten_bvh(Scene *scene)
 	// 	printf("%d, L %d R %d\n", i, bins[i].lind, bins[i].rind);
 
 	return bins;
-}
\ No newline at end of file
+}
+static void number_depth_first(AABB *box, int *bin_ind)
+{
+	box->flat_ind = (*bin_ind)++;
+	if (box->left)
+	{
+		number_depth_first(box->left, bin_ind);
+		number_depth_first(box->right, bin_ind);
+	}
+}
+
+static void fill_bins(gpu_bin *bins, AABB *box)
+{
+	bins[box->flat_ind] = bin_from_box(box);
+	if (box->left)
+	{
+		fill_bins(bins, box->left);
+		fill_bins(bins, box->right);
+	}
+}
+
+gpu_bin *flatten_bvh_profiled(Scene *scene)
+{
+	//depth first instead of breadth first, so after sbvh_order_by_profile the hot path
+	//down the tree is (mostly) contiguous in memory
+	gpu_bin *bins = calloc(scene->bin_count, sizeof(gpu_bin));
+	int bin_ind = 0;
+	number_depth_first(scene->bins, &bin_ind);
+	printf("bin_ind got to %d, should equal %d\n", bin_ind, scene->bin_count);
+	fill_bins(bins, scene->bins);
+	return bins;
+}